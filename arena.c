@@ -0,0 +1,304 @@
+/*
+ * arena.c
+ *
+ * Run arena and slab caches
+ */
+
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/**
+ * Everything we hand out is aligned to this
+ */
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/**
+ * What we keep in front of each allocation
+ */
+struct arena_hdr {
+    size_t size;
+    struct arena_block *block;
+};
+
+#define BLOCK_HDR_SIZE ARENA_ROUND(sizeof(struct arena_block))
+#define ALLOC_HDR_SIZE ARENA_ROUND(sizeof(struct arena_hdr))
+
+#define BLOCK_DATA(b) ((char*)(b) + BLOCK_HDR_SIZE)
+#define ALLOC_HDR(p)  ((struct arena_hdr*)((char*)(p) - ALLOC_HDR_SIZE))
+
+/**
+ * A thread's cache of objects for one of our slab caches: objects it can
+ * allocate, and a batch it has freed which it will give back all at once
+ */
+struct slab_mag {
+    struct slab_cache *slab;
+    void *head;
+    void *batch, *batch_tail;
+    unsigned int batch_len;
+};
+
+static __thread struct slab_mag g_mags[SLAB_CACHES_MAX];
+static unsigned int g_slab_ids;
+
+// The next object in a free list is kept in the object itself
+#define OBJ_NEXT(o) (*(void**)(o))
+
+// Add a block to our list
+static void block_link(struct arena *arena, struct arena_block *block) {
+    block->prev = NULL;
+    block->next = arena->blocks;
+    if(arena->blocks) {
+        arena->blocks->prev = block;
+    }
+    arena->blocks = block;
+}
+
+// Take a block out of our list
+static void block_unlink(struct arena *arena, struct arena_block *block) {
+    if(block->prev) {
+        block->prev->next = block->next;
+    } else {
+        arena->blocks = block->next;
+    }
+    if(block->next) {
+        block->next->prev = block->prev;
+    }
+}
+
+void arena_init(struct arena *arena) {
+    memset(arena, 0, sizeof(struct arena));
+    pthread_mutex_init(&arena->mutex, NULL);
+}
+
+// Allocate with our lock held
+static void *arena_alloc_locked(struct arena *arena, size_t size) {
+    struct arena_block *block;
+    struct arena_hdr *hdr;
+    size_t need = ALLOC_HDR_SIZE + ARENA_ROUND(size);
+
+    if(size > ARENA_LARGE_SIZE) {
+        // Big allocations get a block to themselves
+        if(!(block = malloc(BLOCK_HDR_SIZE + need))) {
+            return NULL;
+        }
+        block->size = block->used = need;
+        block->large = 1;
+        block_link(arena, block);
+    } else {
+        // Otherwise carve it out of our current block, starting a new one
+        // if it's full
+        if(!arena->cur || arena->cur->size - arena->cur->used < need) {
+            if(!(block = malloc(BLOCK_HDR_SIZE + ARENA_BLOCK_SIZE))) {
+                return NULL;
+            }
+            block->size = ARENA_BLOCK_SIZE;
+            block->used = 0;
+            block->large = 0;
+            block_link(arena, block);
+            arena->cur = block;
+        }
+
+        block = arena->cur;
+    }
+
+    hdr = (struct arena_hdr*)(BLOCK_DATA(block) + (block->large ? 0 : block->used));
+    hdr->size = size;
+    hdr->block = block;
+
+    if(!block->large) {
+        block->used += need;
+        arena->last = (char*)hdr + ALLOC_HDR_SIZE;
+    }
+
+    return (char*)hdr + ALLOC_HDR_SIZE;
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+    void *ptr;
+
+    pthread_mutex_lock(&arena->mutex);
+    ptr = arena_alloc_locked(arena, size);
+    pthread_mutex_unlock(&arena->mutex);
+
+    return ptr;
+}
+
+void *arena_realloc(struct arena *arena, void *ptr, size_t size) {
+    struct arena_hdr *hdr;
+    struct arena_block *block;
+    void *out = NULL;
+    size_t grow;
+
+    if(!ptr) {
+        return arena_alloc(arena, size);
+    }
+
+    hdr = ALLOC_HDR(ptr);
+    if(size <= hdr->size) {
+        return ptr;
+    }
+
+    pthread_mutex_lock(&arena->mutex);
+    block = hdr->block;
+
+    if(block->large) {
+        // Large allocations are realloced as they are
+        block_unlink(arena, block);
+        if((block = realloc(block, BLOCK_HDR_SIZE + ALLOC_HDR_SIZE + ARENA_ROUND(size)))) {
+            block->size = block->used = ALLOC_HDR_SIZE + ARENA_ROUND(size);
+            hdr = (struct arena_hdr*)BLOCK_DATA(block);
+            hdr->size = size;
+            hdr->block = block;
+            out = (char*)hdr + ALLOC_HDR_SIZE;
+        } else {
+            block = hdr->block;
+        }
+        block_link(arena, block);
+    } else if(ptr == arena->last && size <= ARENA_LARGE_SIZE &&
+              (grow = ARENA_ROUND(size) - ARENA_ROUND(hdr->size)) <= block->size - block->used)
+    {
+        // The last thing we handed out can grow in place
+        block->used += grow;
+        hdr->size = size;
+        out = ptr;
+    } else if((out = arena_alloc_locked(arena, size))) {
+        // Anything else moves, leaving its old space until we're freed
+        memcpy(out, ptr, hdr->size);
+    }
+
+    pthread_mutex_unlock(&arena->mutex);
+
+    return out;
+}
+
+void arena_release(struct arena *arena, void *ptr) {
+    struct arena_hdr *hdr;
+
+    if(!ptr) {
+        return;
+    }
+
+    hdr = ALLOC_HDR(ptr);
+
+    pthread_mutex_lock(&arena->mutex);
+    if(hdr->block->large) {
+        block_unlink(arena, hdr->block);
+        free(hdr->block);
+    } else if(ptr == arena->last) {
+        // We can take back the last thing we handed out
+        hdr->block->used -= ALLOC_HDR_SIZE + ARENA_ROUND(hdr->size);
+        arena->last = NULL;
+    }
+    pthread_mutex_unlock(&arena->mutex);
+}
+
+void arena_free(struct arena *arena) {
+    struct arena_block *block, *next;
+
+    for(block=arena->blocks;block;block=next) {
+        next = block->next;
+        free(block);
+    }
+
+    pthread_mutex_destroy(&arena->mutex);
+    arena->blocks = arena->cur = NULL;
+    arena->last = NULL;
+}
+
+int slab_init(struct slab_cache *slab, struct arena *arena, size_t size) {
+    unsigned int id = __atomic_fetch_add(&g_slab_ids, 1, __ATOMIC_RELAXED);
+
+    if(id >= SLAB_CACHES_MAX) {
+        return -1;
+    }
+
+    slab->size = ARENA_ROUND(size < sizeof(void*) ? sizeof(void*) : size);
+    slab->id = id;
+    slab->arena = arena;
+    slab->free = NULL;
+    pthread_mutex_init(&slab->mutex, NULL);
+
+    return 0;
+}
+
+// Get this thread's cache for a slab
+static inline struct slab_mag *slab_mag(struct slab_cache *slab) {
+    struct slab_mag *mag = &g_mags[slab->id];
+
+    // Anything left from a cache that used our slot before is gone
+    if(mag->slab != slab) {
+        memset(mag, 0, sizeof(struct slab_mag));
+        mag->slab = slab;
+    }
+
+    return mag;
+}
+
+void *slab_alloc(struct slab_cache *slab) {
+    struct slab_mag *mag = slab_mag(slab);
+    char *chunk;
+    void *obj;
+    unsigned int i;
+
+    if(!mag->head) {
+        if(mag->batch) {
+            // Use what we've freed ourselves first
+            mag->head = mag->batch;
+            mag->batch = mag->batch_tail = NULL;
+            mag->batch_len = 0;
+        } else {
+            // Then whatever other threads have given back
+            pthread_mutex_lock(&slab->mutex);
+            mag->head = slab->free;
+            slab->free = NULL;
+            pthread_mutex_unlock(&slab->mutex);
+        }
+    }
+
+    // Failing that, carve out a new chunk of objects
+    if(!mag->head) {
+        if(!(chunk = arena_alloc(slab->arena, slab->size * SLAB_CHUNK_OBJS))) {
+            return NULL;
+        }
+
+        for(i=0;i<SLAB_CHUNK_OBJS;i++) {
+            OBJ_NEXT(chunk + i * slab->size) = i + 1 < SLAB_CHUNK_OBJS ? chunk + (i + 1) * slab->size : NULL;
+        }
+        mag->head = chunk;
+    }
+
+    obj = mag->head;
+    mag->head = OBJ_NEXT(obj);
+
+    return obj;
+}
+
+void slab_free(struct slab_cache *slab, void *obj) {
+    struct slab_mag *mag = slab_mag(slab);
+
+    // Add it to our batch
+    OBJ_NEXT(obj) = mag->batch;
+    if(!mag->batch) {
+        mag->batch_tail = obj;
+    }
+    mag->batch = obj;
+
+    // Give back our batch once it's full
+    if(++mag->batch_len == SLAB_MAG_SIZE) {
+        pthread_mutex_lock(&slab->mutex);
+        OBJ_NEXT(mag->batch_tail) = slab->free;
+        slab->free = mag->batch;
+        pthread_mutex_unlock(&slab->mutex);
+
+        mag->batch = mag->batch_tail = NULL;
+        mag->batch_len = 0;
+    }
+}
+
+void slab_destroy(struct slab_cache *slab) {
+    pthread_mutex_destroy(&slab->mutex);
+    slab->free = NULL;
+}
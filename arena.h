@@ -0,0 +1,131 @@
+/*
+ * arena.h
+ *
+ * Memory for a whole run.  An arena hands out small allocations from large
+ * blocks and frees them all at once when the run is over, while anything
+ * big gets a block of its own which can be grown or freed by itself.  Slab
+ * caches sit on top of an arena and recycle fixed size objects, with a small
+ * cache of free objects for each thread so that objects allocated on one
+ * thread and freed on another only need a lock once per batch.
+ */
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+/**
+ * Size of the blocks we carve small allocations from, and the size over
+ * which an allocation gets a block of its own
+ */
+#define ARENA_BLOCK_SIZE (1024*1024)
+#define ARENA_LARGE_SIZE (64*1024)
+
+/**
+ * How many objects a slab cache takes from its arena at a time, how many a
+ * thread holds on to before giving them back, and how many caches we can
+ * have
+ */
+#define SLAB_CHUNK_OBJS 64
+#define SLAB_MAG_SIZE   32
+#define SLAB_CACHES_MAX 8
+
+/**
+ * A block of memory
+ */
+struct arena_block {
+    struct arena_block *prev, *next;
+
+    /**
+     * How big we are, how much of us is in use, and whether we hold a
+     * single large allocation
+     */
+    size_t size, used;
+    int large;
+};
+
+/**
+ * An arena
+ */
+struct arena {
+    /**
+     * Every block we have, the one we're carving small allocations from,
+     * and where the last of those starts, so it can be grown in place
+     */
+    struct arena_block *blocks, *cur;
+    void *last;
+
+    pthread_mutex_t mutex;
+};
+
+/**
+ * A cache of fixed size objects
+ */
+struct slab_cache {
+    /**
+     * Our objects' size, our slot in each thread's caches, and where we get
+     * memory from
+     */
+    size_t size;
+    unsigned int id;
+    struct arena *arena;
+
+    /**
+     * Objects given back by our threads
+     */
+    void *free;
+    pthread_mutex_t mutex;
+};
+
+/**
+ * Start an arena
+ */
+void arena_init(struct arena *arena);
+
+/**
+ * Allocate memory that lives as long as our arena, returning NULL on
+ * failure
+ */
+void *arena_alloc(struct arena *arena, size_t size);
+
+/**
+ * Grow an allocation, like realloc().  Large allocations are realloced,
+ * small ones grown in place if they're the last thing we handed out, and
+ * copied otherwise.
+ */
+void *arena_realloc(struct arena *arena, void *ptr, size_t size);
+
+/**
+ * Give back an allocation.  Large ones are freed right away, small ones
+ * when our arena is.
+ */
+void arena_release(struct arena *arena, void *ptr);
+
+/**
+ * Free everything in our arena
+ */
+void arena_free(struct arena *arena);
+
+/**
+ * Start a cache of objects of a given size, returning non zero if we
+ * already have too many
+ */
+int slab_init(struct slab_cache *slab, struct arena *arena, size_t size);
+
+/**
+ * Get an object, returning NULL on failure
+ */
+void *slab_alloc(struct slab_cache *slab);
+
+/**
+ * Give an object back, on any thread
+ */
+void slab_free(struct slab_cache *slab, void *obj);
+
+/**
+ * Stop a cache.  Its memory belongs to its arena.
+ */
+void slab_destroy(struct slab_cache *slab);
+
+#endif /* ARENA_H_ */
@@ -0,0 +1,129 @@
+#!/bin/sh
+#
+# bench.sh
+#
+# Time csv-split over generated CSV of each shape, in each configuration, and
+# write the results as JSON.  Each configuration is run BENCH_RUNS times and
+# the fastest run kept.
+#
+# Settings (from the environment):
+#   CSV_SPLIT       csv-split binary (./csv-split)
+#   CSVGEN          generator binary (bench/csvgen)
+#   BENCH_SIZE      bytes of CSV to generate for each shape (64M)
+#   BENCH_RUNS      runs of each configuration (3)
+#   BENCH_SHAPES    shapes to generate (narrow wide quoted newline long)
+#   BENCH_CONFIGS   configurations to run (parse split raw gzip group)
+#   BENCH_ARGS      extra arguments for every run (e.g. --io-uring)
+#   BENCH_DIR       where to put input and output (a temporary directory)
+#   BENCH_OUT       where to write our results (bench/results.json)
+#
+
+CSV_SPLIT=${CSV_SPLIT:-./csv-split}
+CSVGEN=${CSVGEN:-bench/csvgen}
+BENCH_SIZE=${BENCH_SIZE:-67108864}
+BENCH_RUNS=${BENCH_RUNS:-3}
+BENCH_SHAPES=${BENCH_SHAPES:-"narrow wide quoted newline long"}
+BENCH_CONFIGS=${BENCH_CONFIGS:-"parse split raw gzip group"}
+BENCH_OUT=${BENCH_OUT:-bench/results.json}
+
+# Rows per output file when splitting
+ROWS=100000
+
+die() {
+    echo "bench: $*" >&2
+    exit 1
+}
+
+[ -x "$CSV_SPLIT" ] || die "can't run $CSV_SPLIT"
+[ -x "$CSVGEN" ] || die "can't run $CSVGEN"
+
+if [ -z "$BENCH_DIR" ]; then
+    BENCH_DIR=$(mktemp -d "${TMPDIR:-/tmp}/csv-split-bench.XXXXXX") || die "can't make a temporary directory"
+    trap 'rm -rf "$BENCH_DIR"' EXIT INT TERM
+fi
+mkdir -p "$BENCH_DIR/out" || die "can't use $BENCH_DIR"
+
+# Arguments for each configuration.  Parsing alone is a --where no row
+# passes, so nothing but the header is written.
+config_args() {
+    case $1 in
+        parse) echo "-d -n $ROWS -w col0==\"\"" ;;
+        split) echo "-d -n $ROWS" ;;
+        raw)   echo "-d -r -n $ROWS" ;;
+        gzip)  echo "-d -z -n $ROWS" ;;
+        group) echo "-d -g 1 -n $ROWS" ;;
+        *)     die "unknown configuration '$1'" ;;
+    esac
+}
+
+# Nanoseconds since the epoch
+now() {
+    date +%s%N
+}
+
+# Time one run, in nanoseconds
+run() {
+    rm -rf "$BENCH_DIR/out" && mkdir "$BENCH_DIR/out" || die "can't clear $BENCH_DIR/out"
+    start=$(now)
+    # shellcheck disable=SC2086
+    "$CSV_SPLIT" $BENCH_ARGS $2 "$1" "$BENCH_DIR/out/" >/dev/null || die "csv-split $2 failed on $1"
+    echo $(( $(now) - start ))
+}
+
+json_str() {
+    printf '"%s"' "$(printf '%s' "$1" | sed 's/\\/\\\\/g; s/"/\\"/g')"
+}
+
+{
+    printf '{\n'
+    printf '  "version": %s,\n' "$(json_str "$("$CSV_SPLIT" --version)")"
+    printf '  "commit": %s,\n' "$(json_str "$(git rev-parse --short HEAD 2>/dev/null)")"
+    printf '  "date": %s,\n' "$(json_str "$(date -u +%Y-%m-%dT%H:%M:%SZ)")"
+    printf '  "size": %s,\n' "$BENCH_SIZE"
+    printf '  "runs": %s,\n' "$BENCH_RUNS"
+    printf '  "args": %s,\n' "$(json_str "$BENCH_ARGS")"
+    printf '  "results": [\n'
+} > "$BENCH_OUT.tmp" || die "can't write $BENCH_OUT"
+
+sep=
+for shape in $BENCH_SHAPES; do
+    in="$BENCH_DIR/$shape.csv"
+    rows=$("$CSVGEN" "$shape" "$BENCH_SIZE" 2>&1 >"$in") || die "can't generate $shape: $rows"
+    bytes=$(wc -c < "$in" | tr -d ' ')
+
+    for config in $BENCH_CONFIGS; do
+        args=$(config_args "$config") || exit 1
+        best=
+        i=0
+        while [ $i -lt "$BENCH_RUNS" ]; do
+            ns=$(run "$in" "$args") || exit 1
+            if [ -z "$best" ] || [ "$ns" -lt "$best" ]; then
+                best=$ns
+            fi
+            i=$((i + 1))
+        done
+
+        # Keep the minimum run, and report throughput against it
+        awk -v shape="$shape" -v config="$config" -v args="$args" -v bytes="$bytes" \
+            -v rows="$rows" -v ns="$best" -v sep="$sep" 'BEGIN {
+            s = ns / 1e9
+            gsub(/\\/, "\\\\", args)
+            gsub(/"/, "\\\"", args)
+            printf "%s    {\"shape\": \"%s\", \"config\": \"%s\", \"args\": \"%s\", \"bytes\": %d, \"rows\": %d, ", \
+                   sep, shape, config, args, bytes, rows
+            printf "\"seconds\": %.4f, \"mb_per_sec\": %.1f, \"rows_per_sec\": %.0f}", \
+                   s, bytes / 1048576 / s, rows / s
+        }' >> "$BENCH_OUT.tmp"
+        sep=",
+"
+        awk -v shape="$shape" -v config="$config" -v bytes="$bytes" -v ns="$best" -v rows="$rows" 'BEGIN {
+            s = ns / 1e9
+            printf "%-8s %-6s %8.3fs %9.1f MB/s %12.0f rows/s\n", shape, config, s, bytes / 1048576 / s, rows / s
+        }' >&2
+    done
+
+    rm -f "$in"
+done
+
+printf '\n  ]\n}\n' >> "$BENCH_OUT.tmp" && mv "$BENCH_OUT.tmp" "$BENCH_OUT" || die "can't write $BENCH_OUT"
+echo "bench: results written to $BENCH_OUT" >&2
@@ -0,0 +1,201 @@
+/*
+ * csvgen.c
+ *
+ * Deterministic CSV generator for our benchmarks.  Writes about the given
+ * number of bytes of one shape of CSV to stdout, and how many rows that was
+ * (not counting the header) to stderr.  The same shape, size and seed always
+ * give the same bytes.
+ *
+ * Every shape starts with a unique id and a group column that changes every
+ * GROUP_ROWS rows, so it can be split with --group-col 1.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/**
+ * How many rows share each group column value
+ */
+#define GROUP_ROWS 64
+
+/**
+ * How many columns our wide shape has, and how long our long shape's fields
+ * get
+ */
+#define WIDE_COLS      100
+#define LONG_FIELD_MIN 1024
+#define LONG_FIELD_MAX 8192
+
+static const char *g_words[] = {
+    "alpha", "bravo", "charlie", "delta", "echo", "foxtrot", "golf", "hotel",
+    "india", "juliet", "kilo", "lima", "mike", "november", "oscar", "papa",
+};
+
+#define WORD_COUNT (sizeof(g_words) / sizeof(g_words[0]))
+
+// Our random number generator (xorshift64*)
+static uint64_t g_state;
+
+static inline uint64_t rnd(void) {
+    g_state ^= g_state >> 12;
+    g_state ^= g_state << 25;
+    g_state ^= g_state >> 27;
+    return g_state * 0x2545F4914F6CDD1DULL;
+}
+
+static inline const char *word(void) {
+    return g_words[rnd() % WORD_COUNT];
+}
+
+// Short fields: numbers, a word and a decimal
+static int row_narrow(FILE *fp) {
+    return fprintf(fp, ",%u,%s,%u.%02u", (unsigned int)(rnd() % 100000), word(),
+                   (unsigned int)(rnd() % 1000), (unsigned int)(rnd() % 100));
+}
+
+// Lots of small fields
+static int row_wide(FILE *fp) {
+    int i, n = 0;
+
+    for(i=2;i<WIDE_COLS;i++) {
+        if(i & 1) {
+            n += fprintf(fp, ",%s", word());
+        } else {
+            n += fprintf(fp, ",%u", (unsigned int)(rnd() % 10000));
+        }
+    }
+
+    return n;
+}
+
+// Every field quoted, with commas and escaped quotes inside
+static int row_quoted(FILE *fp) {
+    int i, n = 0;
+
+    for(i=0;i<6;i++) {
+        switch(rnd() % 3) {
+            case 0:
+                n += fprintf(fp, ",\"%s, %s\"", word(), word());
+                break;
+            case 1:
+                n += fprintf(fp, ",\"%s \"\"%s\"\" %s\"", word(), word(), word());
+                break;
+            default:
+                n += fprintf(fp, ",\"%s\"", word());
+                break;
+        }
+    }
+
+    return n;
+}
+
+// Quoted fields, half of them spanning lines
+static int row_newline(FILE *fp) {
+    int i, n = 0;
+
+    for(i=0;i<4;i++) {
+        if(rnd() & 1) {
+            n += fprintf(fp, ",\"%s\n%s\n%s\"", word(), word(), word());
+        } else {
+            n += fprintf(fp, ",\"%s %s\"", word(), word());
+        }
+    }
+
+    return n;
+}
+
+// A couple of fields several kilobytes long
+static int row_long(FILE *fp) {
+    size_t len, i;
+    int f, n = 0;
+
+    for(f=0;f<2;f++) {
+        len = LONG_FIELD_MIN + rnd() % (LONG_FIELD_MAX - LONG_FIELD_MIN);
+        fputc(',', fp);
+        for(i=0;i<len;i++) {
+            fputc('a' + rnd() % 26, fp);
+        }
+        n += len + 1;
+    }
+
+    return n;
+}
+
+/**
+ * Our shapes, and how many columns each one has
+ */
+static const struct shape {
+    const char *name;
+    int cols;
+    int (*row)(FILE *fp);
+} g_shapes[] = {
+    { "narrow",  5,         row_narrow },
+    { "wide",    WIDE_COLS, row_wide },
+    { "quoted",  8,         row_quoted },
+    { "newline", 6,         row_newline },
+    { "long",    4,         row_long },
+};
+
+#define SHAPE_COUNT (sizeof(g_shapes) / sizeof(g_shapes[0]))
+
+static void usage(const char *exec) {
+    size_t i;
+
+    fprintf(stderr, "Usage:  %s SHAPE BYTES [SEED]\n", exec);
+    fprintf(stderr, "Shapes:");
+    for(i=0;i<SHAPE_COUNT;i++) {
+        fprintf(stderr, " %s", g_shapes[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv) {
+    const struct shape *shape = NULL;
+    unsigned long long bytes, written = 0, rows = 0;
+    size_t i;
+    int c;
+
+    if(argc < 3) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    for(i=0;i<SHAPE_COUNT;i++) {
+        if(!strcmp(argv[1], g_shapes[i].name)) {
+            shape = &g_shapes[i];
+        }
+    }
+
+    if(!shape || !(bytes = strtoull(argv[2], NULL, 10))) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    g_state = argc > 3 ? strtoull(argv[3], NULL, 10) : 0;
+    g_state = g_state * 0x9E3779B97F4A7C15ULL + 1;
+
+    // Our header
+    for(c=0;c<shape->cols;c++) {
+        written += printf(c ? ",c%d" : "c%d", c);
+    }
+    written += putchar('\n') != EOF;
+
+    // Rows until we've got enough
+    while(written < bytes) {
+        written += printf("%llu,g%llu", rows, rows / GROUP_ROWS);
+        written += shape->row(stdout);
+        written += putchar('\n') != EOF;
+        rows++;
+    }
+
+    if(fflush(stdout) != 0) {
+        perror("csvgen");
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "%llu\n", rows);
+
+    return 0;
+}
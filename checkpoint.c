@@ -0,0 +1,186 @@
+/*
+ * checkpoint.c
+ *
+ * Writing and reading checkpoints.  They're small text files, one setting
+ * per line, with our header and group column value in hex.
+ */
+
+#include "checkpoint.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <limits.h>
+
+// Write bytes as hex, or a dash if there aren't any
+static void put_hex(FILE *fp, const char *name, const char *data, size_t len) {
+    size_t i;
+
+    fprintf(fp, "%s ", name);
+    if(!len) {
+        fputc('-', fp);
+    }
+    for(i=0;i<len;i++) {
+        fprintf(fp, "%02x", (unsigned char)data[i]);
+    }
+    fputc('\n', fp);
+}
+
+// Read bytes written by put_hex, returning non zero if they're not valid
+static int get_hex(const char *hex, char **data, size_t *len) {
+    size_t i, n = strlen(hex);
+    unsigned int c;
+
+    *data = NULL;
+    *len = 0;
+
+    if(!strcmp(hex, "-")) {
+        return 0;
+    } else if(n % 2 || !(*data = malloc(n / 2))) {
+        return 1;
+    }
+
+    for(i=0;i<n/2;i++) {
+        if(sscanf(hex + i * 2, "%2x", &c) != 1) {
+            return 1;
+        }
+        (*data)[i] = c;
+    }
+    *len = n / 2;
+
+    return 0;
+}
+
+// Make sure a rename into a directory survives a crash
+static void sync_dir(const char *path) {
+    char dir[PATH_MAX];
+    int fd;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    if((fd = open(dirname(dir), O_RDONLY | O_DIRECTORY)) >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+int ckpt_write(const char *path, const struct ckpt *ck) {
+    char tmp[PATH_MAX];
+    FILE *fp;
+    int err = 0;
+
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+        return ENAMETOOLONG;
+    } else if(!(fp = fopen(tmp, "w"))) {
+        return errno;
+    }
+
+    fprintf(fp, "csv-split-checkpoint %d\n", CKPT_VERSION);
+    fprintf(fp, "in_size %lld\n", (long long)ck->in_size);
+    fprintf(fp, "raw %d\n", ck->raw);
+    fprintf(fp, "gcol %d\n", ck->gcol);
+    fprintf(fp, "max_rows %lu\n", ck->max_rows);
+    fprintf(fp, "max_bytes %zu\n", ck->max_bytes);
+    fprintf(fp, "use_header %d\n", ck->use_header);
+    fprintf(fp, "count_header %d\n", ck->count_header);
+    fprintf(fp, "on_file %u\n", ck->on_file);
+    fprintf(fp, "offset %lld\n", (long long)ck->offset);
+    fprintf(fp, "header_end %lld\n", (long long)ck->header_end);
+    put_hex(fp, "header", ck->header, ck->header_len);
+    put_hex(fp, "group", ck->group, ck->group_len);
+
+    // Our checkpoint has to be on disk before it replaces the last one
+    if(fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        err = errno;
+    }
+    if(fclose(fp) != 0 && !err) {
+        err = errno;
+    }
+    if(!err && rename(tmp, path) != 0) {
+        err = errno;
+    }
+
+    if(err) {
+        unlink(tmp);
+    } else {
+        sync_dir(path);
+    }
+
+    return err;
+}
+
+int ckpt_read(const char *path, struct ckpt *ck) {
+    char *line = NULL, *val;
+    size_t size = 0;
+    ssize_t len;
+    long long num;
+    int version = 0, err = 0;
+    FILE *fp;
+
+    memset(ck, 0, sizeof(struct ckpt));
+
+    if(!(fp = fopen(path, "r"))) {
+        return errno == ENOENT ? ENOENT : errno;
+    }
+
+    while(!err && (len = getline(&line, &size, fp)) > 0) {
+        if(line[len-1] == '\n') {
+            line[len-1] = '\0';
+        }
+        if(!(val = strchr(line, ' '))) {
+            err = EINVAL;
+            break;
+        }
+        *val++ = '\0';
+        num = strtoll(val, NULL, 10);
+
+        if(!strcmp(line, "csv-split-checkpoint")) {
+            version = num;
+        } else if(!strcmp(line, "in_size")) {
+            ck->in_size = num;
+        } else if(!strcmp(line, "raw")) {
+            ck->raw = num;
+        } else if(!strcmp(line, "gcol")) {
+            ck->gcol = num;
+        } else if(!strcmp(line, "max_rows")) {
+            ck->max_rows = strtoul(val, NULL, 10);
+        } else if(!strcmp(line, "max_bytes")) {
+            ck->max_bytes = strtoull(val, NULL, 10);
+        } else if(!strcmp(line, "use_header")) {
+            ck->use_header = num;
+        } else if(!strcmp(line, "count_header")) {
+            ck->count_header = num;
+        } else if(!strcmp(line, "on_file")) {
+            ck->on_file = num;
+        } else if(!strcmp(line, "offset")) {
+            ck->offset = num;
+        } else if(!strcmp(line, "header_end")) {
+            ck->header_end = num;
+        } else if(!strcmp(line, "header")) {
+            err = get_hex(val, &ck->header, &ck->header_len) ? EINVAL : 0;
+        } else if(!strcmp(line, "group")) {
+            err = get_hex(val, &ck->group, &ck->group_len) ? EINVAL : 0;
+        }
+    }
+
+    free(line);
+    fclose(fp);
+
+    if(!err && (version != CKPT_VERSION || ck->offset < ck->header_end)) {
+        err = EINVAL;
+    }
+    if(err) {
+        ckpt_free(ck);
+    }
+
+    return err;
+}
+
+void ckpt_free(struct ckpt *ck) {
+    free(ck->header);
+    free(ck->group);
+    ck->header = ck->group = NULL;
+    ck->header_len = ck->group_len = 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * checkpoint.h
+ *
+ * Checkpoints for resuming a split that didn't finish.  Once every output
+ * file up to and including one has been written and synced, we record where
+ * in our input the row after it starts, along with everything we need to
+ * carry on from there as if we'd never stopped.  Checkpoints are only taken
+ * between rows, where our parser has nothing buffered, so nothing about a
+ * half parsed row ever needs saving.  A checkpoint is written to a
+ * temporary file, synced and renamed over the last, so there's always one
+ * whole checkpoint to resume from.
+ */
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Our format version, which we refuse to resume from if it's not ours
+ */
+#define CKPT_VERSION 1
+
+/**
+ * A checkpoint
+ */
+struct ckpt {
+    /**
+     * The settings our run was started with, which have to match for the
+     * files we'd write from here on to follow on from the ones we wrote:
+     * our input's size (zero if we couldn't tell), whether we were in raw
+     * mode, our group column, our limits, and our header settings
+     */
+    off_t in_size;
+    int raw;
+    int gcol;
+    unsigned long max_rows;
+    size_t max_bytes;
+    int use_header, count_header;
+
+    /**
+     * The last file we've written, where in our input the row after it
+     * starts, and where our header row ends (zero if we don't have one)
+     */
+    unsigned int on_file;
+    off_t offset, header_end;
+
+    /**
+     * Our header as we write it to each file, and our last group column
+     * value
+     */
+    char *header;
+    size_t header_len;
+    char *group;
+    size_t group_len;
+};
+
+/**
+ * Write a checkpoint to path, replacing whatever was there.  Returns zero on
+ * success or an errno value.
+ */
+int ckpt_write(const char *path, const struct ckpt *ck);
+
+/**
+ * Read a checkpoint.  Returns zero on success, ENOENT if there isn't one, or
+ * EINVAL if it isn't a checkpoint we can read.
+ */
+int ckpt_read(const char *path, struct ckpt *ck);
+
+/**
+ * Free what ckpt_read() allocated
+ */
+void ckpt_free(struct ckpt *ck);
+
+#endif /* CHECKPOINT_H_ */
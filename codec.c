@@ -0,0 +1,249 @@
+/*
+ * codec.c
+ *
+ * Output compression codecs
+ */
+
+#include "codec.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+/*
+ * gzip, compressed in parallel blocks on our pgz pool
+ */
+
+struct gz_state {
+    struct pgz_pool *pool;
+    struct pgz_stream strm;
+};
+
+static void *gz_open(const struct codec_opts *opts) {
+    struct gz_state *gz;
+
+    if(!(gz = malloc(sizeof(struct gz_state)))) {
+        return NULL;
+    }
+
+    gz->pool = opts->pgz;
+    pgz_stream_init(&gz->strm, opts->level);
+
+    return gz;
+}
+
+static int gz_write(void *state, FILE *fp, const char *data, size_t len, int last) {
+    struct gz_state *gz = (struct gz_state*)state;
+    return pgz_write(gz->pool, &gz->strm, fp, data, len, last);
+}
+
+static void gz_free(void *state) {
+    free(state);
+}
+
+#ifdef HAVE_ZSTD
+
+/*
+ * zstd, which can spread a single stream over its own worker threads
+ */
+
+struct zst_state {
+    ZSTD_CCtx *cctx;
+    void *out;
+    size_t out_size;
+};
+
+static void zst_free(void *state) {
+    struct zst_state *zs = (struct zst_state*)state;
+
+    ZSTD_freeCCtx(zs->cctx);
+    free(zs->out);
+    free(zs);
+}
+
+static void *zst_open(const struct codec_opts *opts) {
+    struct zst_state *zs;
+
+    if(!(zs = calloc(1, sizeof(struct zst_state)))) {
+        return NULL;
+    }
+
+    zs->out_size = ZSTD_CStreamOutSize();
+    if(!(zs->cctx = ZSTD_createCCtx()) || !(zs->out = malloc(zs->out_size))) {
+        zst_free(zs);
+        return NULL;
+    }
+
+    if(ZSTD_isError(ZSTD_CCtx_setParameter(zs->cctx, ZSTD_c_compressionLevel, opts->level))) {
+        zst_free(zs);
+        return NULL;
+    }
+
+    // This fails if libzstd was built without threads, in which case we
+    // just compress on the IO thread
+    if(opts->threads > 1) {
+        ZSTD_CCtx_setParameter(zs->cctx, ZSTD_c_nbWorkers, opts->threads);
+    }
+
+    return zs;
+}
+
+static int zst_write(void *state, FILE *fp, const char *data, size_t len, int last) {
+    struct zst_state *zs = (struct zst_state*)state;
+    ZSTD_EndDirective mode = last ? ZSTD_e_end : ZSTD_e_continue;
+    ZSTD_inBuffer in = { data, len, 0 };
+    ZSTD_outBuffer out;
+    size_t ret;
+
+    // Keep going until we've consumed everything, and when finishing, until
+    // zstd says it has nothing left to flush
+    do {
+        out.dst = zs->out;
+        out.size = zs->out_size;
+        out.pos = 0;
+
+        ret = ZSTD_compressStream2(zs->cctx, &out, &in, mode);
+        if(ZSTD_isError(ret)) {
+            return EIO;
+        }
+
+        if(out.pos && fwrite(zs->out, 1, out.pos, fp) != out.pos) {
+            return EIO;
+        }
+    } while(last ? ret != 0 : in.pos < in.size);
+
+    return 0;
+}
+
+#endif /* HAVE_ZSTD */
+
+#ifdef HAVE_LZ4
+
+/*
+ * lz4 frames, for when speed matters much more than size
+ */
+
+struct lz4_state {
+    LZ4F_cctx *cctx;
+    LZ4F_preferences_t prefs;
+    int started;
+    char *out;
+    size_t out_size;
+};
+
+/**
+ * How much we hand LZ4F_compressUpdate at once, which bounds our output
+ * buffer
+ */
+#define LZ4_CHUNK_SIZE (256*1024)
+
+static void lz4_free(void *state) {
+    struct lz4_state *ls = (struct lz4_state*)state;
+
+    LZ4F_freeCompressionContext(ls->cctx);
+    free(ls->out);
+    free(ls);
+}
+
+static void *lz4_open(const struct codec_opts *opts) {
+    struct lz4_state *ls;
+
+    if(!(ls = calloc(1, sizeof(struct lz4_state)))) {
+        return NULL;
+    }
+
+    ls->prefs.compressionLevel = opts->level;
+    ls->prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+
+    // Room for a header, a full chunk, and the end mark in one go
+    ls->out_size = LZ4F_compressBound(LZ4_CHUNK_SIZE, &ls->prefs) + LZ4F_HEADER_SIZE_MAX;
+
+    if(LZ4F_isError(LZ4F_createCompressionContext(&ls->cctx, LZ4F_VERSION)) ||
+       !(ls->out = malloc(ls->out_size)))
+    {
+        lz4_free(ls);
+        return NULL;
+    }
+
+    return ls;
+}
+
+static int lz4_write(void *state, FILE *fp, const char *data, size_t len, int last) {
+    struct lz4_state *ls = (struct lz4_state*)state;
+    size_t ret, pos = 0, n;
+
+    if(!ls->started) {
+        ret = LZ4F_compressBegin(ls->cctx, ls->out, ls->out_size, &ls->prefs);
+        if(LZ4F_isError(ret) || fwrite(ls->out, 1, ret, fp) != ret) {
+            return EIO;
+        }
+        ls->started = 1;
+    }
+
+    while(pos < len) {
+        n = len - pos < LZ4_CHUNK_SIZE ? len - pos : LZ4_CHUNK_SIZE;
+
+        ret = LZ4F_compressUpdate(ls->cctx, ls->out, ls->out_size, data + pos, n, NULL);
+        if(LZ4F_isError(ret) || (ret && fwrite(ls->out, 1, ret, fp) != ret)) {
+            return EIO;
+        }
+
+        pos += n;
+    }
+
+    if(last) {
+        ret = LZ4F_compressEnd(ls->cctx, ls->out, ls->out_size, NULL);
+        if(LZ4F_isError(ret) || fwrite(ls->out, 1, ret, fp) != ret) {
+            return EIO;
+        }
+    }
+
+    return 0;
+}
+
+#endif /* HAVE_LZ4 */
+
+static const struct codec g_codecs[] = {
+    { "gzip", ".gz", 1, 9, Z_DEFAULT_COMPRESSION, gz_open, gz_write, gz_free },
+#ifdef HAVE_ZSTD
+    { "zstd", ".zst", 1, 19, 3, zst_open, zst_write, zst_free },
+#endif
+#ifdef HAVE_LZ4
+    { "lz4", ".lz4", 0, 12, 0, lz4_open, lz4_write, lz4_free },
+#endif
+};
+
+#define CODEC_COUNT (sizeof(g_codecs) / sizeof(g_codecs[0]))
+
+const struct codec *codec_find(const char *name) {
+    size_t i;
+
+    for(i=0;i<CODEC_COUNT;i++) {
+        if(!strcmp(g_codecs[i].name, name)) {
+            return &g_codecs[i];
+        }
+    }
+
+    return NULL;
+}
+
+const char *codec_list(void) {
+    static char list[64];
+    size_t i;
+
+    if(!*list) {
+        for(i=0;i<CODEC_COUNT;i++) {
+            if(i) strcat(list, ", ");
+            strcat(list, g_codecs[i].name);
+        }
+    }
+
+    return list;
+}
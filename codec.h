@@ -0,0 +1,79 @@
+/*
+ * codec.h
+ *
+ * Output compression codecs.  Each codec knows how to start a compressed
+ * stream for one output file, compress and write blocks of data to it as
+ * they arrive, and finish it with the last one.  gzip is always available,
+ * zstd and lz4 (frame format) when we're built against them.
+ */
+
+#ifndef CODEC_H_
+#define CODEC_H_
+
+#include <stdio.h>
+#include "pgz.h"
+
+/**
+ * Settings shared by every stream we open
+ */
+struct codec_opts {
+    /**
+     * Compression level
+     */
+    int level;
+
+    /**
+     * How many threads a single stream may compress on
+     */
+    unsigned int threads;
+
+    /**
+     * Our parallel gzip pool
+     */
+    struct pgz_pool *pgz;
+};
+
+/**
+ * A compression codec
+ */
+struct codec {
+    /**
+     * Name (as given to --compress) and the extension for our files
+     */
+    const char *name;
+    const char *ext;
+
+    /**
+     * Valid compression levels, and the one we use if none is given
+     */
+    int min_level, max_level, default_level;
+
+    /**
+     * Start a stream, returning its state or NULL on failure
+     */
+    void *(*open)(const struct codec_opts *opts);
+
+    /**
+     * Compress len bytes and write them to fp, finishing the stream if last
+     * is set.  Returns zero on success.
+     */
+    int (*write)(void *state, FILE *fp, const char *data, size_t len, int last);
+
+    /**
+     * Free a stream's state
+     */
+    void (*free)(void *state);
+};
+
+/**
+ * Find a codec by name, returning NULL if we don't know it (or weren't
+ * built with it)
+ */
+const struct codec *codec_find(const char *name);
+
+/**
+ * Comma separated list of the codecs we were built with
+ */
+const char *codec_list(void);
+
+#endif /* CODEC_H_ */
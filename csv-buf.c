@@ -20,15 +20,51 @@ cbuf cbuf_init(size_t size) {
 	// Set up our size and current position
 	ch->size = size;
 	ch->pos = 0;
+	ch->align = 0;
 
 	// Return our buffer
 	return (char*)ch->buf;
 }
 
+// Allocate the memory for an aligned buffer.  Our header sits at the end of
+// the first align bytes, so our data starts right after them.
+static cbufhdr *cbuf_aligned_hdr(size_t size, size_t align) {
+	void *mem;
+
+	if(posix_memalign(&mem, align, align+size+1) != 0) return NULL;
+
+	return (cbufhdr*)((char*)mem+align-sizeof(cbufhdr));
+}
+
+// Initialize a buffer whose data is aligned
+cbuf cbuf_init_aligned(size_t size, size_t align) {
+	cbufhdr *ch;
+
+	// Make sure we have room for our header in front of our data
+	while(align < sizeof(cbufhdr)) align *= 2;
+
+	ch = cbuf_aligned_hdr(size, align);
+
+	// OOM sanity check
+	if(!ch) return NULL;
+
+	ch->size = size;
+	ch->pos = 0;
+	ch->align = align;
+
+	return (char*)ch->buf;
+}
+
 // Free our buffer
 void cbuf_free(cbuf buf) {
 	if(buf == NULL) return;
-	free(buf-sizeof(cbufhdr));
+
+	// Aligned buffers were allocated from further back
+	if(CBUF_HDR(buf)->align) {
+		free(buf-CBUF_HDR(buf)->align);
+	} else {
+		free(CBUF_HDR(buf));
+	}
 }
 
 // Allocate enough room for size bytes
@@ -43,8 +79,18 @@ cbuf cbuf_alloc(cbuf buf, size_t size) {
 		size *= 2;
 	}
 
-	// Reallocate our buffer
-	newch = realloc(ch, sizeof(cbufhdr) + size + 1);
+	// Reallocate our buffer, by hand if it's aligned, since realloc won't
+	// keep it that way
+	if(ch->align) {
+		newch = cbuf_aligned_hdr(size, ch->align);
+		if(!newch) return NULL;
+
+		memcpy(newch, ch, sizeof(cbufhdr) + ch->size + 1);
+		cbuf_free(buf);
+	} else {
+		newch = realloc(ch, sizeof(cbufhdr) + size + 1);
+		if(!newch) return NULL;
+	}
 	newch->size = size;
 
 	// Return our new buffer
@@ -90,6 +136,18 @@ cbuf cbuf_putc(cbuf buf, char c) {
 	return buf;
 }
 
+// Append len bytes to the end of our output buffer
+cbuf cbuf_append(cbuf buf, const char *s, size_t len) {
+	// Grow geometrically so repeated appends don't realloc every time
+	while(CBUF_REM(buf) < len) buf = cbuf_double(buf);
+
+	// Copy in our data and move our position
+	memcpy(CBUF_PTR(buf), s, len);
+	CBUF_POS(buf) += len;
+
+	return buf;
+}
+
 // Return a copy of the buffer and it's size
 char *cbuf_dup(cbuf buf, size_t *size) {
 	if(!buf) return NULL;
@@ -118,3 +176,63 @@ char *cbuf_duplen(cbuf buf, size_t *len) {
     // Return our data
     return ret;
 }
+
+// Initialize a pool that will hold on to up to max free buffers
+int cbuf_pool_init(cbuf_pool *pool, size_t size, unsigned int max) {
+	return cbuf_pool_init_aligned(pool, size, max, 0);
+}
+
+// Initialize a pool of buffers whose data is aligned
+int cbuf_pool_init_aligned(cbuf_pool *pool, size_t size, unsigned int max, size_t align) {
+	pool->bufs = malloc(max * sizeof *pool->bufs);
+	if(!pool->bufs) return -1;
+
+	pool->count = 0;
+	pool->max = max;
+	pool->size = size;
+	pool->align = align;
+
+	return pthread_mutex_init(&pool->mutex, NULL);
+}
+
+// Get an empty buffer, either a recycled one or a new one
+cbuf cbuf_pool_get(cbuf_pool *pool) {
+	cbuf buf = NULL;
+
+	pthread_mutex_lock(&pool->mutex);
+	if(pool->count) {
+		buf = pool->bufs[--pool->count];
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	if(!buf) {
+		return pool->align ? cbuf_init_aligned(pool->size, pool->align) : cbuf_init(pool->size);
+	}
+
+	CBUF_SETPOS(buf, 0);
+	return buf;
+}
+
+// Give a buffer back to the pool, or free it if we have enough
+void cbuf_pool_put(cbuf_pool *pool, cbuf buf) {
+	if(!buf) return;
+
+	pthread_mutex_lock(&pool->mutex);
+	if(pool->count < pool->max) {
+		pool->bufs[pool->count++] = buf;
+		buf = NULL;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	cbuf_free(buf);
+}
+
+// Free our pool and every buffer in it
+void cbuf_pool_free(cbuf_pool *pool) {
+	while(pool->count) {
+		cbuf_free(pool->bufs[--pool->count]);
+	}
+
+	free(pool->bufs);
+	pthread_mutex_destroy(&pool->mutex);
+}
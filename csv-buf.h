@@ -7,6 +7,7 @@
 
 #include <stddef.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #ifndef CSV_BUF_H_
 #define CSV_BUF_H_
@@ -16,11 +17,31 @@ typedef char *cbuf;
 typedef struct _cbufhdr {
 	size_t size;
 	size_t pos;
+	// What our data is aligned to, if we were allocated aligned
+	size_t align;
 	char buf[];
 } cbufhdr;
 
 #define MAX_PREALLOC (1024*1024)
 
+/**
+ * A pool of buffers which rotate between our parser and IO threads, so a
+ * full buffer can be handed off by pointer and a recycled one taken back.
+ * Buffers keep whatever size they grew to.
+ */
+typedef struct _cbuf_pool {
+	// Free buffers, how many there are, and how many we'll hold on to
+	cbuf *bufs;
+	unsigned int count, max;
+
+	// Initial size of any buffer we have to create, and what its data
+	// should be aligned to (zero if we don't care)
+	size_t size, align;
+
+	// Exclusive access to our free list
+	pthread_mutex_t mutex;
+} cbuf_pool;
+
 // Get our header
 #define CBUF_HDR(p) ((cbufhdr*)(p-(sizeof(cbufhdr))))
 
@@ -37,8 +58,10 @@ typedef struct _cbufhdr {
 
 #define CBUF_PUT(p, c) (*CBUF_PTR(p)=c, CBUF_POS(p)++)
 
-// allocation, freeing stuff
+// allocation, freeing stuff.  An aligned buffer's data starts on a
+// multiple of align (a power of two), and stays that way as it grows.
 cbuf cbuf_init(size_t size);
+cbuf cbuf_init_aligned(size_t size, size_t align);
 cbuf cbuf_alloc(cbuf p, size_t size);
 cbuf cbuf_double(cbuf p);
 void cbuf_free(cbuf p);
@@ -50,6 +73,14 @@ size_t cbuf_size(cbuf p);
 cbuf cbuf_setlen(cbuf p, const char *str, size_t len);
 cbuf cbuf_set(cbuf p, const char *str);
 cbuf cbuf_putc(cbuf p, char c);
+cbuf cbuf_append(cbuf p, const char *str, size_t len);
+
+// Buffer pool
+int cbuf_pool_init(cbuf_pool *pool, size_t size, unsigned int max);
+int cbuf_pool_init_aligned(cbuf_pool *pool, size_t size, unsigned int max, size_t align);
+cbuf cbuf_pool_get(cbuf_pool *pool);
+void cbuf_pool_put(cbuf_pool *pool, cbuf p);
+void cbuf_pool_free(cbuf_pool *pool);
 
 // Duplication
 char *cbuf_dup(cbuf p, size_t *size);
@@ -0,0 +1,256 @@
+/*
+ * csv-range.c
+ *
+ * Parallel range scanning for regular file inputs
+ */
+
+#include "csv-range.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/**
+ * How much we scan at a time, so we only grow our offset storage by as much
+ * as a piece could possibly need
+ */
+#define CRANGE_PIECE 65536
+
+// Scan a range from a given quote state, growing our offset storage as needed
+static int crange_scan(struct crange *r, const struct csv_scanner *proto, uint64_t in_quote) {
+    struct csv_scanner s = *proto;
+    size_t pos, len, size;
+    uint32_t *idx;
+
+    s.in_quote = in_quote;
+    r->n = 0;
+
+    for(pos=0;pos<r->len;pos+=len) {
+        len = r->len - pos < CRANGE_PIECE ? r->len - pos : CRANGE_PIECE;
+
+        // Make sure we have room for every byte in this piece
+        if(r->idx_size < r->n + len) {
+            size = r->idx_size * 2 > r->n + len ? r->idx_size * 2 : r->n + len;
+            if(!(idx = realloc(r->idx, size * sizeof *idx))) {
+                return ENOMEM;
+            }
+            r->idx = idx;
+            r->idx_size = size;
+        }
+
+        // Scan, and make our offsets relative to the whole range
+        size = csv_scan(&s, r->buf + pos, len, r->idx + r->n);
+        if(pos) {
+            for(;size;size--,r->n++) r->idx[r->n] += pos;
+        } else {
+            r->n += size;
+        }
+    }
+
+    r->in_quote = s.in_quote;
+    return 0;
+}
+
+// Read a range in full, or just point at it if we've got a mapping
+static int crange_read(struct crange_pool *pool, struct crange *r) {
+    size_t got = 0;
+    ssize_t ret;
+
+    if(pool->map) {
+        r->buf = pool->map + r->off;
+        return 0;
+    }
+
+    r->buf = r->data;
+
+    while(got < r->len) {
+        ret = pread(pool->fd, r->data + got, r->len - got, r->off + got);
+        if(ret < 0 && errno == EINTR) continue;
+        if(ret <= 0) return ret < 0 ? errno : EIO;
+        got += ret;
+    }
+
+    return 0;
+}
+
+// Worker thread, claiming ranges in order and filling them
+static void *crange_worker(void *arg) {
+    struct crange_pool *pool = (struct crange_pool*)arg;
+    struct crange *r;
+    size_t seq;
+    int err;
+
+    while(1) {
+        pthread_mutex_lock(&pool->mutex);
+
+        // Wait for a free slot, unless we're out of ranges
+        while(pool->next_seq < pool->total && pool->next_seq >= pool->done_seq + pool->slot_count) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+
+        if(pool->next_seq >= pool->total) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+
+        // Claim our range
+        seq = pool->next_seq++;
+        r = &pool->ranges[seq % pool->slot_count];
+        pthread_mutex_unlock(&pool->mutex);
+
+        r->seq = seq;
+        r->off = pool->start + (off_t)seq * pool->range_size;
+        r->len = pool->size - r->off < (off_t)pool->range_size ?
+            (size_t)(pool->size - r->off) : pool->range_size;
+
+        // Read it, and speculatively scan it as if it starts unquoted
+        if(!(err = crange_read(pool, r))) {
+            err = crange_scan(r, &pool->scanner, 0);
+        }
+
+        // Let our consumer know this one is ready
+        pthread_mutex_lock(&pool->mutex);
+        if(err) pool->error = err;
+        r->ready = 1;
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return NULL;
+}
+
+// Start our workers
+int crange_init(struct crange_pool *pool, int fd, const char *map, off_t start, off_t size,
+                size_t range_size, unsigned int thread_count, const struct csv_scanner *scanner)
+{
+    unsigned int i;
+    int ret;
+
+    // Ranges share offsets with our scanner flag, so can't be too big
+    if(range_size > CSV_SCAN_MAX || !thread_count) {
+        return EINVAL;
+    }
+
+    memset(pool, 0, sizeof(struct crange_pool));
+
+    pool->fd = fd;
+    pool->map = map;
+    pool->start = start;
+    pool->size = size;
+    pool->range_size = range_size;
+    pool->total = (size - start + range_size - 1) / range_size;
+    pool->scanner = *scanner;
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    // Two slots per worker so they can stay ahead of our consumer
+    pool->slot_count = thread_count * 2;
+    pool->ranges = calloc(pool->slot_count, sizeof *pool->ranges);
+    pool->threads = calloc(thread_count, sizeof *pool->threads);
+
+    if(!pool->ranges || !pool->threads) {
+        crange_free(pool);
+        return ENOMEM;
+    }
+
+    // We only need our own buffers if we're not reading from a mapping
+    for(i=0;i<pool->slot_count && !map;i++) {
+        if(!(pool->ranges[i].data = malloc(range_size))) {
+            crange_free(pool);
+            return ENOMEM;
+        }
+    }
+
+    // Start our workers, keeping track of how many we actually started
+    for(i=0;i<thread_count;i++,pool->thread_count++) {
+        if((ret = pthread_create(&pool->threads[i], NULL, crange_worker, (void*)pool))) {
+            crange_free(pool);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+// Get our next range, fixing it up if it actually starts inside quotes
+struct crange *crange_next(struct crange_pool *pool) {
+    struct crange *r;
+    size_t seq = pool->done_seq;
+
+    if(seq >= pool->total) {
+        return NULL;
+    }
+
+    r = &pool->ranges[seq % pool->slot_count];
+
+    // Wait for a worker to fill it
+    pthread_mutex_lock(&pool->mutex);
+    while(!pool->error && !(r->ready && r->seq == seq)) {
+        pthread_cond_wait(&pool->cond, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    if(pool->error) {
+        return NULL;
+    }
+
+    // Our guess was wrong, so scan it again from inside quotes
+    if(pool->in_quote && crange_scan(r, &pool->scanner, pool->in_quote) != 0) {
+        pool->error = ENOMEM;
+        return NULL;
+    }
+
+    // Quote state for the start of the next range
+    pool->in_quote = r->in_quote;
+
+    return r;
+}
+
+// Release a range so its slot can be refilled
+void crange_release(struct crange_pool *pool, struct crange *r) {
+    // We're done with these pages.  Ranges start on a multiple of our range
+    // size from where we started, which may not be on a page boundary, so
+    // we start from the page we begin in.  Anything before us in it has
+    // already been handed back.
+    if(pool->map) {
+        size_t skew = (uintptr_t)r->buf & (sysconf(_SC_PAGESIZE) - 1);
+        madvise((void*)(r->buf - skew), r->len + skew, MADV_DONTNEED);
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    r->ready = 0;
+    pool->done_seq++;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Stop our workers and free everything
+void crange_free(struct crange_pool *pool) {
+    unsigned int i;
+
+    // Make sure nobody is waiting on a slot that will never free up
+    pthread_mutex_lock(&pool->mutex);
+    pool->total = pool->next_seq;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for(i=0;i<pool->thread_count;i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->cond);
+
+    if(pool->ranges) {
+        for(i=0;i<pool->slot_count;i++) {
+            free(pool->ranges[i].data);
+            free(pool->ranges[i].idx);
+        }
+    }
+
+    free(pool->ranges);
+    free(pool->threads);
+    memset(pool, 0, sizeof(struct crange_pool));
+}
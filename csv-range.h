@@ -0,0 +1,136 @@
+/*
+ * csv-range.h
+ *
+ * Parallel range scanning for regular file inputs.  The file is cut into
+ * large byte ranges, and a pool of workers reads and scans them ahead of
+ * the thread consuming them.  As a worker can't know whether its range
+ * starts inside a quoted field, it speculatively scans as if it doesn't.
+ * Ranges are handed back strictly in order, and once the real quote state
+ * at a cut is known, any range that was scanned with the wrong assumption
+ * is rescanned before it's returned.
+ */
+
+#ifndef CSV_RANGE_H_
+#define CSV_RANGE_H_
+
+#include <pthread.h>
+#include <sys/types.h>
+#include "csv-scan.h"
+
+/**
+ * A range of our input, along with the scanner offsets for it
+ */
+struct crange {
+    /**
+     * Which range this is, and where it lives in our input
+     */
+    size_t seq;
+    off_t off;
+
+    /**
+     * The range data and its length.  This either points into our mapping
+     * of the file, or at data, which we read it into.
+     */
+    const char *buf;
+    char *data;
+    size_t len;
+
+    /**
+     * Structural offsets within buf, how many there are and how many
+     * we have room for
+     */
+    uint32_t *idx;
+    size_t n, idx_size;
+
+    /**
+     * Quote state at the end of the range, assuming it starts unquoted
+     */
+    uint64_t in_quote;
+
+    /**
+     * Set once a worker has filled this range
+     */
+    int ready;
+};
+
+/**
+ * Our pool of range workers
+ */
+struct crange_pool {
+    /**
+     * File we're reading (or its mapping), its size, and how big our
+     * ranges are
+     */
+    int fd;
+    const char *map;
+    off_t start, size;
+    size_t range_size;
+
+    /**
+     * Range slots, which workers fill in order and the consumer releases
+     * in order.  There are more slots than workers so we can read ahead.
+     */
+    struct crange *ranges;
+    unsigned int slot_count;
+
+    /**
+     * Total number of ranges, the next one for a worker to claim, and the
+     * number the consumer has released
+     */
+    size_t total, next_seq, done_seq;
+
+    /**
+     * Quote state at the start of the next range we'll hand back
+     */
+    uint64_t in_quote;
+
+    /**
+     * Scanner settings workers copy for each range
+     */
+    struct csv_scanner scanner;
+
+    /**
+     * Set if a worker couldn't read its range
+     */
+    int error;
+
+    /**
+     * Our workers
+     */
+    pthread_t *threads;
+    unsigned int thread_count;
+
+    /**
+     * Protects everything above, and lets us wait for slots to fill or free
+     */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+/**
+ * Start thread_count workers reading fd from start up to size bytes in
+ * range_size pieces, scanning them with the same settings as scanner.  start
+ * has to be a row boundary.  If map is not NULL it should be a mapping of
+ * the whole file, and ranges will point into it rather than being read.
+ */
+int crange_init(struct crange_pool *pool, int fd, const char *map, off_t start, off_t size,
+                size_t range_size, unsigned int thread_count, const struct csv_scanner *scanner);
+
+/**
+ * Get the next range in order, blocking until it's ready.  Returns NULL
+ * once every range has been handed back, or if we couldn't read one.
+ */
+struct crange *crange_next(struct crange_pool *pool);
+
+/**
+ * Hand a range back so its slot can be refilled.  If we're reading from a
+ * mapping, the kernel is told it can drop the range's pages.
+ */
+void crange_release(struct crange_pool *pool, struct crange *range);
+
+/**
+ * Join our workers and free everything
+ */
+void crange_free(struct crange_pool *pool);
+
+#endif /* CSV_RANGE_H_ */
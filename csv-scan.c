@@ -0,0 +1,174 @@
+/*
+ * csv-scan.c
+ *
+ * Vectorized CSV structural scanner.  SSE2 is our baseline on x86, with
+ * AVX2 picked at runtime when the CPU supports it, and a scalar fallback
+ * everywhere else.
+ */
+
+#include "csv-scan.h"
+#include <string.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define CSV_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+// Scalar block classifier
+static void classify_scalar(const struct csv_scanner *s, const unsigned char *p, struct csv_scan_masks *m) {
+    uint64_t quote = 0, delim = 0, lf = 0, bit;
+    int i;
+
+    for(i=0;i<CSV_SCAN_BLOCK;i++) {
+        bit = (uint64_t)1 << i;
+        if(p[i] == s->quote) quote |= bit;
+        else if(p[i] == s->delim) delim |= bit;
+        else if(p[i] == '\n') lf |= bit;
+    }
+
+    m->quote = quote;
+    m->delim = delim;
+    m->lf = lf;
+}
+
+// Prefix XOR, such that each bit is the XOR of itself and every bit below it
+static uint64_t prefix_xor_shift(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+#ifdef CSV_SCAN_X86
+
+// SSE2 classifier, four 16 byte lanes per block
+static void classify_sse2(const struct csv_scanner *s, const unsigned char *p, struct csv_scan_masks *m) {
+    const __m128i q = _mm_set1_epi8((char)s->quote);
+    const __m128i d = _mm_set1_epi8((char)s->delim);
+    const __m128i n = _mm_set1_epi8('\n');
+    uint64_t quote = 0, delim = 0, lf = 0;
+    __m128i v;
+    int i;
+
+    for(i=0;i<4;i++) {
+        v = _mm_loadu_si128((const __m128i*)(p + i*16));
+        quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, q)) << (i*16);
+        delim |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, d)) << (i*16);
+        lf    |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, n)) << (i*16);
+    }
+
+    m->quote = quote;
+    m->delim = delim;
+    m->lf = lf;
+}
+
+// AVX2 classifier, two 32 byte lanes per block
+__attribute__((target("avx2")))
+static void classify_avx2(const struct csv_scanner *s, const unsigned char *p, struct csv_scan_masks *m) {
+    const __m256i q = _mm256_set1_epi8((char)s->quote);
+    const __m256i d = _mm256_set1_epi8((char)s->delim);
+    const __m256i n = _mm256_set1_epi8('\n');
+    __m256i lo = _mm256_loadu_si256((const __m256i*)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i*)(p + 32));
+
+    m->quote = (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, q)) |
+               (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, q)) << 32;
+    m->delim = (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, d)) |
+               (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, d)) << 32;
+    m->lf    = (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, n)) |
+               (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, n)) << 32;
+}
+
+// Prefix XOR as a carry-less multiply by all ones
+__attribute__((target("pclmul")))
+static uint64_t prefix_xor_clmul(uint64_t x) {
+    __m128i v = _mm_set_epi64x(0, (long long)x);
+    __m128i ones = _mm_set1_epi8((char)0xff);
+    return (uint64_t)_mm_cvtsi128_si64(_mm_clmulepi64_si128(v, ones, 0));
+}
+
+#endif
+
+// Pick the best implementation this CPU supports
+void csv_scan_init(struct csv_scanner *s, unsigned char delim, unsigned char quote, int fields) {
+    memset(s, 0, sizeof(struct csv_scanner));
+
+    s->delim = delim;
+    s->quote = quote;
+    s->fields = fields;
+    s->classify = classify_scalar;
+    s->prefix_xor = prefix_xor_shift;
+
+#ifdef CSV_SCAN_X86
+    __builtin_cpu_init();
+
+    s->classify = classify_sse2;
+    if(__builtin_cpu_supports("avx2")) {
+        s->classify = classify_avx2;
+    }
+    if(__builtin_cpu_supports("pclmul")) {
+        s->prefix_xor = prefix_xor_clmul;
+    }
+#endif
+}
+
+// Which implementation we're using
+const char *csv_scan_impl(const struct csv_scanner *s) {
+#ifdef CSV_SCAN_X86
+    if(s->classify == classify_avx2) return "avx2";
+    if(s->classify == classify_sse2) return "sse2";
+#endif
+    return "scalar";
+}
+
+// Scan a single block, appending structural offsets to idx
+static inline size_t scan_block(struct csv_scanner *s, const unsigned char *p, uint32_t base,
+                                uint64_t valid, uint32_t *idx)
+{
+    struct csv_scan_masks m;
+    uint64_t quoted, structural;
+    size_t n = 0;
+    uint32_t bit;
+
+    s->classify(s, p, &m);
+
+    // Bytes inside quotes, continuing on from the last block.  An escaped
+    // quote ("") toggles twice, so it doesn't change anything.
+    quoted = s->prefix_xor(m.quote & valid) ^ s->in_quote;
+    s->in_quote = (uint64_t)((int64_t)quoted >> 63);
+
+    structural = (s->fields ? m.delim | m.lf : m.lf) & ~quoted & valid;
+
+    // Hand back every structural character we found
+    while(structural) {
+        bit = (uint32_t)__builtin_ctzll(structural);
+        idx[n++] = (base + bit) | ((m.lf >> bit) & 1 ? CSV_SCAN_ROW : 0);
+        structural &= structural - 1;
+    }
+
+    return n;
+}
+
+// Scan a buffer
+size_t csv_scan(struct csv_scanner *s, const char *buf, size_t len, uint32_t *idx) {
+    const unsigned char *p = (const unsigned char *)buf;
+    unsigned char tail[CSV_SCAN_BLOCK];
+    size_t pos = 0, n = 0, rem;
+
+    // Full blocks
+    for(;pos + CSV_SCAN_BLOCK <= len;pos += CSV_SCAN_BLOCK) {
+        n += scan_block(s, p + pos, (uint32_t)pos, ~(uint64_t)0, idx + n);
+    }
+
+    // Whatever is left gets copied into a padded block
+    if((rem = len - pos)) {
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, p + pos, rem);
+        n += scan_block(s, tail, (uint32_t)pos, ((uint64_t)1 << rem) - 1, idx + n);
+    }
+
+    return n;
+}
@@ -0,0 +1,92 @@
+/*
+ * csv-scan.h
+ *
+ * Vectorized CSV structural scanner.  Rather than walking the input one
+ * byte at a time through a state machine, we build bitmasks for quotes,
+ * delimiters and newlines 64 bytes at a time, work out which bytes are
+ * inside quoted fields with a prefix XOR, and hand back the offsets of
+ * every unquoted delimiter and row terminator in bulk.
+ */
+
+#ifndef CSV_SCAN_H_
+#define CSV_SCAN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Set on an offset returned by csv_scan() when it marks the end of a row
+ * (an unquoted line feed) rather than a field delimiter
+ */
+#define CSV_SCAN_ROW ((uint32_t)1 << 31)
+
+/**
+ * Largest buffer we can scan in a single call, as offsets share their
+ * top bit with CSV_SCAN_ROW
+ */
+#define CSV_SCAN_MAX (CSV_SCAN_ROW - 1)
+
+/**
+ * How many bytes we classify at a time
+ */
+#define CSV_SCAN_BLOCK 64
+
+/**
+ * Per block masks for our structural characters
+ */
+struct csv_scan_masks {
+    uint64_t quote;
+    uint64_t delim;
+    uint64_t lf;
+};
+
+/**
+ * Scanner state, which carries our quoting across calls so input can be
+ * fed through in arbitrary pieces
+ */
+struct csv_scanner {
+    /**
+     * All ones if the last byte we scanned was inside quotes, zero if not
+     */
+    uint64_t in_quote;
+
+    /**
+     * Characters we're looking for
+     */
+    unsigned char delim, quote;
+
+    /**
+     * Whether we should report delimiters, or just row ends
+     */
+    int fields;
+
+    /**
+     * Block classifier (scalar, SSE2 or AVX2), picked at init time
+     */
+    void (*classify)(const struct csv_scanner *s, const unsigned char *p, struct csv_scan_masks *m);
+
+    /**
+     * Prefix XOR implementation (shift based, or carry-less multiply)
+     */
+    uint64_t (*prefix_xor)(uint64_t x);
+};
+
+/**
+ * Initialize a scanner for the given delimiter and quote characters.  If
+ * fields is zero only row ends will be reported.
+ */
+void csv_scan_init(struct csv_scanner *s, unsigned char delim, unsigned char quote, int fields);
+
+/**
+ * Name of the implementation we picked (e.g. "avx2"), for diagnostics
+ */
+const char *csv_scan_impl(const struct csv_scanner *s);
+
+/**
+ * Scan len bytes (at most CSV_SCAN_MAX), storing the offsets of unquoted
+ * delimiters and row ends in idx in order.  Row ends have CSV_SCAN_ROW set.
+ * idx must have room for len entries.  Returns the number of offsets stored.
+ */
+size_t csv_scan(struct csv_scanner *s, const char *buf, size_t len, uint32_t *idx);
+
+#endif /* CSV_SCAN_H_ */
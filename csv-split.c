@@ -1,3 +1,6 @@
+// For O_DIRECT and sync_file_range()
+#define _GNU_SOURCE
+
 #include "csv-split.h"
 #include "csv-buf.h"
 #include "csv.h"
@@ -8,436 +11,2495 @@
 #include <time.h>
 #include <pthread.h>
 #include <zlib.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <glob.h>
+#include <dirent.h>
+#include <sys/resource.h>
 
 /**
- * Trigger a command when a job is done
+ * Our filesystem won't let us write a file with O_DIRECT, so we drop its
+ * pages from the cache once they're written instead
  */
-static void exec_trigger(const char *trigger_cmd, const char *job_file, unsigned long row_count) {
-	// The full trigger command we'll execute
-    char row_count_str[40];
+static void direct_fallback(struct out_file *file) {
+	static int warned;
 
-    // Get the row count in the form of a string
-    snprintf(row_count_str, sizeof(row_count_str), "%lu", row_count);
+	if(!__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED)) {
+		fprintf(stderr, "Warning:  Can't write '%s' with O_DIRECT, dropping written pages from the cache instead\n",
+		        file->path);
+	}
 
-    // Payload file
-    if(setenv(ENV_PAYLOAD_VAR, job_file, 1) != 0) {
-        fprintf(stderr, "Couldn't set environment variable: %d\n", errno);
-    }
-    
-    // Row count
-    if(setenv(ENV_ROWCOUNT_VAR, row_count_str, 1) != 0) {
-        fprintf(stderr, "Couldn't set environment variable: %d\n", errno);
-    }
+	file->direct = 0;
+	file->drop = 1;
+}
 
-	// Trigger our command
-    if(system(trigger_cmd) != 0) {
-        fprintf(stderr, "Error:  Couldn't execute system command \"%s\"\n", trigger_cmd);
-    }
+/**
+ * O_DIRECT only writes whole pages, so pad a file's last block out to one
+ * with zeros.  We cut the file back to size once it's written.
+ */
+static cbuf direct_pad(struct out_file *file, cbuf buf, size_t len) {
+	if(DIRECT_ROUND(len) == len) {
+		return buf;
+	}
+
+	if(CBUF_LEN(buf) < DIRECT_ROUND(len) && !(buf = cbuf_alloc(buf, DIRECT_ROUND(len)))) {
+		fprintf(stderr, "Error:  Couldn't allocate memory to write '%s'\n", file->path);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(buf + len, 0, DIRECT_ROUND(len) - len);
+	file->pad = 1;
+
+	return buf;
+}
+
+/**
+ * Write everything to a descriptor
+ */
+static int fd_write(int fd, const char *data, size_t len) {
+	ssize_t ret;
+
+	while(len) {
+		if((ret = write(fd, data, len)) < 0) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		data += ret;
+		len -= ret;
+	}
+
+	return 0;
 }
 
 /**
- * Write uncompressed data
+ * Open an output file, compressed or not
  */
-static void write_file(const char *file, const char *data, size_t len) {
+static void out_open(struct csv_context *ctx, struct out_file *file) {
+	file->off = file->dropped = 0;
+
+	// Bypass the page cache if we've been asked to and our filesystem lets us
+	if(file->direct && (file->fd = open(file->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0666)) < 0) {
+		if(errno != EINVAL) {
+			fprintf(stderr, "Error:  Unable to open output file '%s'\n", file->path);
+			exit(EXIT_FAILURE);
+		}
+		direct_fallback(file);
+	}
+	if(file->direct) {
+		return;
+	}
+
 	// Attempt to open the file
-	FILE *fp = fopen(file, "w");
+	file->fp = fopen(file->path, "wb");
 
 	// Bomb out if we can't open the file
-	if(!fp) {
-		fprintf(stderr, "Error:  Unable to open output file '%s\n", file);
+	if(!file->fp) {
+		fprintf(stderr, "Error:  Unable to open output file '%s'\n", file->path);
 		exit(EXIT_FAILURE);
 	}
 
-
-	// Attempt to write our data and abort if we can not
-	if(fwrite(data, 1, len, fp) != len) {
-		fprintf(stderr, "Error:  Unable to write all data to file '%s'\n", file);
+	// Start our compressed stream if we're compressing
+	if(file->codec && !(file->cstate = file->codec->open(&ctx->codec_opts))) {
+		fprintf(stderr, "Error:  Unable to start %s stream for '%s'\n", file->codec->name, file->path);
 		exit(EXIT_FAILURE);
 	}
-
-	// Close our file
-	fclose(fp);
 }
 
 /**
- * Write gz compressed data
+ * Drop what we've written from the page cache.  Pages have to be written
+ * back before they can be dropped, so we start writing back each block as
+ * we finish it and wait for it (and drop it) after the next, which gives
+ * the disk a block's worth of time to catch up.
  */
-static void write_gz_file(const char *file, const char *data, size_t len, int level) {
-	// Compression mode (level)
-	char mode[255];
+static int out_drop(struct out_file *file, int last) {
+	int fd = fileno(file->fp);
+	off_t end;
+
+	if(fflush(file->fp) != 0 || (end = ftello(file->fp)) < 0) {
+		return -1;
+	}
+
+	// Wait for the block we started writing back last time, and drop it
+	if(file->off > file->dropped) {
+		sync_file_range(fd, file->dropped, file->off - file->dropped,
+		                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(fd, file->dropped, file->off - file->dropped, POSIX_FADV_DONTNEED);
+		file->dropped = file->off;
+	}
+
+	if(last) {
+		// Nothing comes after us, so wait on the rest now
+		sync_file_range(fd, file->dropped, 0,
+		                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	} else if(end > file->off) {
+		sync_file_range(fd, file->off, end - file->off, SYNC_FILE_RANGE_WRITE);
+	}
 
-	// Default compression or specific compression level
-	if(level == Z_DEFAULT_COMPRESSION) {
-		strncpy(mode,"wb",sizeof(mode));
+	file->off = end;
+
+	return 0;
+}
+
+/**
+ * Write a block of data to an open output file, finishing our compressed
+ * stream if this is the last one.  Writing with O_DIRECT, every block but
+ * the last is a whole number of pages, and the last has been padded out.
+ */
+static void out_write(struct csv_context *ctx, struct out_file *file, const char *data, size_t len, int last) {
+	int failed;
+
+	// Attempt to write our data (compressed or not) and abort if we can not
+	if(file->direct) {
+		failed = fd_write(file->fd, data, last ? DIRECT_ROUND(len) : len) != 0;
+		file->off += len;
+	} else if(file->codec) {
+		failed = file->codec->write(file->cstate, file->fp, data, len, last) != 0;
 	} else {
-		snprintf(mode,sizeof(mode),"wb%d",level);
+		failed = len && fwrite(data, 1, len, file->fp) != len;
 	}
 
-	// Open our file
-	gzFile fp = gzopen(file,mode);
+	if(!failed && file->drop) {
+		failed = out_drop(file, last) != 0;
+	}
 
-	// Bomb out if we can't open the file
-	if(!fp) {
-		fprintf(stderr, "Error:  Unable to open output file '%s'\n", file);
+	if(failed) {
+		fprintf(stderr, "Error:  Unable to write all data to file '%s'\n", file->path);
 		exit(EXIT_FAILURE);
 	}
+}
+
+/**
+ * Close an output file, cutting it back to size if we padded it
+ */
+static void out_close(struct out_file *file) {
+	if(file->direct) {
+		if(file->pad && ftruncate(file->fd, file->off) != 0) {
+			fprintf(stderr, "Error:  Unable to truncate output file '%s'\n", file->path);
+			exit(EXIT_FAILURE);
+		}
+		if(file->sync && fsync(file->fd) != 0) {
+			fprintf(stderr, "Error:  Unable to sync output file '%s'\n", file->path);
+			exit(EXIT_FAILURE);
+		}
+		close(file->fd);
+		return;
+	}
 
-	// Attempt to write our data compressed
-	if(gzwrite(fp, data, len) != len) {
-		fprintf(stderr, "Error:  Unable to write all data to file '%s'\n", file);
+	if(file->codec) {
+		file->codec->free(file->cstate);
+	}
+
+	// Make sure we're on disk before we're checkpointed
+	if(file->sync && (fflush(file->fp) != 0 || fsync(fileno(file->fp)) != 0)) {
+		fprintf(stderr, "Error:  Unable to sync output file '%s'\n", file->path);
 		exit(EXIT_FAILURE);
 	}
+	fclose(file->fp);
+}
 
-	// Close our file
-	gzclose(fp);
+/**
+ * Free a file we're done with
+ */
+static void file_free(struct csv_context *ctx, struct out_file *file) {
+    free(file->group);
+    slab_free(&ctx->file_slab, file);
 }
 
 /**
- * Our IO worker thread, where we wait on our IO queue (files to be written)
- * and write them as we get them.  Once the queue is flagged done, we'll finish
+ * Checkpoint a file we've written and synced.  Our IO threads can finish
+ * files out of order, so a file that's done before those ahead of it is
+ * held until they are, and we checkpoint the last of every run of files
+ * that are all done.
  */
-void *io_worker(void *arg) {
-    // Grab our queue
-    fqueue *queue = (fqueue*)arg;
+static void checkpoint_file(struct csv_context *ctx, struct out_file *file) {
+    struct out_file **fpp, *last = NULL;
+    int err;
 
-    struct q_flush_item *item;
-    void *itm_ptr;
-    char out_file[1024];
+    pthread_mutex_lock(&ctx->ckpt_mutex);
 
-    // Block until we have work, or we're done
-    while(!fq_get(queue, &itm_ptr)) {
-        // Assign the item for us
-        item = itm_ptr;
+    // Hold our files in order
+    for(fpp=&ctx->ckpt_held;*fpp && (*fpp)->num < file->num;fpp=&(*fpp)->held_next);
+    file->held_next = *fpp;
+    *fpp = file;
 
-        // Write either uncompressed or compressed data
-        if(item->gzip) {
-            // Append gz extension and write the file
-            snprintf(out_file, sizeof(out_file),"%s.gz", item->out_file);
-            write_gz_file(out_file, item->str, item->len, item->gzip);
-        } else {
-        	// We're writing to the filename passed
-        	strncpy(out_file, item->out_file, sizeof(out_file));
-        	write_file(out_file, item->str, item->len);
+    // Take every file that's next in line
+    while(ctx->ckpt_held && ctx->ckpt_held->num == ctx->ckpt.on_file + 1) {
+        if(last) {
+            file_free(ctx, last);
         }
+        last = ctx->ckpt_held;
+        ctx->ckpt_held = last->held_next;
+        ctx->ckpt.on_file = last->num;
+    }
+
+    if(last) {
+        ctx->ckpt.offset = last->in_end;
+        ctx->ckpt.header_end = ctx->header_end;
+        ctx->ckpt.header = ctx->header_buf;
+        ctx->ckpt.header_len = ctx->header_len;
+        ctx->ckpt.group = last->group;
+        ctx->ckpt.group_len = last->group_len;
 
-        // Execute our trigger if one is set
-        if(item->trigger_cmd) {
-            exec_trigger(item->trigger_cmd, out_file, item->row_count);
+        if((err = ckpt_write(ctx->ckpt_path, &ctx->ckpt))) {
+            fprintf(stderr, "Error:  Couldn't write checkpoint '%s': %s\n", ctx->ckpt_path, strerror(err));
+            exit(EXIT_FAILURE);
         }
 
-        // Now free our memory as this was a copy
-        free(item->str);
-        free(item);
+        // Our checkpoint doesn't own these
+        ctx->ckpt.header = ctx->ckpt.group = NULL;
+        file_free(ctx, last);
     }
 
-    return NULL;
+    pthread_mutex_unlock(&ctx->ckpt_mutex);
 }
 
-// We're ready to split this file off, so package up information for our queue, 
-// add it, and send it to one of our IO threads
-void flush_file(struct csv_context *ctx, unsigned int use_ovr) {
-    // Create a queue item
-    struct q_flush_item *q_item = malloc(sizeof(struct q_flush_item));
-
-    // If we've got an overflow position and we're supposed to use it, do so
-    size_t flush_len = use_ovr && ctx->opos ? ctx->opos : CBUF_POS(ctx->csv_buf);
+/**
+ * Finish with a file we've closed, queueing our trigger if one is set.  It
+ * runs in the background while we get on with writing.
+ */
+static void file_done(struct csv_context *ctx, struct out_file *file, unsigned long row_count) {
+    if(file->trigger_cmd && trigger_add(&ctx->triggers, file->trigger_cmd, file->path, row_count) != 0) {
+        fprintf(stderr, "Error:  Couldn't queue trigger for '%s'\n", file->path);
+    }
 
-    // Copy in our filename
-    sprintf(q_item->out_file, "%s%s.%05d", ctx->out_path, ctx->in_prefix, ++ctx->on_file);
+    pthread_mutex_destroy(&file->mutex);
+    pthread_cond_destroy(&file->cond);
 
-    // If we've got a non empty trigger command, set it in our item
-    if(*ctx->trigger_cmd) {
-    	q_item->trigger_cmd = (const char *)ctx->trigger_cmd;
+    if(file->sync) {
+        checkpoint_file(ctx, file);
     } else {
-    	q_item->trigger_cmd = NULL;
+        file_free(ctx, file);
     }
+}
 
-    // Store the number of rows we're going to write
-    q_item->row_count = ctx->row;
+/**
+ * Add a block to our IO queue.  If our queue is bounded by bytes, we wait
+ * until there's room for our buffer, unless the queue is empty, so a block
+ * bigger than our limit still gets through on its own.
+ */
+static void io_queue_add(struct csv_context *ctx, struct q_flush_item *item) {
+    uint64_t start = 0;
 
-    // Make a copy of our buffer, and store our length
-    q_item->str = cbuf_duplen(ctx->csv_buf, &flush_len);
-    q_item->len = flush_len;
+    if(ctx->queue_bytes) {
+        item->bytes = CBUF_LEN(item->str);
 
-    // Set our gzip flag
-    q_item->gzip = ctx->gzip;
+        pthread_mutex_lock(&ctx->bytes_mutex);
+        while(ctx->queued_bytes && ctx->queued_bytes + item->bytes > ctx->queue_bytes) {
+            if(!start && (start = stats_start())) {
+                stats_add(STAT_FULL_WAITS, 1);
+            }
+            pthread_cond_wait(&ctx->bytes_cond, &ctx->bytes_mutex);
+        }
+        __atomic_add_fetch(&ctx->queued_bytes, item->bytes, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&ctx->bytes_mutex);
 
-    // Chop our output buffer to the length of our header.  If we're not
-    // injecting headers, header_len will be zero.
-    CBUF_SETPOS(ctx->csv_buf, ctx->header_len);
+        if(start) {
+            stats_stop(STAT_FULL_NS, start);
+        }
+    }
 
-    // Reset our row count (zero unless we're counting the header)
-    ctx->row  = ctx->count_header ? 1 : 0;
-    
-    // Reset overflow position
-    ctx->opos = 0;
+    fq_add(&ctx->io_queue, (void*)item);
+}
 
-    // Add to our blocking/limited queue
-    fq_add(&ctx->io_queue, (void*)q_item);
+/**
+ * We've taken a block from our IO queue, which makes room for more if it's
+ * bounded by bytes
+ */
+static void io_queue_took(struct csv_context *ctx, struct q_flush_item *item) {
+    if(ctx->queue_bytes) {
+        pthread_mutex_lock(&ctx->bytes_mutex);
+        __atomic_sub_fetch(&ctx->queued_bytes, item->bytes, __ATOMIC_RELAXED);
+        pthread_cond_broadcast(&ctx->bytes_cond);
+        pthread_mutex_unlock(&ctx->bytes_mutex);
+    }
 }
 
 /**
- * Column callback
+ * If we've been asked to shrink our IO pool, and nobody else has yet, stop.
+ * Our slot is joined when it's next needed, or when we're done.
  */
-static inline void cb_col(void *s, size_t len, void *data) {
-    struct csv_context *ctx = (struct csv_context *)data;
-    size_t cnt;
+static int io_should_stop(struct csv_context *ctx) {
+    unsigned int i;
+    int ret = 0;
 
-    // Put a comma if we should
-    if(ctx->put_comma) {
-        ctx->csv_buf = cbuf_putc(ctx->csv_buf, ',');
+    if(!__atomic_load_n(&ctx->io_retire, __ATOMIC_RELAXED)) {
+        return 0;
     }
-    ctx->put_comma = 1;
 
-    // If we are keeping same columns together see if we're on one
-    if(ctx->gcol > -1 && ctx->col == ctx->gcol) {
-        // Don't treat header columns as a group column
-        if(!ctx->use_header || ctx->header_len) {
-            // If we have a last column value and we're in overflow, check
-	    	// the new row's value against the last one
-            if(ctx->gcol_buf && ctx->opos && memcmp(ctx->gcol_buf, s, len) != 0) {
-                // Flush the data we have!
-                flush_file(ctx, 1);
-            } else if(!ctx->gcol_buf) {
-                // Initialize a new group column buffer
-                ctx->gcol_buf = cbuf_init(len);
+    pthread_mutex_lock(&ctx->adapt_mutex);
+    if(ctx->io_retire) {
+        ctx->io_retire--;
+        ctx->io_running--;
+        for(i=0;i<ctx->thread_max;i++) {
+            if(ctx->io_live[i] == 1 && pthread_equal(ctx->io_threads[i], pthread_self())) {
+                ctx->io_live[i] = 2;
             }
-
-            // Update our last group column value
-            ctx->gcol_buf = cbuf_setlen(ctx->gcol_buf, (const char*)s, len);
         }
+        ret = 1;
     }
+    pthread_mutex_unlock(&ctx->adapt_mutex);
 
-    // Make sure we can write all the data
-    while((cnt = csv_write(CBUF_PTR(ctx->csv_buf), CBUF_REM(ctx->csv_buf), s, len)) > CBUF_REM(ctx->csv_buf)) {
-        // We didn't have room, reallocate
-        ctx->csv_buf = cbuf_double(ctx->csv_buf);
-    }
-
-    // Increment where we are in our buffer
-    CBUF_POS(ctx->csv_buf)+=cnt;
-
-    // Increment our column
-    ctx->col++;
+    return ret;
 }
 
 /**
- * Row parsing callback
+ * Our IO worker thread, where we wait on our IO queue (blocks of files to be
+ * written) and write them as we get them.  Blocks of the same file are always
+ * written in order, and the file is opened with its first block and closed
+ * (and our trigger executed) with its last.  Once the queue is flagged done,
+ * we'll finish
  */
-void cb_row(int c, void *data) {
-    // Type cast to our context structure
-    struct csv_context *ctx = (struct csv_context*)data;
+void *io_worker(void *arg) {
+    // Grab our context and queue
+    struct csv_context *ctx = (struct csv_context*)arg;
+    fqueue *queue = &ctx->io_queue;
 
-    // Put a newline
-    ctx->csv_buf = cbuf_putc(ctx->csv_buf, '\n');
+    struct q_flush_item *item;
+    struct out_file *file;
+    void *itm_ptr;
+    uint64_t start, busy;
 
-    // If we're injecting headers, and we don't have a header length, then
-    // this row is a header.  Otherwise, just increment our row count.
-    if(ctx->use_header && !ctx->header_len) {
-        // Set the length of our header
-        ctx->header_len = CBUF_POS(ctx->csv_buf);
-        
-        // Only increment our row count if we're counting header rows
-        if(ctx->count_header) {
-            ctx->row++;
+    stats_thread(STATS_IO);
+
+    // Block until we have work, or we're done (or no longer needed)
+    while(!io_should_stop(ctx) && !fq_get(queue, &itm_ptr)) {
+        // Assign the item for us, and time how long it keeps us busy if
+        // that's how we size our pool
+        item = itm_ptr;
+        file = item->file;
+        busy = ctx->thread_max ? stats_ns() : 0;
+        io_queue_took(ctx, item);
+
+        // Wait for any earlier blocks of this file to be written.  They were
+        // queued before us, so another IO thread already has them.
+        pthread_mutex_lock(&file->mutex);
+        while(file->next_seq != item->seq) {
+            pthread_cond_wait(&file->cond, &file->mutex);
         }
-    } else {
-        // Increment row count
-        ctx->row++;
-    }
 
-    // If we're at or above our row limit, either keep track/ of the position
-    // of this row (if we're grouping columns), or write these rows to disk.
-    if(ctx->row >= ctx->max_rows) {
-        // Mark the position of this row if we're grouping columns, or flush
-        if(ctx->gcol >= 0) {
-            ctx->opos = CBUF_POS(ctx->csv_buf);
+        // Open with our first block, write, and close with our last
+        if(item->seq == 0) {
+            out_open(ctx, file);
+        }
+        if(file->direct && item->last) {
+            item->str = direct_pad(file, item->str, item->len);
+        }
+        // Keep track of how well we're compressing, so we can estimate how big
+        // our files will be
+        start = stats_start();
+        if(file->codec) {
+            long before = ftell(file->fp);
+            out_write(ctx, file, item->str, item->len, item->last);
+            __atomic_add_fetch(&ctx->written_in, item->len, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&ctx->written_out, ftell(file->fp) - before, __ATOMIC_RELAXED);
+            stats_stop(STAT_COMPRESS_NS, start);
+            stats_add(STAT_WRITE_OUT, ftell(file->fp) - before);
         } else {
-            flush_file(ctx, 0);
+            out_write(ctx, file, item->str, item->len, item->last);
+            stats_stop(STAT_WRITE_NS, start);
+            stats_add(STAT_WRITE_OUT, item->len);
+        }
+        stats_add(STAT_WRITE_IN, item->len);
+        stats_add(STAT_BLOCKS, 1);
+        if(item->last) {
+            out_close(file);
+            stats_add(STAT_FILES, 1);
         }
-    }
 
-    // Back on column zero
-    ctx->col=0;
+        // Let the next block go
+        file->next_seq++;
+        pthread_cond_broadcast(&file->cond);
+        pthread_mutex_unlock(&file->mutex);
 
-    // We don't need a comma for the next column
-    ctx->put_comma = 0;
+        // Once the file is done, queue our trigger and free it
+        if(item->last) {
+            file_done(ctx, file, item->row_count);
+        }
+
+        // Recycle our buffer and our item
+        cbuf_pool_put(&ctx->buf_pool, item->str);
+        slab_free(&ctx->item_slab, item);
+
+        if(busy) {
+            __atomic_add_fetch(&ctx->io_busy_ns, stats_ns() - busy, __ATOMIC_RELAXED);
+        }
+    }
+
+    return NULL;
 }
 
 /**
- * Usage function
+ * io_uring operations.  Files and queue items come from our slab caches, so
+ * they're aligned well enough for us to tag their addresses with what we
+ * did with them.
  */
-void print_usage(char *exec) {
-    printf("Usage:  %s [options] FILE\n", exec);
+#define URING_OPEN  1
+#define URING_WRITE 2
+#define URING_CLOSE 3
+#define URING_DROP  4
+#define URING_SYNC  5
+
+#define URING_TAG(p, op) ((uint64_t)(uintptr_t)(p) | (op))
+#define URING_OP(data)   ((int)((data) & 15))
+#define URING_PTR(data)  ((void*)(uintptr_t)((data) & ~(uint64_t)15))
+
+// Get a submission entry, or give up
+static struct io_uring_sqe *uring_get(struct csv_context *ctx) {
+    struct io_uring_sqe *sqe;
+
+    if(!(sqe = uring_sqe(&ctx->ring))) {
+        fprintf(stderr, "Error:  Couldn't submit to io_uring: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    ctx->uring_ops++;
+    return sqe;
+}
+
+// Open a file, with O_DIRECT if we're bypassing the page cache
+static void uring_open(struct csv_context *ctx, struct out_file *file) {
+    uring_prep_openat(uring_get(ctx), file->path,
+                      O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | (file->direct ? O_DIRECT : 0), 0666,
+                      URING_TAG(file, URING_OPEN));
 }
 
 /**
- * Parse arguments
+ * Close a file once its last block has arrived and everything has been
+ * written, cutting it back to size first if we padded it.  If we're
+ * dropping our pages from the cache, we wait for them to be written back
+ * and drop them on the way.  Those are linked to our close, which runs
+ * whether they work or not.
  */
-int parse_args(struct csv_context *ctx, int argc, char **argv) {
-    int opt, opt_idx, intval;
-    char *ptr;
+static void uring_maybe_close(struct csv_context *ctx, struct out_file *file) {
+    struct io_uring_sqe *sqe;
 
-    // While we've got arguments to parse
-    while((opt = getopt_long(argc, argv, "g:n:v:i:z::hd::", g_long_opts, &opt_idx)) != -1) {
-        switch(opt) {
-            case 't':
-                strncpy(ctx->trigger_cmd, optarg, sizeof(ctx->trigger_cmd));
-        		break;
-            case 'g':
-                ctx->gcol = atoi(optarg);
-                break;
-            case 'n':
-                intval = atoi(optarg);
-                if(intval < 1) {
-                    fprintf(stderr, "Number of lines per file must be a positive integer!\n");
-                    exit(EXIT_FAILURE);
-                }
-                ctx->max_rows = intval;
-                break;
-            case 'i':
-                if(optarg) {
-                	intval = atoi(optarg);
-                	if(intval < IO_THREADS_MIN || intval > IO_THREADS_MAX) {
-                		fprintf(stderr, "Thread count must be in range %d - %d\n",
-                				IO_THREADS_MIN, IO_THREADS_MAX);
-                		exit(EXIT_FAILURE);
-                	}
-                	ctx->thread_count = intval;
-                }
-                break;
-            case 'z':
-            	ctx->gzip = Z_DEFAULT_COMPRESSION;
-            	if(optarg) {
-            		intval = atoi(optarg);
-            		if(intval >= Z_BEST_SPEED && intval <= Z_BEST_COMPRESSION) {
-            			ctx->gzip = intval;
-            		} else {
-            			fprintf(stderr, "Unknown compression level: %d\n", intval);
-            		}
-            	}
-            	break;
-            case 'd':
-                ctx->use_header = 1;
-                if(optarg) {
-                    intval = atoi(optarg);
-                    ctx->count_header = intval != 0;
-                }
-                break;
-            case 'h':
-            case '?':
-                print_usage(argv[0]);
-                exit(EXIT_FAILURE);
-            case 'v':
-                printf("csv-split " CSV_SPLIT_VERSION "\n");
-                exit(EXIT_SUCCESS);
-            case 0:
-                // Parse from STDIN
-                if(!strcmp("stdin", g_long_opts[opt_idx].name)) {
-                    ctx->from_stdin = 1;
-                }
-                break;
-        }
+    if(!file->got_last || file->fd < 0 || file->inflight || file->pending) {
+        return;
     }
 
-    // Make sure we have been passed a num-rows argument
-    if(!ctx->max_rows) {
-        fprintf(stderr, "Must specify the --num-rows (-n) argument!\n");
+    if(file->pad && ftruncate(file->fd, file->off) != 0) {
+        fprintf(stderr, "Error:  Unable to truncate output file '%s'\n", file->path);
         exit(EXIT_FAILURE);
     }
 
-    // Sanity check against "counting the header row" and splitting to one line per file
-    if(ctx->count_header && ctx->max_rows < 2) {
-        fprintf(stderr, "--num-rows must be > 1 if we're counting headers as rows!\n");
-        exit(EXIT_FAILURE);
-    }
+    if(file->drop) {
+        sqe = uring_get(ctx);
+        uring_prep_sync_file_range(sqe, file->fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                   SYNC_FILE_RANGE_WAIT_AFTER, URING_TAG(file, URING_DROP));
+        sqe->flags |= IOSQE_IO_HARDLINK;
 
-    // Get the filename we're reading or the prefix to use if reading from STDIN
-    if(!argv[optind] || !*argv[optind]) {
-        fprintf(stderr, "Must specify a file to process or a prefix to use if reading from STDIN!\n");
-        exit(EXIT_FAILURE);
+        sqe = uring_get(ctx);
+        uring_prep_fadvise(sqe, file->fd, 0, 0, POSIX_FADV_DONTNEED, URING_TAG(file, URING_DROP));
+        sqe->flags |= IOSQE_IO_HARDLINK;
     }
 
-    // Copy in our input file, move to next argument
-    strcpy(ctx->in_file, argv[optind++]);
-
-    // If we find that there are path parts in the file, keep track of just the basename
-    if((ptr = strrchr(ctx->in_file, '/'))) {
-        ctx->in_prefix = ptr+1;
-    } else {
-        ctx->in_prefix = ctx->in_file;
+    // If we're checkpointing, we have to be on disk before we're closed
+    if(file->sync) {
+        sqe = uring_get(ctx);
+        uring_prep_fsync(sqe, file->fd, URING_TAG(file, URING_SYNC));
+        sqe->flags |= IOSQE_IO_HARDLINK;
     }
 
-    // Set our output path if it's not set
-    if(argv[optind] && *argv[optind]) {
-    	// Copy in our output path
-    	strcpy(ctx->out_path, argv[optind]);
+    uring_prep_close(uring_get(ctx), file->fd, URING_TAG(file, URING_CLOSE));
+}
 
-    	// Terminate with a '/' if it's not already terminated
-    	if(ctx->out_path[strlen(ctx->out_path)]-1 != '/') {
-    		strcat(ctx->out_path, "/");
-    	}
+/**
+ * Write whatever's left of a block, or if it's all written, recycle it
+ */
+static void uring_write(struct csv_context *ctx, struct q_flush_item *item) {
+    struct out_file *file = item->file;
+    size_t len = item->len - item->done;
+
+    if(len) {
+        uring_prep_write(uring_get(ctx), file->fd, item->str + item->done,
+                         len < URING_WRITE_MAX ? len : URING_WRITE_MAX, item->off + item->done,
+                         URING_TAG(item, URING_WRITE));
+        file->inflight++;
+        return;
     }
 
-    // Success
-    return 0;
+    cbuf_pool_put(&ctx->buf_pool, item->str);
+    slab_free(&ctx->item_slab, item);
+    ctx->uring_blocks--;
+
+    uring_maybe_close(ctx, file);
 }
 
 /**
- * Spin up our threads
+ * Take a block from our queue.  Blocks of a file arrive in order, so each
+ * one's position is known up front, and they can all be written at once.
  */
-void spool_threads(struct csv_context *ctx) {
-    int i;
+static void uring_block(struct csv_context *ctx, struct q_flush_item *item) {
+    struct out_file *file = item->file;
 
-    // Iterate up to our thread count
-    for(i=0;i<ctx->thread_count;i++) {
-        // We have to fail if our background threads fail to initialize
-        if(pthread_create(&ctx->io_threads[i], NULL, io_worker, (void*)&ctx->io_queue) != 0) {
-            fprintf(stderr, "Couldn't start background IO threads!\n");
-            exit(EXIT_FAILURE);
+    ctx->uring_blocks++;
+
+    // Open our file with its first block
+    if(item->seq == 0) {
+        file->fd = -1;
+        file->off = 0;
+        file->pending = file->pending_tail = NULL;
+        file->inflight = 0;
+        file->got_last = 0;
+
+        uring_open(ctx, file);
+    }
+
+    item->off = file->off;
+    item->done = 0;
+    item->next = NULL;
+    file->off += item->len;
+
+    stats_add(STAT_BLOCKS, 1);
+    stats_add(STAT_WRITE_IN, item->len);
+
+    // Our last block goes out as whole pages if we're writing with O_DIRECT
+    if(item->last) {
+        file->got_last = 1;
+        file->row_count = item->row_count;
+        if(file->direct) {
+            item->str = direct_pad(file, item->str, item->len);
+            item->len = DIRECT_ROUND(item->len);
+        }
+    }
+
+    // Wait for our file to be opened if it hasn't been yet
+    if(file->fd < 0) {
+        if(file->pending_tail) {
+            file->pending_tail->next = item;
+        } else {
+            file->pending = item;
         }
+        file->pending_tail = item;
+    } else {
+        uring_write(ctx, item);
     }
 }
 
 /**
- * Wait for threads to exit
+ * Handle a finished operation
  */
-void join_threads(struct csv_context *ctx) {
-    int i=0;
+static void uring_complete(struct csv_context *ctx, uint64_t data, int res) {
+    struct q_flush_item *item, *next;
+    struct out_file *file;
+
+    ctx->uring_ops--;
+
+    switch(URING_OP(data)) {
+        case URING_OPEN:
+            file = URING_PTR(data);
+            if(res == -EINVAL && file->direct) {
+                direct_fallback(file);
+                uring_open(ctx, file);
+                break;
+            } else if(res < 0) {
+                fprintf(stderr, "Error:  Unable to open output file '%s'\n", file->path);
+                exit(EXIT_FAILURE);
+            }
 
-    // Iterate, joining on threads
-    for(i=0;i<ctx->thread_count;i++) {
+            // Write everything that was waiting for us
+            file->fd = res;
+            for(item=file->pending,file->pending=file->pending_tail=NULL;item;item=next) {
+                next = item->next;
+                uring_write(ctx, item);
+            }
+            uring_maybe_close(ctx, file);
+            break;
+        case URING_WRITE:
+            item = URING_PTR(data);
+            file = item->file;
+            if(res == -EINTR || res == -EAGAIN) {
+                res = 0;
+            } else if(res <= 0) {
+                fprintf(stderr, "Error:  Unable to write all data to file '%s'\n", file->path);
+                exit(EXIT_FAILURE);
+            }
+
+            // Write anything we came up short on, or recycle our block
+            stats_add(STAT_WRITE_OUT, res);
+            file->inflight--;
+            item->done += res;
+            uring_write(ctx, item);
+            break;
+        case URING_CLOSE:
+            file = URING_PTR(data);
+            if(res < 0) {
+                fprintf(stderr, "Error:  Unable to close output file '%s'\n", file->path);
+                exit(EXIT_FAILURE);
+            }
+            stats_add(STAT_FILES, 1);
+            file_done(ctx, file, file->row_count);
+            break;
+        case URING_DROP:
+            // Dropping our pages is only advice, so it doesn't matter if it fails
+            break;
+        case URING_SYNC:
+            file = URING_PTR(data);
+            if(res < 0) {
+                fprintf(stderr, "Error:  Unable to sync output file '%s'\n", file->path);
+                exit(EXIT_FAILURE);
+            }
+            break;
+    }
+}
+
+/**
+ * Our io_uring writer.  One thread takes blocks from our queue and keeps
+ * their opens, writes and closes in flight all at once, submitting them
+ * with one system call each time around, instead of each IO thread writing
+ * one file at a time.
+ */
+void *uring_worker(void *arg) {
+    struct csv_context *ctx = (struct csv_context*)arg;
+    unsigned int max_blocks = ctx->queue_size < URING_BLOCKS_MAX ? ctx->queue_size : URING_BLOCKS_MAX;
+    struct io_uring_cqe *cqe;
+    void *itm_ptr;
+    uint64_t start;
+    int ret, done = 0;
+
+    stats_thread(STATS_IO);
+
+    while(!done || ctx->uring_ops) {
+        // Take what's waiting in our queue, blocking only if we have
+        // nothing else to do
+        while(!done && ctx->uring_blocks < max_blocks) {
+            ret = ctx->uring_ops ? fq_poll(&ctx->io_queue, &itm_ptr) : fq_get(&ctx->io_queue, &itm_ptr);
+            if(ret == EAGAIN) {
+                break;
+            } else if(ret) {
+                done = 1;
+            } else {
+                io_queue_took(ctx, (struct q_flush_item*)itm_ptr);
+                uring_block(ctx, (struct q_flush_item*)itm_ptr);
+            }
+        }
+
+        if(!ctx->uring_ops) {
+            continue;
+        }
+
+        // Submit everything, and wait for something to finish
+        start = stats_start();
+        if((ret = uring_submit(&ctx->ring, 1)) && ret != EBUSY && ret != EAGAIN) {
+            fprintf(stderr, "Error:  io_uring failed: %s\n", strerror(ret));
+            exit(EXIT_FAILURE);
+        }
+        stats_stop(STAT_WRITE_NS, start);
+
+        while((cqe = uring_cqe(&ctx->ring))) {
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+
+            uring_seen(&ctx->ring);
+            uring_complete(ctx, data, res);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Start a new output file, either our next one or the next one for a
+ * partition if part isn't NULL
+ */
+static struct out_file *out_file_new(struct csv_context *ctx, struct partition *part) {
+    struct out_file *file = slab_alloc(&ctx->run->file_slab);
+    const char *ext = ctx->codec ? ctx->codec->ext : "";
+    unsigned int n = part ? ++part->on_file : ++ctx->on_file;
+    size_t len = strlen(ctx->out_path);
+    int ret, err;
+
+    // Build our filename from our template, with our partition number if we
+    // have one, and our codec's extension if we're compressing
+    memcpy(file->path, ctx->out_path, len);
+    ret = outname_format(&ctx->out_name, file->path + len, sizeof(file->path) - len, ctx->in_prefix, n,
+                         (n - 1) / ctx->shard_size, part ? (unsigned int)(part - ctx->parts) : 0);
+    if(ret < 0 || len + ret + strlen(ext) >= sizeof(file->path)) {
+        fprintf(stderr, "Error:  Output file name for '%s' is too long\n", ctx->in_prefix);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(file->path + len + ret, ext);
+    file->num = ctx->on_file;
+
+    // Make our file's directory the first time we put a file in it
+    if(ctx->out_name.dirs && (err = dircache_make(&ctx->run->dirs, file->path)) != 0) {
+        fprintf(stderr, "Error:  Unable to make a directory for '%s': %s\n", file->path, strerror(err));
+        exit(EXIT_FAILURE);
+    }
+
+    // If we've got a non empty trigger command, set it
+    if(*ctx->trigger_cmd) {
+        file->trigger_cmd = (const char *)ctx->run->trigger_cmd;
+    } else {
+        file->trigger_cmd = NULL;
+    }
+
+    // Set our codec
+    file->codec = ctx->codec;
+    file->cstate = NULL;
+
+    // Nothing has been written yet
+    file->fp = NULL;
+    file->next_seq = 0;
+    file->direct = ctx->cache_mode == CACHE_DIRECT;
+    file->drop = ctx->cache_mode == CACHE_DROP;
+    file->pad = 0;
+    file->sync = *ctx->ckpt_path != '\0';
+    file->group = NULL;
+    file->group_len = 0;
+    pthread_mutex_init(&file->mutex, NULL);
+    pthread_cond_init(&file->cond, NULL);
+
+    return file;
+}
+
+/**
+ * Take a buffer from our run's pool, giving up if we can't allocate one
+ */
+static cbuf pool_get(struct csv_context *ctx) {
+    cbuf buf;
+
+    if(!(buf = cbuf_pool_get(&ctx->run->buf_pool))) {
+        fprintf(stderr, "Error:  Couldn't allocate a %zu byte buffer.\n", ctx->run->buf_pool.size);
+        exit(EXIT_FAILURE);
+    }
+
+    return buf;
+}
+
+/**
+ * How much of len bytes we can send on as a block.  With O_DIRECT, every
+ * block of a file but its last has to be a whole number of pages, so we keep
+ * the rest for the next one.
+ */
+static inline size_t block_len(struct csv_context *ctx, size_t len, int last) {
+    return ctx->cache_mode == CACHE_DIRECT && !last ? len & ~(size_t)(DIRECT_ALIGN - 1) : len;
+}
+
+/**
+ * Hand the first len bytes of our buffer to our IO threads as the next block
+ * of the current output file (starting one if we need to), and continue in a
+ * recycled buffer.  If this is the last block of the file, the next file's
+ * buffer starts with our header.  Anything past len (or what we can send of
+ * it) is carried over.
+ */
+static void queue_block(struct csv_context *ctx, size_t len, int last) {
+    struct q_flush_item *q_item = slab_alloc(&ctx->run->item_slab);
+    size_t tail_len;
+
+    len = block_len(ctx, len, last);
+
+    // Start our file if this is its first block
+    if(!ctx->cur_file) {
+        ctx->cur_file = out_file_new(ctx, NULL);
+        ctx->cur_seq = 0;
+    }
+
+    q_item->file = ctx->cur_file;
+    q_item->seq = ctx->cur_seq++;
+    q_item->last = last;
+
+    // Store the number of rows we've written to this file so far
+    q_item->row_count = ctx->row;
+
+    // Hand our buffer off as it is, and store our length
+    q_item->str = ctx->csv_buf;
+    q_item->len = len;
+
+    // Start the next block in a recycled buffer.  If we're not injecting
+    // headers, header_len will be zero.
+    tail_len = CBUF_POS(q_item->str) - len;
+    ctx->csv_buf = pool_get(ctx);
+    if(last) {
+        ctx->csv_buf = cbuf_append(ctx->csv_buf, ctx->header_buf, ctx->header_len);
+        ctx->cur_file = NULL;
+        ctx->file_bytes = 0;
+    } else {
+        ctx->file_bytes += len;
+    }
+    ctx->csv_buf = cbuf_append(ctx->csv_buf, q_item->str + len, tail_len);
+
+    // If we're checkpointing, remember where the row after our file starts,
+    // and our last group column value
+    if(last && q_item->file->sync) {
+        q_item->file->in_end = ctx->flush_end;
+        if(ctx->gcol_buf && CBUF_POS(ctx->gcol_buf)) {
+            q_item->file->group_len = CBUF_POS(ctx->gcol_buf);
+            q_item->file->group = malloc(q_item->file->group_len);
+            memcpy(q_item->file->group, ctx->gcol_buf, q_item->file->group_len);
+        }
+    }
+
+    // Add to our blocking/limited queue
+    io_queue_add(ctx->run, q_item);
+}
+
+// We're ready to split this file off, so package up information for our queue, 
+// add it, and send it to one of our IO threads
+void flush_file(struct csv_context *ctx, unsigned int use_ovr) {
+    // If we're in overflow and we're supposed to flush up to our overflow
+    // position, do so.  Anything after it belongs to the next file.
+    size_t flush_len = use_ovr && IN_OVERFLOW(ctx) ? ctx->opos : CBUF_POS(ctx->csv_buf);
+    uint64_t start = stats_start();
+
+    // Where the row after our file starts in our input
+    ctx->flush_end = use_ovr && IN_OVERFLOW(ctx) ? ctx->opos_end : ctx->row_end;
+
+    // This is the last block of our file
+    queue_block(ctx, flush_len, 1);
+    stats_stop(STAT_FLUSH_NS, start);
+    stats_add(STAT_FLUSHES, 1);
+
+    // Reset our row count (zero unless we're counting the header)
+    ctx->row  = ctx->count_header ? 1 : 0;
+    
+    // Reset overflow position
+    ctx->opos = 0;
+    ctx->full = 0;
+}
+
+/**
+ * Compress a sample of our data to see how well it compresses.  Our IO
+ * threads keep track once they're writing, but we usually get well ahead of
+ * them to begin with.
+ */
+static void sample_ratio(struct csv_context *ctx, const char *data, size_t len) {
+    char *out = NULL;
+    size_t out_len = 0;
+    void *state;
+    FILE *fp;
+
+    ctx->sampled = 1;
+
+    if(!(fp = open_memstream(&out, &out_len))) {
+        return;
+    }
+
+    if((state = ctx->codec->open(&ctx->codec_opts))) {
+        if(!ctx->codec->write(state, fp, data, len, 1) && !fflush(fp)) {
+            __atomic_add_fetch(&ctx->run->written_in, len, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&ctx->run->written_out, out_len, __ATOMIC_RELAXED);
+        }
+        ctx->codec->free(state);
+    }
+
+    fclose(fp);
+    free(out);
+}
+
+/**
+ * Estimate how big a file with len bytes of data will be once written, buf
+ * being the part of it we're still holding.  If we're compressing we go by
+ * how well we've compressed so far.
+ */
+static inline size_t out_size(struct csv_context *ctx, cbuf buf, size_t len) {
+    size_t in, out;
+
+    if(!ctx->codec) {
+        return len;
+    }
+
+    // Take a sample once we have enough data, or would be at our limit
+    // without compression
+    if(!ctx->sampled && (CBUF_POS(buf) >= RATIO_SAMPLE_SIZE || len >= ctx->max_bytes)) {
+        sample_ratio(ctx, buf, CBUF_POS(buf) < RATIO_SAMPLE_SIZE ? CBUF_POS(buf) : RATIO_SAMPLE_SIZE);
+    }
+
+    in = __atomic_load_n(&ctx->run->written_in, __ATOMIC_RELAXED);
+    out = __atomic_load_n(&ctx->run->written_out, __ATOMIC_RELAXED);
+
+    return in ? (size_t)((double)len * out / in) : len;
+}
+
+/**
+ * Whether our current file has reached our row or byte limit.  This is only
+ * checked at the end of a row, and once it has, it stays that way until
+ * the file is flushed.
+ */
+static inline int file_full(struct csv_context *ctx) {
+    if(!ctx->full) {
+        ctx->full = ctx->row >= ctx->max_rows || (ctx->max_bytes &&
+                    out_size(ctx, ctx->csv_buf, ctx->file_bytes + CBUF_POS(ctx->csv_buf)) >= ctx->max_bytes);
+    }
+
+    return ctx->full;
+}
+
+/**
+ * If we're streaming and have a full block, send it on its way.  This is only
+ * called at the end of a row, so everything we've got belongs to this file.
+ */
+static void stream_block(struct csv_context *ctx) {
+    if(!ctx->stream_size || CBUF_POS(ctx->csv_buf) < ctx->stream_size) {
+        return;
+    }
+
+    queue_block(ctx, CBUF_POS(ctx->csv_buf), 0);
+
+    // Our overflow position is now the end of whatever we carried over
+    ctx->opos = CBUF_POS(ctx->csv_buf);
+    ctx->opos_end = ctx->row_end;
+}
+
+/**
+ * Keep a copy of our header row, which starts every file
+ */
+static void save_header(struct csv_context *ctx) {
+    ctx->header_len = CBUF_POS(ctx->csv_buf);
+    ctx->header_buf = cbuf_init(ctx->header_len);
+    ctx->header_buf = cbuf_append(ctx->header_buf, ctx->csv_buf, ctx->header_len);
+    ctx->header_end = ctx->row_end;
+
+    // If we're resuming, we'd better be reading the same input
+    if(ctx->skip_end && (ctx->header_len != ctx->ckpt.header_len ||
+       memcmp(ctx->header_buf, ctx->ckpt.header, ctx->header_len) != 0))
+    {
+        fprintf(stderr, "Error:  Our header doesn't match the one in checkpoint '%s'\n", ctx->ckpt_path);
+        exit(EXIT_FAILURE);
+    }
+    ckpt_free(&ctx->ckpt);
+
+    // Partitions add the header to their own buffers
+    if(ctx->partitions) {
+        CBUF_SETPOS(ctx->csv_buf, 0);
+    }
+}
+
+/**
+ * Hash a group column value (64 bit FNV-1a) to pick its partition
+ */
+static inline uint64_t part_hash(const char *s, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while(len--) {
+        h ^= (unsigned char)*s++;
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+/**
+ * Send a partition's buffer to our IO threads as the next block of its file
+ * (starting one if we need to), finishing the file if this is the last block
+ */
+static void partition_queue(struct csv_context *ctx, struct partition *part, int last) {
+    struct q_flush_item *q_item = slab_alloc(&ctx->run->item_slab);
+    cbuf buf;
+
+    if(!part->file) {
+        part->file = out_file_new(ctx, part);
+        part->seq = 0;
+    }
+
+    q_item->file = part->file;
+    q_item->seq = part->seq++;
+    q_item->last = last;
+    q_item->row_count = part->row;
+    q_item->str = buf = part->buf;
+    q_item->len = block_len(ctx, CBUF_POS(buf), last);
+
+    // Anything we can't send yet starts our next buffer
+    part->buf = pool_get(ctx);
+    part->buf = cbuf_append(part->buf, buf + q_item->len, CBUF_POS(buf) - q_item->len);
+    if(last) {
+        part->file = NULL;
+        part->row = ctx->count_header ? 1 : 0;
+        part->bytes = 0;
+    } else {
+        part->bytes += q_item->len;
+    }
+
+    io_queue_add(ctx->run, q_item);
+}
+
+/**
+ * Move the row we just finished, everything in our buffer from row_start, to
+ * the partition its group column hashes to.  A partition's file is finished
+ * once it has enough rows, and otherwise its data goes to our IO threads a
+ * block at a time.
+ */
+static void partition_row(struct csv_context *ctx, size_t row_start) {
+    struct partition *part = &ctx->parts[ctx->part_hash % ctx->partitions];
+
+    // Each of a partition's files starts with our header
+    if(!part->file && !CBUF_POS(part->buf)) {
+        part->buf = cbuf_append(part->buf, ctx->header_buf, ctx->header_len);
+    }
+
+    part->buf = cbuf_append(part->buf, ctx->csv_buf + row_start, CBUF_POS(ctx->csv_buf) - row_start);
+    CBUF_SETPOS(ctx->csv_buf, row_start);
+
+    if(++part->row >= ctx->max_rows || (ctx->max_bytes &&
+       out_size(ctx, part->buf, part->bytes + CBUF_POS(part->buf)) >= ctx->max_bytes))
+    {
+        partition_queue(ctx, part, 1);
+    } else if(CBUF_POS(part->buf) >= ctx->part_size) {
+        partition_queue(ctx, part, 0);
+    }
+
+    // Rows without enough columns hash as an empty value
+    ctx->part_hash = part_hash(NULL, 0);
+}
+
+/**
+ * Finish every partition's file once we're out of input
+ */
+static void partition_fin(struct csv_context *ctx) {
+    unsigned int i;
+
+    for(i=0;i<ctx->partitions;i++) {
+        if(ctx->parts[i].file || CBUF_POS(ctx->parts[i].buf) > ctx->header_len) {
+            partition_queue(ctx, &ctx->parts[i], 1);
+        }
+    }
+}
+
+/**
+ * Work out which input columns we need to keep, once we know where all of
+ * our output columns come from, and tell our parser to skip the rest
+ */
+static void columns_ready(struct csv_context *ctx) {
+    unsigned int i;
+    size_t len = ctx->gcol + 1;
+
+    for(i=0;i<ctx->ncols;i++) {
+        if((size_t)ctx->cols[i] + 1 > len) len = ctx->cols[i] + 1;
+    }
+    if(ctx->filter.need_len > len) {
+        len = ctx->filter.need_len;
+    }
+
+    ctx->col_keep = arena_alloc(&ctx->run->arena, len);
+    memset(ctx->col_keep, 0, len);
+    ctx->col_keep_len = len;
+
+    for(i=0;i<ctx->ncols;i++) {
+        ctx->col_keep[ctx->cols[i]] = 1;
+    }
+    for(i=0;i<ctx->filter.need_len;i++) {
+        ctx->col_keep[i] |= ctx->filter.need[i];
+    }
+    if(ctx->gcol > -1) {
+        ctx->col_keep[ctx->gcol] = 1;
+    }
+
+    // If we're only filtering we still write every column
+    if(ctx->ncols) {
+        csv_set_skip(&ctx->parser, ctx->col_keep, ctx->col_keep_len);
+    }
+    ctx->cols_ready = 1;
+}
+
+/**
+ * Find our named columns in our header row, which we've stashed in full
+ */
+static void columns_find(struct csv_context *ctx) {
+    unsigned int i;
+    unsigned long c;
+
+    for(i=0;i<ctx->ncols;i++) {
+        if(!ctx->col_names[i]) continue;
+
+        for(c=0;c<ctx->col;c++) {
+            if(ctx->proj_len[c] == strlen(ctx->col_names[i]) &&
+               !memcmp(ctx->proj_buf + ctx->proj_off[c], ctx->col_names[i], ctx->proj_len[c]))
+            {
+                break;
+            }
+        }
+
+        if(c == ctx->col) {
+            fprintf(stderr, "Column '%s' isn't in our header!\n", ctx->col_names[i]);
+            exit(EXIT_FAILURE);
+        }
+        ctx->cols[i] = c;
+    }
+
+    columns_ready(ctx);
+}
+
+/**
+ * Stash a field we're keeping until the end of its row
+ */
+static void proj_field(struct csv_context *ctx, const char *s, size_t len) {
+    if(ctx->col >= ctx->proj_size) {
+        ctx->proj_size = ctx->col * 2 + 16;
+        ctx->proj_off = arena_realloc(&ctx->run->arena, ctx->proj_off, ctx->proj_size * sizeof *ctx->proj_off);
+        ctx->proj_len = arena_realloc(&ctx->run->arena, ctx->proj_len, ctx->proj_size * sizeof *ctx->proj_len);
+    }
+
+    if(!ctx->proj_buf) {
+        ctx->proj_buf = cbuf_init(CSV_BLK_SIZE);
+    }
+
+    ctx->proj_off[ctx->col] = CBUF_POS(ctx->proj_buf);
+    ctx->proj_len[ctx->col] = len;
+    ctx->proj_buf = cbuf_append(ctx->proj_buf, s, len);
+}
+
+/**
+ * Write out our projected row's columns in order.  Columns past the end of a
+ * short row are empty.
+ */
+static void proj_row(struct csv_context *ctx) {
+    unsigned int i;
+    size_t cnt;
+    int c;
+
+    for(i=0;i<ctx->ncols;i++) {
+        if(i) {
+            ctx->csv_buf = cbuf_putc(ctx->csv_buf, ',');
+        }
+
+        if((unsigned long)(c = ctx->cols[i]) >= ctx->col) {
+            continue;
+        }
+
+        while((cnt = csv_write(CBUF_PTR(ctx->csv_buf), CBUF_REM(ctx->csv_buf),
+                               ctx->proj_buf + ctx->proj_off[c], ctx->proj_len[c])) > CBUF_REM(ctx->csv_buf))
+        {
+            ctx->csv_buf = cbuf_double(ctx->csv_buf);
+        }
+        CBUF_POS(ctx->csv_buf)+=cnt;
+    }
+
+    // We won't have stashed anything if none of our columns were in the row
+    if(ctx->proj_buf) {
+        CBUF_SETPOS(ctx->proj_buf, 0);
+    }
+}
+
+/**
+ * Handle the group column value of a row we're keeping
+ */
+static void group_col(struct csv_context *ctx, const char *s, size_t len) {
+    // Don't treat header columns as a group column
+    if(ctx->use_header && !ctx->header_len) {
+        // Nothing to do
+    } else if(ctx->partitions) {
+        // Our value picks this row's partition
+        ctx->part_hash = part_hash(s, len);
+    } else {
+        // If we have a last column value and we're in overflow, check
+        // the new row's value against the last one
+        if(ctx->gcol_buf && IN_OVERFLOW(ctx) && (len != CBUF_POS(ctx->gcol_buf) ||
+           memcmp(ctx->gcol_buf, s, len) != 0))
+        {
+            // Flush the data we have!
+            flush_file(ctx, 1);
+        } else if(!ctx->gcol_buf) {
+            // Initialize a new group column buffer
+            ctx->gcol_buf = cbuf_init(len);
+        }
+
+        // Update our last group column value
+        ctx->gcol_buf = cbuf_setlen(ctx->gcol_buf, s, len);
+        CBUF_SETPOS(ctx->gcol_buf, len);
+    }
+}
+
+/**
+ * A keep mask that keeps nothing, for the rest of a row that failed our filter
+ */
+static const unsigned char g_skip_all[1];
+
+/**
+ * A stashed field for our filter, or NULL if our row is too short to have it
+ */
+static const char *row_field(void *arg, unsigned int col, size_t *len) {
+    struct csv_context *ctx = (struct csv_context*)arg;
+
+    if(col >= ctx->col) {
+        return NULL;
+    }
+
+    *len = ctx->proj_len[col];
+    return ctx->proj_buf + ctx->proj_off[col];
+}
+
+/**
+ * Column callback
+ */
+static inline void cb_col(void *s, size_t len, void *data) {
+    struct csv_context *ctx = (struct csv_context *)data;
+    size_t cnt;
+
+    // Once a row has failed our filter, the rest of it is skipped
+    if(ctx->drop) {
+        ctx->col++;
+        return;
+    }
+
+    // Our parser only hands us fields we're keeping, stash them if we're
+    // projecting or filtering (or need to look through our header for
+    // column names)
+    if((ctx->ncols || ctx->filter.nops) &&
+       (!ctx->cols_ready || (ctx->col < ctx->col_keep_len && ctx->col_keep[ctx->col])))
+    {
+        proj_field(ctx, (const char*)s, len);
+    }
+
+    // A filter that's a single comparison can be tested as soon as we have
+    // its column, and if the row fails, our parser can skip the rest of it
+    if(ctx->filter.single && ctx->col == ctx->filter.ops[0].col &&
+       !(ctx->use_header && !ctx->header_len) &&
+       !filter_test(&ctx->filter.ops[0], (const char*)s, len))
+    {
+        csv_set_skip(&ctx->parser, g_skip_all, 0);
+        ctx->drop = 1;
+        ctx->col++;
+        return;
+    }
+
+    if(!ctx->ncols) {
+        // Put a comma if we should
+        if(ctx->put_comma) {
+            ctx->csv_buf = cbuf_putc(ctx->csv_buf, ',');
+        }
+        ctx->put_comma = 1;
+    }
+
+    // If we are keeping same columns together see if we're on one.  If
+    // we're filtering we wait until we know we're keeping the row.
+    if(ctx->gcol > -1 && ctx->col == ctx->gcol && !ctx->filter.nops) {
+        group_col(ctx, (const char*)s, len);
+    }
+
+    // Make sure we can write all the data, unless we're projecting in which
+    // case we'll write it at the end of the row
+    if(!ctx->ncols) {
+        while((cnt = csv_write(CBUF_PTR(ctx->csv_buf), CBUF_REM(ctx->csv_buf), s, len)) > CBUF_REM(ctx->csv_buf)) {
+            // We didn't have room, reallocate
+            ctx->csv_buf = cbuf_double(ctx->csv_buf);
+        }
+
+        // Increment where we are in our buffer
+        CBUF_POS(ctx->csv_buf)+=cnt;
+    }
+
+    // Increment our column
+    ctx->col++;
+}
+
+/**
+ * Throw away the row we just parsed, which failed our filter
+ */
+static void drop_row(struct csv_context *ctx) {
+    CBUF_SETPOS(ctx->csv_buf, ctx->row_start);
+    if(ctx->proj_buf) {
+        CBUF_SETPOS(ctx->proj_buf, 0);
+    }
+
+    // Go back to keeping the fields we were before
+    if(ctx->drop) {
+        csv_set_skip(&ctx->parser, ctx->ncols ? ctx->col_keep : NULL, ctx->col_keep_len);
+        ctx->drop = 0;
+    }
+
+    ctx->col = 0;
+    ctx->put_comma = 0;
+}
+
+/**
+ * Row parsing callback
+ */
+void cb_row(int c, void *data) {
+    // Type cast to our context structure
+    struct csv_context *ctx = (struct csv_context*)data;
+
+    stats_add(STAT_ROWS, 1);
+
+    // Where our row ends in our input
+    ctx->row_end = ctx->in_off + ctx->parser.row_end;
+
+    // Drop rows that fail our filter, along with anything we've written of
+    // them.  They never count toward our row limit.
+    if(ctx->filter.nops && !(ctx->use_header && !ctx->header_len)) {
+        if(ctx->drop || (!ctx->filter.single && !filter_eval(&ctx->filter, row_field, ctx)) ||
+           (ctx->filter.single && ctx->col <= ctx->filter.ops[0].col &&
+            !filter_test(&ctx->filter.ops[0], NULL, 0)))
+        {
+            drop_row(ctx);
+            return;
+        }
+
+        // Now we know we're keeping it, we can look at its group column
+        if(ctx->gcol > -1 && (unsigned long)ctx->gcol < ctx->col) {
+            group_col(ctx, ctx->proj_buf + ctx->proj_off[ctx->gcol], ctx->proj_len[ctx->gcol]);
+        }
+    }
+
+    // Write out our projected columns, finding any named ones first if this
+    // is our header
+    if(ctx->ncols) {
+        if(!ctx->cols_ready) {
+            columns_find(ctx);
+        }
+        proj_row(ctx);
+    } else if(ctx->proj_buf) {
+        CBUF_SETPOS(ctx->proj_buf, 0);
+    }
+
+    // Put a newline
+    ctx->csv_buf = cbuf_putc(ctx->csv_buf, '\n');
+
+    // If we're injecting headers, and we don't have a header length, then
+    // this row is a header.  Otherwise, just increment our row count.
+    if(ctx->use_header && !ctx->header_len) {
+        // Set the length of our header, and keep a copy
+        save_header(ctx);
+        
+        // Only increment our row count if we're counting header rows
+        if(ctx->count_header) {
+            ctx->row++;
+        }
+    } else if(ctx->partitions) {
+        // Partitions keep their own row counts
+        partition_row(ctx, 0);
+    } else {
+        // Increment row count
+        ctx->row++;
+    }
+
+    // If we're at or above our row limit, either keep track/ of the position
+    // of this row (if we're grouping columns), or write these rows to disk.
+    if(ctx->partitions) {
+        // Our row has already gone to its partition
+    } else if(file_full(ctx)) {
+        // Mark the position of this row if we're grouping columns, or flush
+        if(ctx->gcol >= 0) {
+            ctx->opos = CBUF_POS(ctx->csv_buf);
+            ctx->opos_end = ctx->row_end;
+        } else {
+            flush_file(ctx, 0);
+        }
+    }
+
+    // Send a block on its way if we're streaming and have enough
+    if(!ctx->partitions) {
+        stream_block(ctx);
+    }
+
+    // Back on column zero
+    ctx->col=0;
+
+    // We don't need a comma for the next column
+    ctx->put_comma = 0;
+
+    // Our next row starts here
+    ctx->row_start = CBUF_POS(ctx->csv_buf);
+}
+
+/**
+ * Raw mode row handler, called once the complete row (including its line
+ * terminator) has been copied into csv_buf starting at row_start
+ */
+static void raw_row(struct csv_context *ctx) {
+    char *row = ctx->csv_buf + ctx->row_start;
+    size_t row_len = CBUF_POS(ctx->csv_buf) - ctx->row_start;
+
+    // Drop blank lines, the same as the parser does
+    if(row_len == 1 || (row_len == 2 && *row == '\r')) {
+        CBUF_SETPOS(ctx->csv_buf, ctx->row_start);
+        goto next_row;
+    }
+
+    stats_add(STAT_ROWS, 1);
+
+    if(ctx->use_header && !ctx->header_len) {
+        // This row is our header
+        save_header(ctx);
+
+        // Only increment our row count if we're counting header rows
+        if(ctx->count_header) {
+            ctx->row++;
+        }
+    } else {
+        // Find the end of our group column if it was the last one in the row,
+        // or treat it as empty if the row didn't have that many columns
+        if(ctx->gcol > -1 && ctx->col == ctx->gcol) {
+            ctx->gcol_end = row[row_len-1] == '\n' ? row_len - 1 : row_len;
+            if(ctx->gcol_end > ctx->gcol_start && row[ctx->gcol_end-1] == '\r') {
+                ctx->gcol_end--;
+            }
+        } else if(ctx->gcol > -1 && ctx->col < ctx->gcol) {
+            ctx->gcol_start = ctx->gcol_end = 0;
+        }
+
+        if(ctx->partitions) {
+            const char *val = row + ctx->gcol_start;
+            size_t len = ctx->gcol_end - ctx->gcol_start;
+
+            // Hash a simply quoted value without its quotes, so we route it
+            // the same way as when we parse it
+            if(len >= 2 && val[0] == '"' && val[len-1] == '"' && !memchr(val + 1, '"', len - 2)) {
+                val++;
+                len -= 2;
+            }
+
+            ctx->part_hash = part_hash(val, len);
+            partition_row(ctx, ctx->row_start);
+            goto next_row;
+        } else if(ctx->gcol > -1) {
+            size_t len = ctx->gcol_end - ctx->gcol_start;
+
+            // If we're in overflow and our group value changed, flush everything
+            // before this row.  The row itself moves down to the next file.
+            if(ctx->gcol_buf && IN_OVERFLOW(ctx) && (len != CBUF_POS(ctx->gcol_buf) ||
+               memcmp(ctx->gcol_buf, row + ctx->gcol_start, len) != 0))
+            {
+                flush_file(ctx, 1);
+                row = ctx->csv_buf + ctx->header_len;
+            } else if(!ctx->gcol_buf) {
+                ctx->gcol_buf = cbuf_init(len);
+            }
+
+            // Update our last group column value
+            ctx->gcol_buf = cbuf_setlen(ctx->gcol_buf, row + ctx->gcol_start, len);
+            CBUF_SETPOS(ctx->gcol_buf, len);
+        }
+
+        // Increment row count
+        ctx->row++;
+    }
+
+    // Mark our overflow position or flush, just like cb_row
+    if(file_full(ctx)) {
+        if(ctx->gcol >= 0) {
+            ctx->opos = CBUF_POS(ctx->csv_buf);
+            ctx->opos_end = ctx->row_end;
+        } else {
+            flush_file(ctx, 0);
+        }
+    }
+
+    // Send a block on its way if we're streaming and have enough
+    stream_block(ctx);
+
+next_row:
+    // The next row starts wherever we are now
+    ctx->row_start = CBUF_POS(ctx->csv_buf);
+    ctx->col = 0;
+    ctx->gcol_start = ctx->gcol_end = 0;
+}
+
+/**
+ * Raw mode row splitter.  Given the offsets of every unquoted delimiter and
+ * newline in buf, which starts at in_off in our input, we copy whole row
+ * ranges into our output buffer as we find them.  Any partial row at the end
+ * of the buffer is copied as well, and completed on the next call.
+ */
+static void raw_index(struct csv_context *ctx, const char *buf, off_t in_off, size_t len, const uint32_t *idx,
+                      size_t n)
+{
+    const char *seg = buf;
+    size_t i, off, rel;
+
+    for(i=0;i<n;i++) {
+        off = idx[i] & ~CSV_SCAN_ROW;
+
+        if(idx[i] & CSV_SCAN_ROW) {
+            // Copy in the rest of this row and handle it
+            ctx->csv_buf = cbuf_append(ctx->csv_buf, seg, buf + off + 1 - seg);
+            seg = buf + off + 1;
+            ctx->row_end = in_off + off + 1;
+            raw_row(ctx);
+        } else {
+            // Where this delimiter is relative to the start of our row
+            rel = CBUF_POS(ctx->csv_buf) - ctx->row_start + (buf + off - seg);
+
+            if(ctx->col == ctx->gcol) {
+                ctx->gcol_end = rel;
+            }
+            if(++ctx->col == ctx->gcol) {
+                ctx->gcol_start = rel + 1;
+            }
+        }
+    }
+
+    // Copy in any partial row
+    ctx->csv_buf = cbuf_append(ctx->csv_buf, seg, buf + len - seg);
+}
+
+/**
+ * Raw mode parser, finding all of our row and field boundaries in one go
+ */
+static void raw_parse(struct csv_context *ctx, const char *buf, size_t len) {
+    size_t pos, n, chunk;
+
+    // Our index only has room for one read buffer's worth of offsets
+    for(pos=0;pos<len;pos+=chunk) {
+        chunk = len - pos < READ_BUF_SIZE ? len - pos : READ_BUF_SIZE;
+        n = csv_scan(&ctx->scanner, buf + pos, chunk, ctx->scan_idx);
+        raw_index(ctx, buf + pos, ctx->in_off + pos, chunk, ctx->scan_idx, n);
+    }
+}
+
+/**
+ * Parallel raw mode parser for regular files.  Our range workers read and
+ * scan the file ahead of us, and we stitch the ranges back together in
+ * order so numbering and row counts are exactly what we'd get reading it
+ * sequentially.
+ */
+static void raw_parse_ranges(struct csv_context *ctx, int fd, const char *map, off_t size) {
+    struct crange_pool pool;
+    struct crange *r;
+    uint64_t start = stats_start();
+
+    if(crange_init(&pool, fd, map, ctx->in_off, size, PARSE_RANGE_SIZE, ctx->parse_threads, &ctx->scanner) != 0) {
+        fprintf(stderr, "Couldn't start parse threads!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while((r = crange_next(&pool))) {
+        stats_stop(STAT_READ_NS, start);
+
+        start = stats_start();
+        raw_index(ctx, r->buf, r->off, r->len, r->idx, r->n);
+        stats_stop(STAT_PARSE_NS, start);
+        stats_add(STAT_IN_BYTES, r->len);
+
+        crange_release(&pool, r);
+        start = stats_start();
+    }
+    ctx->in_off = size;
+
+    if(pool.error) {
+        fprintf(stderr, "Error while reading file: %s\n", strerror(pool.error));
+        exit(EXIT_FAILURE);
+    }
+
+    crange_free(&pool);
+}
+
+/**
+ * Usage function
+ */
+void print_usage(char *exec) {
+    printf("Usage:  %s [options] FILE... [OUT-PATH]\n", exec);
+}
+
+/**
+ * Parse a size in bytes, with an optional K, M or G suffix.  Returns zero if
+ * it's not valid.
+ */
+static size_t parse_size(const char *arg) {
+    char *end;
+    unsigned long long val = strtoull(arg, &end, 10);
+
+    if(end == arg) {
+        return 0;
+    }
+
+    switch(*end) {
+        case 'k': case 'K': val <<= 10; end++; break;
+        case 'm': case 'M': val <<= 20; end++; break;
+        case 'g': case 'G': val <<= 30; end++; break;
+    }
+
+    return *end ? 0 : (size_t)val;
+}
+
+/**
+ * Pick our output codec from a CODEC[:LEVEL] argument
+ */
+static void set_codec(struct csv_context *ctx, const char *arg) {
+    char name[32];
+    const char *colon = strchr(arg, ':');
+    size_t len = colon ? (size_t)(colon - arg) : strlen(arg);
+
+    snprintf(name, sizeof(name), "%.*s", (int)len, arg);
+
+    // Compressing with "none" is the same as not compressing
+    if(!strcmp(name, "none")) {
+        ctx->codec = NULL;
+        return;
+    }
+
+    if(!(ctx->codec = codec_find(name))) {
+        fprintf(stderr, "Unknown codec '%s', available codecs: %s\n", name, codec_list());
+        exit(EXIT_FAILURE);
+    }
+
+    ctx->codec_opts.level = ctx->codec->default_level;
+    if(colon) {
+        ctx->codec_opts.level = atoi(colon + 1);
+        if(ctx->codec_opts.level < ctx->codec->min_level ||
+           ctx->codec_opts.level > ctx->codec->max_level)
+        {
+            fprintf(stderr, "%s compression level must be in range %d - %d\n",
+                    ctx->codec->name, ctx->codec->min_level, ctx->codec->max_level);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * Parse a comma separated list of columns to write, each either a zero based
+ * index or a header name
+ */
+static void parse_columns(struct csv_context *ctx, const char *arg) {
+    const char *p = arg, *end;
+    size_t len;
+    unsigned int i;
+
+    for(ctx->ncols=1;*p;p++) {
+        if(*p == ',') ctx->ncols++;
+    }
+
+    ctx->cols = arena_alloc(&ctx->arena, ctx->ncols * sizeof *ctx->cols);
+    ctx->col_names = arena_alloc(&ctx->arena, ctx->ncols * sizeof *ctx->col_names);
+
+    for(i=0,p=arg;i<ctx->ncols;i++,p=end+1) {
+        if(!(end = strchr(p, ','))) {
+            end = p + strlen(p);
+        }
+
+        if(!(len = end - p)) {
+            fprintf(stderr, "Empty column in --columns list!\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // Anything that's all digits is an index, otherwise it's a name
+        if(strspn(p, "0123456789") >= len) {
+            ctx->cols[i] = atoi(p);
+            ctx->col_names[i] = NULL;
+        } else {
+            ctx->cols[i] = -1;
+            ctx->col_names[i] = arena_alloc(&ctx->arena, len + 1);
+            memcpy(ctx->col_names[i], p, len);
+            ctx->col_names[i][len] = '\0';
+        }
+    }
+}
+
+/**
+ * Add a file to our inputs
+ */
+static void add_input(struct csv_context *ctx, const char *path) {
+    size_t len = strlen(path);
+
+    if(!len) {
+        return;
+    } else if(len >= sizeof(ctx->in_file)) {
+        fprintf(stderr, "Input path '%s' is too long!\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    if(!(ctx->input_count & (ctx->input_count + 1))) {
+        ctx->inputs = arena_realloc(&ctx->arena, ctx->inputs, (ctx->input_count * 2 + 1) * sizeof *ctx->inputs);
+    }
+    if(!ctx->inputs || !(ctx->inputs[ctx->input_count] = arena_alloc(&ctx->arena, len + 1))) {
+        fprintf(stderr, "Error:  Couldn't allocate our input list.\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(ctx->inputs[ctx->input_count++], path, len + 1);
+}
+
+/**
+ * Add an input argument, expanding it ourselves if it's a glob that the shell
+ * left alone (it was quoted, or would have made too long a command line)
+ */
+static void add_input_arg(struct csv_context *ctx, const char *arg) {
+    glob_t g;
+    size_t i;
+
+    if(!strpbrk(arg, "*?[") || !access(arg, F_OK)) {
+        add_input(ctx, arg);
+        return;
+    }
+
+    if(glob(arg, 0, NULL, &g) != 0) {
+        fprintf(stderr, "No input files match '%s'\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    for(i=0;i<g.gl_pathc;i++) {
+        add_input(ctx, g.gl_pathv[i]);
+    }
+    globfree(&g);
+}
+
+/**
+ * Add every file listed in a file (or STDIN, for "-"), one per line
+ */
+static void add_input_list(struct csv_context *ctx, const char *list) {
+    FILE *fp = strcmp(list, "-") ? fopen(list, "r") : stdin;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+
+    if(!fp) {
+        fprintf(stderr, "Couldn't open input list '%s'\n", list);
+        exit(EXIT_FAILURE);
+    }
+
+    while((len = getline(&line, &size, fp)) > 0) {
+        while(len && (line[len-1] == '\n' || line[len-1] == '\r')) {
+            line[--len] = '\0';
+        }
+        add_input(ctx, line);
+    }
+
+    free(line);
+    if(fp != stdin) {
+        fclose(fp);
+    }
+}
+
+// Order input prefixes, so we can find any that are the same
+static int prefix_cmp(const void *a, const void *b) {
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/**
+ * How much of a name is left without a compression suffix, if it has one
+ * for a format we read
+ */
+static size_t base_len(const char *name, int type) {
+    size_t len = strlen(name), slen = strlen(dz_suffix(type));
+
+    if(slen && len > slen && !strcmp(name + len - slen, dz_suffix(type))) {
+        return len - slen;
+    }
+
+    return len;
+}
+
+/**
+ * Our output files are named after their input's basename, without any
+ * compression suffix, so two inputs with the same one would write over each
+ * other's files.  We can't tell which inputs are compressed until we read
+ * them, so any suffix we know counts here.
+ */
+static void check_prefixes(struct csv_context *ctx) {
+    char **names;
+    const char *ptr;
+    size_t len;
+    unsigned int i;
+
+    if(!(names = malloc(ctx->input_count * sizeof *names))) {
+        fprintf(stderr, "Error:  Couldn't allocate our input list.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for(i=0;i<ctx->input_count;i++) {
+        ptr = (ptr = strrchr(ctx->inputs[i], '/')) ? ptr + 1 : ctx->inputs[i];
+        len = base_len(ptr, DZ_GZIP) < base_len(ptr, DZ_ZSTD) ? base_len(ptr, DZ_GZIP) : base_len(ptr, DZ_ZSTD);
+        if(!(names[i] = strndup(ptr, len))) {
+            fprintf(stderr, "Error:  Couldn't allocate our input list.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    qsort(names, ctx->input_count, sizeof *names, prefix_cmp);
+
+    for(i=1;i<ctx->input_count;i++) {
+        if(!strcmp(names[i-1], names[i])) {
+            fprintf(stderr, "More than one input is named '%s', their output files would collide!\n", names[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for(i=0;i<ctx->input_count;i++) {
+        free(names[i]);
+    }
+    free(names);
+}
+
+/**
+ * Parse arguments
+ */
+int parse_args(struct csv_context *ctx, int argc, char **argv) {
+    int opt, opt_idx, intval, last, queue_set = 0;
+    char *ptr, errbuf[128];
+    const char *list = NULL;
+
+    // While we've got arguments to parse
+    while((opt = getopt_long(argc, argv, "g:n:b:C:w:v:i:t:z::c:hd::rp:q:s::", g_long_opts, &opt_idx)) != -1) {
+        switch(opt) {
+            case 't':
+                strncpy(ctx->trigger_cmd, optarg, sizeof(ctx->trigger_cmd));
+        		break;
+            case 'g':
+                ctx->gcol = atoi(optarg);
+                break;
+            case 'n':
+                intval = atoi(optarg);
+                if(intval < 1) {
+                    fprintf(stderr, "Number of lines per file must be a positive integer!\n");
+                    exit(EXIT_FAILURE);
+                }
+                ctx->max_rows = intval;
+                break;
+            case 'b':
+                if(!(ctx->max_bytes = parse_size(optarg))) {
+                    fprintf(stderr, "Maximum file size must be a positive number of bytes (e.g. 512M)!\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'C':
+                parse_columns(ctx, optarg);
+                break;
+            case 'w':
+                filter_free(&ctx->filter);
+                if(filter_compile(&ctx->filter, optarg, errbuf, sizeof(errbuf))) {
+                    fprintf(stderr, "Invalid --where expression: %s\n", errbuf);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'i':
+                if(optarg) {
+                	intval = atoi(optarg);
+                	if(intval < IO_THREADS_MIN || intval > IO_THREADS_MAX) {
+                		fprintf(stderr, "Thread count must be in range %d - %d\n",
+                				IO_THREADS_MIN, IO_THREADS_MAX);
+                		exit(EXIT_FAILURE);
+                	}
+                	ctx->thread_count = intval;
+                }
+                break;
+            case 'z':
+            	ctx->codec = codec_find("gzip");
+            	ctx->codec_opts.level = Z_DEFAULT_COMPRESSION;
+            	if(optarg) {
+            		intval = atoi(optarg);
+            		if(intval >= Z_BEST_SPEED && intval <= Z_BEST_COMPRESSION) {
+            			ctx->codec_opts.level = intval;
+            		} else {
+            			fprintf(stderr, "Unknown compression level: %d\n", intval);
+            		}
+            	}
+            	break;
+            case 'c':
+                set_codec(ctx, optarg);
+                break;
+            case 'd':
+                ctx->use_header = 1;
+                if(optarg) {
+                    intval = atoi(optarg);
+                    ctx->count_header = intval != 0;
+                }
+                break;
+            case 'r':
+                ctx->raw = 1;
+                break;
+            case 'q':
+                intval = atoi(optarg);
+                if(intval < 1) {
+                    fprintf(stderr, "Queue size must be a positive integer!\n");
+                    exit(EXIT_FAILURE);
+                }
+                ctx->queue_size = intval;
+                queue_set = 1;
+                break;
+            case 's':
+                ctx->stream_size = STREAM_BLOCK_SIZE;
+                if(optarg) {
+                    intval = atoi(optarg);
+                    if(intval < 1) {
+                        fprintf(stderr, "Stream block size must be a positive integer!\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    ctx->stream_size = intval;
+                }
+                break;
+            case 'p':
+                intval = atoi(optarg);
+                if(intval < PARSE_THREADS_MIN || intval > PARSE_THREADS_MAX) {
+                    fprintf(stderr, "Parse thread count must be in range %d - %d\n",
+                            PARSE_THREADS_MIN, PARSE_THREADS_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                ctx->parse_threads = intval;
+                break;
+            case 'h':
+            case '?':
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            case 'v':
+                printf("csv-split " CSV_SPLIT_VERSION "\n");
+                exit(EXIT_SUCCESS);
+            case 0:
+                // Parse from STDIN
+                if(!strcmp("stdin", g_long_opts[opt_idx].name)) {
+                    ctx->from_stdin = 1;
+                } else if(!strcmp("partitions", g_long_opts[opt_idx].name)) {
+                    intval = atoi(optarg);
+                    if(intval < 1 || intval > PARTITIONS_MAX) {
+                        fprintf(stderr, "Partition count must be in range 1 - %d\n", PARTITIONS_MAX);
+                        exit(EXIT_FAILURE);
+                    }
+                    ctx->partitions = intval;
+                } else if(!strcmp("max-field-bytes", g_long_opts[opt_idx].name)) {
+                    if(!(ctx->max_field_bytes = parse_size(optarg))) {
+                        fprintf(stderr, "Maximum field size must be a positive number of bytes (e.g. 64M)!\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    // Our parser buffers a quoted field's closing quote, and
+                    // needs room for the character after a field before it
+                    // knows the field has ended
+                    csv_set_entry_max(&ctx->parser, ctx->max_field_bytes + 2);
+                } else if(!strcmp("io-uring", g_long_opts[opt_idx].name)) {
+                    ctx->want_uring = 1;
+                } else if(!strcmp("direct", g_long_opts[opt_idx].name)) {
+                    ctx->cache_mode = CACHE_DIRECT;
+                } else if(!strcmp("drop-cache", g_long_opts[opt_idx].name)) {
+                    ctx->cache_mode = CACHE_DROP;
+                } else if(!strcmp("trigger-jobs", g_long_opts[opt_idx].name)) {
+                    intval = atoi(optarg);
+                    if(intval < TRIGGER_JOBS_MIN || intval > TRIGGER_JOBS_MAX) {
+                        fprintf(stderr, "Trigger job count must be in range %d - %d\n",
+                                TRIGGER_JOBS_MIN, TRIGGER_JOBS_MAX);
+                        exit(EXIT_FAILURE);
+                    }
+                    ctx->trigger_jobs = intval;
+                } else if(!strcmp("compress-threads", g_long_opts[opt_idx].name) ||
+                          !strcmp("gzip-threads", g_long_opts[opt_idx].name))
+                {
+                    intval = atoi(optarg);
+                    if(intval < 0 || intval > PGZ_THREADS_MAX) {
+                        fprintf(stderr, "Compression thread count must be in range 0 - %d\n",
+                                PGZ_THREADS_MAX);
+                        exit(EXIT_FAILURE);
+                    }
+                    ctx->compress_threads = intval;
+                } else if(!strcmp("stats", g_long_opts[opt_idx].name)) {
+                    if(!optarg || !strcmp(optarg, "text")) {
+                        ctx->stats = STATS_TEXT;
+                    } else if(!strcmp(optarg, "json")) {
+                        ctx->stats = STATS_JSON;
+                    } else {
+                        fprintf(stderr, "Unknown stats format '%s', must be text or json\n", optarg);
+                        exit(EXIT_FAILURE);
+                    }
+                } else if(!strcmp("progress", g_long_opts[opt_idx].name)) {
+                    ctx->progress = PROGRESS_INTERVAL;
+                    if(optarg) {
+                        intval = atoi(optarg);
+                        if(intval < 1) {
+                            fprintf(stderr, "Progress interval must be a positive number of seconds!\n");
+                            exit(EXIT_FAILURE);
+                        }
+                        ctx->progress = intval;
+                    }
+                } else if(!strcmp("checkpoint", g_long_opts[opt_idx].name)) {
+                    if(strlen(optarg) >= sizeof(ctx->ckpt_path)) {
+                        fprintf(stderr, "Checkpoint path is too long!\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    strcpy(ctx->ckpt_path, optarg);
+                } else if(!strcmp("resume", g_long_opts[opt_idx].name)) {
+                    ctx->resume = 1;
+                } else if(!strcmp("files-from", g_long_opts[opt_idx].name)) {
+                    list = optarg;
+                } else if(!strcmp("input-jobs", g_long_opts[opt_idx].name)) {
+                    intval = atoi(optarg);
+                    if(intval < INPUT_JOBS_MIN || intval > INPUT_JOBS_MAX) {
+                        fprintf(stderr, "Input job count must be in range %d - %d\n",
+                                INPUT_JOBS_MIN, INPUT_JOBS_MAX);
+                        exit(EXIT_FAILURE);
+                    }
+                    ctx->input_jobs = intval;
+                } else if(!strcmp("output-name", g_long_opts[opt_idx].name)) {
+                    ctx->out_name_arg = optarg;
+                } else if(!strcmp("shard-size", g_long_opts[opt_idx].name)) {
+                    intval = atoi(optarg);
+                    if(intval < 1) {
+                        fprintf(stderr, "Shard size must be a positive integer!\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    ctx->shard_size = intval;
+                } else if(!strcmp("io-threads-max", g_long_opts[opt_idx].name)) {
+                    intval = atoi(optarg);
+                    if(intval < IO_THREADS_MIN || intval > IO_THREADS_MAX) {
+                        fprintf(stderr, "Thread count must be in range %d - %d\n",
+                                IO_THREADS_MIN, IO_THREADS_MAX);
+                        exit(EXIT_FAILURE);
+                    }
+                    ctx->thread_max = intval;
+                } else if(!strcmp("queue-bytes", g_long_opts[opt_idx].name)) {
+                    if(!(ctx->queue_bytes = parse_size(optarg))) {
+                        fprintf(stderr, "Queue size must be a positive number of bytes (e.g. 256M)!\n");
+                        exit(EXIT_FAILURE);
+                    }
+                } else if(!strcmp("memory", g_long_opts[opt_idx].name)) {
+                    if(!(ctx->mem_budget = parse_size(optarg))) {
+                        fprintf(stderr, "Memory budget must be a positive number of bytes (e.g. 1G)!\n");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                break;
+        }
+    }
+
+    // Make sure we have been passed a num-rows or max-bytes argument.  If we
+    // only have a byte limit, we have no row limit.
+    if(!ctx->max_rows && !ctx->max_bytes) {
+        fprintf(stderr, "Must specify the --num-rows (-n) or --max-bytes (-b) argument!\n");
+        exit(EXIT_FAILURE);
+    } else if(!ctx->max_rows) {
+        ctx->max_rows = ULONG_MAX;
+    }
+
+    // Sanity check against "counting the header row" and splitting to one line per file
+    if(ctx->count_header && ctx->max_rows < 2) {
+        fprintf(stderr, "--num-rows must be > 1 if we're counting headers as rows!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Partitions are picked by our group column
+    if(ctx->partitions && ctx->gcol < 0) {
+        fprintf(stderr, "--partitions requires --group-col!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Partitions finish their files in no particular order, so there's no
+    // one place in our input we could resume them all from
+    if(*ctx->ckpt_path && ctx->partitions) {
+        fprintf(stderr, "--checkpoint can't be used with --partitions!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(ctx->resume && !*ctx->ckpt_path) {
+        fprintf(stderr, "--resume requires --checkpoint!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Our IO pool grows from our thread count, and only if there's room to.
+    // A queue bounded by bytes can hold as many blocks as fit, unless we've
+    // been told otherwise.
+    if(ctx->thread_max && ctx->thread_max < ctx->thread_count) {
+        fprintf(stderr, "--io-threads-max can't be less than --io-threads!\n");
+        exit(EXIT_FAILURE);
+    } else if(ctx->thread_max == ctx->thread_count) {
+        ctx->thread_max = 0;
+    }
+    if(ctx->queue_bytes && !queue_set) {
+        ctx->queue_size = QUEUE_BYTES_ITEMS;
+    }
+
+    // Parallel parsing works on row boundaries, so needs raw mode
+    if(ctx->parse_threads > 1 && !ctx->raw) {
+        fprintf(stderr, "--parse-threads requires --raw!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Projection and filtering happen as we parse fields, which raw mode
+    // never does, and column names come from our header
+    if(ctx->ncols && ctx->raw) {
+        fprintf(stderr, "--columns can't be used with --raw!\n");
+        exit(EXIT_FAILURE);
+    }
+    if(ctx->filter.nops && ctx->raw) {
+        fprintf(stderr, "--where can't be used with --raw!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Raw mode copies rows without buffering fields, so has none to limit
+    if(ctx->max_field_bytes && ctx->raw) {
+        fprintf(stderr, "--max-field-bytes can't be used with --raw!\n");
+        exit(EXIT_FAILURE);
+    }
+    for(intval=0;intval<(int)ctx->ncols && !ctx->col_names[intval];intval++);
+    if(intval < (int)ctx->ncols && !ctx->use_header) {
+        fprintf(stderr, "--columns can only use column names with --header!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // If we don't have to look any names up, we know which columns to skip
+    // right away
+    if((ctx->ncols || ctx->filter.nops) && intval == (int)ctx->ncols) {
+        columns_ready(ctx);
+    }
+
+    // Our output path comes last, unless our only argument is the file we're
+    // reading or the prefix to use if reading from STDIN
+    last = argc - optind > 1 || (list && argc > optind) ? argc - 1 : argc;
+
+    // Gather our inputs
+    for(;optind<last;optind++) {
+        if(ctx->from_stdin) {
+            add_input(ctx, argv[optind]);
+        } else {
+            add_input_arg(ctx, argv[optind]);
+        }
+    }
+    if(list) {
+        add_input_list(ctx, list);
+    }
+
+    if(!ctx->input_count) {
+        fprintf(stderr, "Must specify a file to process or a prefix to use if reading from STDIN!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Several inputs are each split on their own, so can't come from STDIN
+    // or be checkpointed as a single position in a single input
+    if(ctx->input_count > 1) {
+        if(ctx->from_stdin) {
+            fprintf(stderr, "--stdin takes a single prefix!\n");
+            exit(EXIT_FAILURE);
+        } else if(*ctx->ckpt_path) {
+            fprintf(stderr, "--checkpoint can only be used with a single input!\n");
+            exit(EXIT_FAILURE);
+        }
+        check_prefixes(ctx);
+    }
+
+    // Compile our file name template, which has to tell every file apart
+    if(!ctx->out_name_arg) {
+        ctx->out_name_arg = ctx->partitions ? OUT_NAME_PARTITIONS : OUT_NAME_DEFAULT;
+    }
+    if(outname_compile(&ctx->out_name, ctx->out_name_arg, errbuf, sizeof(errbuf))) {
+        fprintf(stderr, "Invalid --output-name template: %s\n", errbuf);
+        exit(EXIT_FAILURE);
+    } else if(!OUTNAME_USES(&ctx->out_name, OUTNAME_N)) {
+        fprintf(stderr, "--output-name needs {n}, the file number!\n");
+        exit(EXIT_FAILURE);
+    } else if(ctx->partitions && !OUTNAME_USES(&ctx->out_name, OUTNAME_PART)) {
+        fprintf(stderr, "--output-name needs {part} with --partitions!\n");
+        exit(EXIT_FAILURE);
+    } else if(ctx->input_count > 1 && !OUTNAME_USES(&ctx->out_name, OUTNAME_PREFIX)) {
+        fprintf(stderr, "--output-name needs {prefix} with more than one input!\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Copy in our first input file, which is the only one unless we have several
+    strcpy(ctx->in_file, ctx->inputs[0]);
+
+    // If we find that there are path parts in the file, keep track of just the basename
+    if((ptr = strrchr(ctx->in_file, '/'))) {
+        ctx->in_prefix = ptr+1;
+    } else {
+        ctx->in_prefix = ctx->in_file;
+    }
+
+    // Set our output path if it's not set
+    if(argv[optind] && *argv[optind]) {
+    	// Copy in our output path
+    	strcpy(ctx->out_path, argv[optind]);
+
+    	// Terminate with a '/' if it's not already terminated
+    	if(ctx->out_path[strlen(ctx->out_path)]-1 != '/') {
+    		strcat(ctx->out_path, "/");
+    	}
+    }
+
+    // Success
+    return 0;
+}
+
+/**
+ * Add an IO thread, in a free slot or one whose thread has stopped
+ */
+static void io_grow(struct csv_context *ctx) {
+    unsigned int i;
+
+    for(i=0;i<ctx->thread_max && ctx->io_live[i] == 1;i++);
+    if(i == ctx->thread_max) {
+        return;
+    }
+
+    if(ctx->io_live[i] == 2) {
         pthread_join(ctx->io_threads[i], NULL);
+        ctx->io_live[i] = 0;
+    }
+
+    // We can do without another thread if we can't have one
+    if(pthread_create(&ctx->io_threads[i], NULL, io_worker, (void*)ctx) == 0) {
+        ctx->io_live[i] = 1;
+        ctx->io_running++;
+    }
+}
+
+/**
+ * Watch over our IO pool, growing it while our queue is backing up and our
+ * threads are all busy, and shrinking it while they're mostly idle.  We look
+ * at how full our queue is (by blocks, or by bytes if that's how it's
+ * bounded) and how much of the last interval our threads spent writing.
+ */
+static void *adapt_worker(void *arg) {
+    struct csv_context *ctx = (struct csv_context*)arg;
+    uint64_t now, busy, last = stats_ns(), last_busy = 0;
+    unsigned int full, pct;
+    struct timespec ts;
+
+    pthread_mutex_lock(&ctx->adapt_mutex);
+    while(!ctx->adapt_done) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += IO_ADAPT_INTERVAL * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        while(!ctx->adapt_done &&
+              pthread_cond_timedwait(&ctx->adapt_cond, &ctx->adapt_mutex, &ts) != ETIMEDOUT);
+        if(ctx->adapt_done) {
+            break;
+        }
+
+        now = stats_ns();
+        busy = __atomic_load_n(&ctx->io_busy_ns, __ATOMIC_RELAXED);
+        pct = (busy - last_busy) * 100 / ((now - last) * ctx->io_running);
+        last = now;
+        last_busy = busy;
+
+        full = fq_len(&ctx->io_queue) * 100 / ctx->queue_size;
+        if(ctx->queue_bytes &&
+           __atomic_load_n(&ctx->queued_bytes, __ATOMIC_RELAXED) * 100 / ctx->queue_bytes > full)
+        {
+            full = __atomic_load_n(&ctx->queued_bytes, __ATOMIC_RELAXED) * 100 / ctx->queue_bytes;
+        }
+
+        if(full >= IO_GROW_QUEUE && pct >= IO_GROW_BUSY) {
+            // Take back a thread we've asked to stop before starting another
+            if(ctx->io_retire) {
+                __atomic_store_n(&ctx->io_retire, ctx->io_retire - 1, __ATOMIC_RELAXED);
+            } else if(ctx->io_running < ctx->thread_max) {
+                io_grow(ctx);
+            }
+        } else if(full < IO_SHRINK_QUEUE && pct < IO_SHRINK_BUSY && !ctx->io_retire &&
+                  ctx->io_running > ctx->thread_count)
+        {
+            __atomic_store_n(&ctx->io_retire, 1, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&ctx->adapt_mutex);
+
+    return NULL;
+}
+
+/**
+ * Spin up our threads
+ */
+void spool_threads(struct csv_context *ctx) {
+    int i;
+
+    // Iterate up to our thread count
+    for(i=0;i<ctx->thread_count;i++) {
+        // We have to fail if our background threads fail to initialize
+        if(pthread_create(&ctx->io_threads[i], NULL, ctx->use_uring ? uring_worker : io_worker,
+                          (void*)ctx) != 0)
+        {
+            fprintf(stderr, "Couldn't start background IO threads!\n");
+            exit(EXIT_FAILURE);
+        }
+        ctx->io_live[i] = 1;
+    }
+    ctx->io_running = ctx->thread_count;
+
+    // Start watching over our pool if it can grow
+    if(ctx->thread_max) {
+        pthread_mutex_init(&ctx->adapt_mutex, NULL);
+        pthread_cond_init(&ctx->adapt_cond, NULL);
+        if(pthread_create(&ctx->adapt_thread, NULL, adapt_worker, (void*)ctx) != 0) {
+            fprintf(stderr, "Couldn't start IO pool thread!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * Wait for threads to exit, once our pool has stopped changing
+ */
+void join_threads(struct csv_context *ctx) {
+    unsigned int i;
+
+    if(ctx->thread_max) {
+        pthread_mutex_lock(&ctx->adapt_mutex);
+        ctx->adapt_done = 1;
+        pthread_cond_signal(&ctx->adapt_cond);
+        pthread_mutex_unlock(&ctx->adapt_mutex);
+
+        pthread_join(ctx->adapt_thread, NULL);
+    }
+
+    // Iterate, joining on threads, including any that stopped early
+    for(i=0;i<(ctx->thread_max ? ctx->thread_max : ctx->thread_count);i++) {
+        if(ctx->io_live[i]) {
+            pthread_join(ctx->io_threads[i], NULL);
+        }
+    }
+
+    if(ctx->thread_max) {
+        pthread_mutex_destroy(&ctx->adapt_mutex);
+        pthread_cond_destroy(&ctx->adapt_cond);
+    }
+}
+
+/**
+ * Print a progress line every so often until we're told to stop: how much
+ * input we've parsed and how fast, and how many files are waiting to be
+ * written and have been
+ */
+static void *progress_worker(void *arg) {
+    struct csv_context *ctx = (struct csv_context*)arg;
+    uint64_t sum[STAT_COUNT], io[STAT_COUNT], last_bytes = 0;
+    double last = 0, now;
+    struct timespec ts;
+
+    pthread_mutex_lock(&ctx->progress_mutex);
+    while(!ctx->progress_done) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += ctx->progress;
+        while(!ctx->progress_done &&
+              pthread_cond_timedwait(&ctx->progress_cond, &ctx->progress_mutex, &ts) != ETIMEDOUT);
+        if(ctx->progress_done) {
+            break;
+        }
+
+        stats_sum(STATS_PARSE, sum);
+        stats_sum(STATS_IO, io);
+        now = stats_elapsed();
+
+        fprintf(stderr, "progress: %.1fs, %.1f MB in (%.1f MB/s), %llu rows, %llu files written, queue %zu/%u, "
+                "%u IO threads\n", now, sum[STAT_IN_BYTES] / 1048576.0,
+                (sum[STAT_IN_BYTES] - last_bytes) / 1048576.0 / (now - last),
+                (unsigned long long)sum[STAT_ROWS], (unsigned long long)io[STAT_FILES],
+                fq_len(&ctx->io_queue), ctx->queue_size, __atomic_load_n(&ctx->io_running, __ATOMIC_RELAXED));
+
+        last = now;
+        last_bytes = sum[STAT_IN_BYTES];
+    }
+    pthread_mutex_unlock(&ctx->progress_mutex);
+
+    return NULL;
+}
+
+/**
+ * Start counting if we're reporting stats or progress, and start our
+ * progress thread if we want one
+ */
+static void stats_start_run(struct csv_context *ctx) {
+    if(!ctx->stats && !ctx->progress) {
+        return;
+    }
+
+    stats_enable();
+    stats_thread(STATS_PARSE);
+
+    if(ctx->progress) {
+        pthread_mutex_init(&ctx->progress_mutex, NULL);
+        pthread_cond_init(&ctx->progress_cond, NULL);
+        if(pthread_create(&ctx->progress_thread, NULL, progress_worker, (void*)ctx) != 0) {
+            fprintf(stderr, "Couldn't start progress thread!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/**
+ * Stop our progress thread and report our stats, as text on stderr or JSON
+ * on stdout
+ */
+static void stats_end_run(struct csv_context *ctx) {
+    if(ctx->progress) {
+        pthread_mutex_lock(&ctx->progress_mutex);
+        ctx->progress_done = 1;
+        pthread_cond_signal(&ctx->progress_cond);
+        pthread_mutex_unlock(&ctx->progress_mutex);
+
+        pthread_join(ctx->progress_thread, NULL);
+        pthread_mutex_destroy(&ctx->progress_mutex);
+        pthread_cond_destroy(&ctx->progress_cond);
+    }
+
+    if(ctx->stats == STATS_TEXT) {
+        stats_print(stderr);
+    } else if(ctx->stats == STATS_JSON) {
+        stats_print_json(stdout);
+    }
+
+    stats_free();
+}
+
+/**
+ * libcsv's allocation hooks don't take any context, so they find our arena
+ * here
+ */
+static struct arena *g_csv_arena;
+
+static void *csv_arena_realloc(void *ptr, size_t size) {
+    return arena_realloc(g_csv_arena, ptr, size);
+}
+
+static void csv_arena_free(void *ptr) {
+    arena_release(g_csv_arena, ptr);
+}
+
+/**
+ * Initialize a CSV parser, which gets its memory from our arena
+ */
+static void parser_init(struct csv_parser *parser) {
+    if(csv_init(parser, 0) != 0) {
+        fprintf(stderr, "Couldn't initialize CSV parser!\n");
+        exit(EXIT_FAILURE);
     }
+    csv_set_realloc_func(parser, csv_arena_realloc);
+    csv_set_free_func(parser, csv_arena_free);
+
+    // Set our csv block realloc size
+    csv_set_blk_size(parser, CSV_BLK_SIZE);
 }
 
 /**
  * Initialize context pointers
  */
 void context_init(struct csv_context *ctx) {
-    // Init our passthrough buffer
-    ctx->csv_buf = cbuf_init(BUFFER_SIZE);
-
-    // Initialize our blocking queue
-    fq_init(&ctx->io_queue, BG_QUEUE_MAX);
-
-    // Initialize our CSV parser
-    if(csv_init(&ctx->parser, 0) != 0) {
-        fprintf(stderr, "Couldn't initialize CSV parser!\n");
+    // We own everything for our run
+    ctx->run = ctx;
+
+    // Default IO queue length
+    ctx->queue_size = BG_QUEUE_MAX;
+
+    // Memory for our run, and caches for what we pass to our IO threads
+    arena_init(&ctx->arena);
+    if(slab_init(&ctx->item_slab, &ctx->arena, sizeof(struct q_flush_item)) ||
+       slab_init(&ctx->file_slab, &ctx->arena, sizeof(struct out_file)))
+    {
+        fprintf(stderr, "Couldn't initialize our allocator!\n");
         exit(EXIT_FAILURE);
     }
 
-    // Set our csv block realloc size
-    csv_set_blk_size(&ctx->parser, CSV_BLK_SIZE);
+    // Offsets handed back by our raw mode scanner
+    ctx->scan_idx = arena_alloc(&ctx->arena, READ_BUF_SIZE * sizeof *ctx->scan_idx);
+
+    // Initialize our CSV parser, which gets its memory from our arena too
+    g_csv_arena = &ctx->arena;
+    parser_init(&ctx->parser);
 
-    // Initialize our thread count
+    // Initialize our thread counts
     ctx->thread_count = IO_THREADS_DEFAULT;
+    ctx->parse_threads = PARSE_THREADS_MIN;
 
     // Default to no group column
     ctx->gcol = -1;
 
-    // Default to not gzipping our output files
-    ctx->gzip = 0;
+    // Default to not compressing our output files, but if we do, compress
+    // on as many threads as we have cores
+    ctx->codec = NULL;
+    ctx->compress_threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    if(ctx->compress_threads > PGZ_THREADS_MAX) {
+        ctx->compress_threads = PGZ_THREADS_MAX;
+    }
+
+    // Run as many triggers at once as we have cores
+    ctx->trigger_jobs = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    if(ctx->trigger_jobs > TRIGGER_JOBS_MAX) {
+        ctx->trigger_jobs = TRIGGER_JOBS_MAX;
+    }
+
+    // Shard our files by the thousand if we're asked to, and remember which
+    // directories we've made for them
+    ctx->shard_size = SHARD_SIZE_DEFAULT;
+    dircache_init(&ctx->dirs);
+
+    // And split as many inputs at once
+    ctx->input_jobs = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    if(ctx->input_jobs > INPUT_JOBS_MAX) {
+        ctx->input_jobs = INPUT_JOBS_MAX;
+    }
 
     // Header injection flags
     ctx->use_header   = 0;
@@ -449,8 +2511,31 @@ void context_init(struct csv_context *ctx) {
  * Free dynamically allocated stuff in our context
  */
 void context_free(struct csv_context *ctx) {
-    // Free our pass through buffer
+    unsigned int i;
+
+    // Free our pass through buffer, and any we recycled
     cbuf_free(ctx->csv_buf);
+    cbuf_pool_free(&ctx->buf_pool);
+
+    // Free our header copy
+    cbuf_free(ctx->header_buf);
+
+    // Free our partitions' buffers, if we didn't leave them to our inputs
+    for(i=0;ctx->parts && i<ctx->partitions;i++) {
+        cbuf_free(ctx->parts[i].buf);
+    }
+
+    // Free our projection
+    if(ctx->proj_buf) {
+        cbuf_free(ctx->proj_buf);
+    }
+
+    // Free our filter
+    filter_free(&ctx->filter);
+
+    // Free our file name template and the directories we've made
+    outname_free(&ctx->out_name);
+    dircache_free(&ctx->dirs);
 
     // Free group column buffer
     if(ctx->gcol_buf) {
@@ -459,12 +2544,113 @@ void context_free(struct csv_context *ctx) {
 
     // Free memory stored in our IO queue
     fq_free(&ctx->io_queue);
+    if(ctx->queue_bytes) {
+        pthread_mutex_destroy(&ctx->bytes_mutex);
+        pthread_cond_destroy(&ctx->bytes_cond);
+    }
 
     // Free our CSV parser
     csv_free(&ctx->parser);
 
-    // Free our thread storage
-    free(ctx->io_threads);
+    // Free everything else we allocated for our run
+    slab_destroy(&ctx->item_slab);
+    slab_destroy(&ctx->file_slab);
+    arena_free(&ctx->arena);
+}
+
+/**
+ * Parse a piece of our input, which starts at in_off
+ */
+static void parse_piece(struct csv_context *ctx, const char *buf, size_t len) {
+    uint64_t start = stats_start();
+
+    // Either pass rows through verbatim or parse our CSV
+    if(ctx->raw) {
+        raw_parse(ctx, buf, len);
+    } else if(csv_parse(&ctx->parser, buf, len, cb_col, cb_row, (void*)ctx) != len) {
+        if(csv_error(&ctx->parser) == CSV_ETOOBIG && ctx->max_field_bytes) {
+            fprintf(stderr, "Error while parsing file:  Found a field longer than %zu bytes "
+                    "(see --max-field-bytes), is there an unmatched quote?\n", ctx->max_field_bytes);
+        } else {
+            fprintf(stderr, "Error while parsing file:  %s\n", csv_strerror(csv_error(&ctx->parser)));
+        }
+        exit(EXIT_FAILURE);
+    }
+
+    stats_stop(STAT_PARSE_NS, start);
+    stats_add(STAT_IN_BYTES, len);
+    ctx->in_off += len;
+}
+
+/**
+ * Process a piece of our input.  If we're resuming, everything between the
+ * end of our header and our checkpoint has already been written, so we skip
+ * it.  We're between rows at both ends.
+ */
+static void parse_buf(struct csv_context *ctx, const char *buf, size_t len) {
+    off_t end = ctx->in_off + len;
+    size_t head, skip;
+
+    if(ctx->skip_end > ctx->in_off && ctx->skip_start < end) {
+        head = ctx->skip_start > ctx->in_off ? ctx->skip_start - ctx->in_off : 0;
+        if(head) {
+            parse_piece(ctx, buf, head);
+        }
+
+        skip = (ctx->skip_end < end ? ctx->skip_end : end) - ctx->in_off;
+        ctx->in_off += skip;
+        buf += head + skip;
+        len -= head + skip;
+    }
+
+    if(len) {
+        parse_piece(ctx, buf, len);
+    }
+}
+
+/**
+ * Parse the header of a file we're resuming, before we scan the rest of it
+ * from our checkpoint in parallel
+ */
+static void parse_head(struct csv_context *ctx, int fd, const char *map) {
+    char buf[READ_BUF_SIZE];
+    ssize_t ret;
+
+    if(map) {
+        parse_buf(ctx, map, ctx->skip_start);
+    }
+
+    while(ctx->in_off < ctx->skip_start) {
+        ret = pread(fd, buf, ctx->skip_start - ctx->in_off < (off_t)sizeof(buf) ?
+                    (size_t)(ctx->skip_start - ctx->in_off) : sizeof(buf), ctx->in_off);
+        if(ret <= 0) {
+            fprintf(stderr, "Error while reading file: %s\n", ret ? strerror(errno) : "Unexpected end of file");
+            exit(EXIT_FAILURE);
+        }
+        parse_buf(ctx, buf, ret);
+    }
+
+    ctx->in_off = ctx->skip_end;
+}
+
+/**
+ * Process a mapped file.  We parse straight out of the mapping, and let the
+ * kernel drop pages once we've moved past them.
+ */
+static void parse_map(struct csv_context *ctx, const char *map, size_t size) {
+    size_t pos, len, done = 0, drop;
+
+    for(pos=0;pos<size;pos+=len) {
+        len = size - pos < READ_BUF_SIZE ? size - pos : READ_BUF_SIZE;
+        parse_buf(ctx, map + pos, len);
+
+        // Anything we've parsed has been copied, so release it every so often
+        if(pos + len - done >= MMAP_RELEASE_SIZE) {
+            drop = (pos + len - done) & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+            madvise((void*)(map + done), drop, MADV_DONTNEED);
+            done += drop;
+        }
+    }
 }
 
 /**
@@ -473,7 +2659,13 @@ void context_free(struct csv_context *ctx) {
 void process_csv(struct csv_context *ctx) {
     FILE *fp;
     char buf[READ_BUF_SIZE];
-    size_t bytes_read;
+    const char *data;
+    size_t bytes_read = 0;
+    struct stat st;
+    void *map = MAP_FAILED;
+    struct dz_reader dz;
+    uint64_t start;
+    int ztype, ret;
 
     // Read from a file or STDIN
     if(!ctx->from_stdin) {
@@ -482,65 +2674,619 @@ void process_csv(struct csv_context *ctx) {
             fprintf(stderr, "Couldn't open input file '%s'\n", ctx->in_file);
             exit(EXIT_FAILURE);
         }
+
+        // Map regular files, rather than copying them into our read buffer
+        if(!fstat(fileno(fp), &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+            if(map != MAP_FAILED) {
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+            }
+        } else {
+            st.st_mode = 0;
+        }
     } else {
         // Just read from STDIN
         fp = stdin;
+        st.st_mode = 0;
+    }
+
+    // If we're resuming a regular file, it had better be the one we started
+    if(ctx->skip_end && S_ISREG(st.st_mode) && ctx->ckpt.in_size && ctx->ckpt.in_size != st.st_size) {
+        fprintf(stderr, "Error:  '%s' has changed size since checkpoint '%s'\n", ctx->in_file, ctx->ckpt_path);
+        exit(EXIT_FAILURE);
+    }
+    ctx->ckpt.in_size = S_ISREG(st.st_mode) ? st.st_size : 0;
+
+    // Set up our scanner, which only needs to report fields if we're grouping
+    if(ctx->raw) {
+        csv_scan_init(&ctx->scanner, CSV_COMMA, CSV_QUOTE, ctx->gcol > -1);
     }
 
-    // Process the file
-    while((bytes_read = fread(buf, 1, sizeof(buf), fp)) > 0) {
-        // Parse our CSV
-        if(csv_parse(&ctx->parser, buf, bytes_read, cb_col, cb_row, (void*)ctx) != bytes_read) {
-            fprintf(stderr, "Error while parsing file!\n");
+    // See whether our input is compressed from its first few bytes, which we
+    // have to read ourselves if we couldn't map it
+    if(map != MAP_FAILED) {
+        ztype = dz_detect(map, st.st_size);
+    } else {
+        bytes_read = fread(buf, 1, sizeof(buf), fp);
+        ztype = dz_detect(buf, bytes_read);
+    }
+
+    if(ztype != DZ_NONE) {
+        // Our files hold what we decompress, so shouldn't be named as if
+        // they were still compressed
+        if(!ctx->from_stdin && base_len(ctx->in_prefix, ztype) < strlen(ctx->in_prefix)) {
+            snprintf(ctx->in_base, sizeof(ctx->in_base), "%.*s", (int)base_len(ctx->in_prefix, ztype),
+                     ctx->in_prefix);
+            ctx->in_prefix = ctx->in_base;
+        }
+
+        // Decompress on another thread while we parse
+        if(map != MAP_FAILED) {
+            ret = dz_open(&dz, ztype, map, st.st_size, NULL, NULL, 0);
+        } else {
+            ret = dz_open(&dz, ztype, NULL, 0, fp, buf, bytes_read);
+        }
+        if(ret) {
+            fprintf(stderr, "Couldn't decompress %s input: %s\n", dz_name(ztype), dz_strerror(ret));
+            exit(EXIT_FAILURE);
+        }
+
+        start = stats_start();
+        while((bytes_read = dz_read(&dz, &data)) > 0) {
+            stats_stop(STAT_READ_NS, start);
+            parse_buf(ctx, data, bytes_read);
+            start = stats_start();
+        }
+
+        if(dz.error) {
+            fprintf(stderr, "Error while decompressing %s input: %s\n", dz_name(ztype),
+                    dz_strerror(dz.error));
             exit(EXIT_FAILURE);
         }
+
+        dz_close(&dz);
+    } else if(ctx->raw && ctx->parse_threads > 1 && S_ISREG(st.st_mode)) {
+        // Regular files can be scanned in parallel, straight from our mapping
+        // if we have one
+        if(ctx->skip_end) {
+            parse_head(ctx, fileno(fp), map != MAP_FAILED ? map : NULL);
+        }
+        raw_parse_ranges(ctx, fileno(fp), map != MAP_FAILED ? map : NULL, st.st_size);
+    } else if(map != MAP_FAILED) {
+        parse_map(ctx, map, st.st_size);
+    } else {
+        // Otherwise process the file a piece at a time, starting with
+        // whatever we read to check for compression
+        do {
+            parse_buf(ctx, buf, bytes_read);
+            start = stats_start();
+            bytes_read = fread(buf, 1, sizeof(buf), fp);
+            stats_stop(STAT_READ_NS, start);
+        } while(bytes_read > 0);
+    }
+
+    // If we're resuming, we'd better have got to our checkpoint
+    if(ctx->in_off < ctx->skip_end) {
+        fprintf(stderr, "Error:  Our input ends before checkpoint '%s'\n", ctx->ckpt_path);
+        exit(EXIT_FAILURE);
+    }
+
+    // Handle a final row that isn't newline terminated
+    if(ctx->raw) {
+        ctx->row_end = ctx->in_off;
+        if(CBUF_POS(ctx->csv_buf) > ctx->row_start) raw_row(ctx);
+    } else {
+        csv_fini(&ctx->parser, cb_col, cb_row, (void*)ctx);
     }
 
     // Write any additional rows to disk as long as it's just just our header we've been
     // keeping around (if we're injecting headers).
-    if(CBUF_POS(ctx->csv_buf) > ctx->header_len) flush_file(ctx, 0);
+    // If we're streaming, we also need to finish any file we've started.
+    if(ctx->partitions) {
+        partition_fin(ctx);
+    } else if(ctx->cur_file || CBUF_POS(ctx->csv_buf) > ctx->header_len) {
+        flush_file(ctx, 0);
+    }
 
-    // Close our file
+    // Unmap and close our file
+    if(map != MAP_FAILED) {
+        munmap(map, st.st_size);
+    }
     fclose(fp);
 }
 
+/**
+ * Give each of our partitions its own buffer
+ */
+static void partitions_init(struct csv_context *ctx) {
+    unsigned int i;
+
+    if(!(ctx->parts = arena_alloc(&ctx->run->arena, ctx->partitions * sizeof *ctx->parts))) {
+        fprintf(stderr, "Error:  Couldn't allocate partitions.\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(ctx->parts, 0, ctx->partitions * sizeof *ctx->parts);
+    for(i=0;i<ctx->partitions;i++) {
+        ctx->parts[i].buf = pool_get(ctx);
+        ctx->parts[i].row = ctx->count_header ? 1 : 0;
+    }
+    ctx->part_hash = part_hash(NULL, 0);
+}
+
+/**
+ * Set up a context to split one of several inputs.  We start with a copy of
+ * our run's context, which has all of our settings and hasn't parsed
+ * anything, and give it a parser and buffers of its own.  Everything we
+ * share is used through run.
+ */
+static void input_init(struct csv_context *ctx, struct csv_context *run, const char *path) {
+    char *ptr;
+
+    memcpy(ctx, run, sizeof(struct csv_context));
+    ctx->run = run;
+
+    strcpy(ctx->in_file, path);
+    ctx->in_prefix = (ptr = strrchr(ctx->in_file, '/')) ? ptr + 1 : ctx->in_file;
+
+    ctx->csv_buf = pool_get(ctx);
+    if(!(ctx->scan_idx = arena_alloc(&run->arena, READ_BUF_SIZE * sizeof *ctx->scan_idx))) {
+        fprintf(stderr, "Error:  Couldn't allocate memory for '%s'\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    parser_init(&ctx->parser);
+    if(ctx->max_field_bytes) {
+        csv_set_entry_max(&ctx->parser, ctx->max_field_bytes + 2);
+    }
+
+    // Column names are looked up in each input's own header, otherwise we
+    // already know which columns to skip
+    if(!ctx->cols_ready && ctx->ncols) {
+        ctx->cols = arena_alloc(&run->arena, ctx->ncols * sizeof *ctx->cols);
+        memcpy(ctx->cols, run->cols, ctx->ncols * sizeof *ctx->cols);
+    } else if(ctx->ncols) {
+        csv_set_skip(&ctx->parser, ctx->col_keep, ctx->col_keep_len);
+    }
+
+    if(ctx->partitions) {
+        partitions_init(ctx);
+    }
+}
+
+/**
+ * Free what input_init() gave us, and anything we allocated along the way
+ */
+static void input_free(struct csv_context *ctx) {
+    struct csv_context *run = ctx->run;
+    unsigned int i;
+
+    cbuf_pool_put(&run->buf_pool, ctx->csv_buf);
+    for(i=0;i<ctx->partitions;i++) {
+        cbuf_pool_put(&run->buf_pool, ctx->parts[i].buf);
+    }
+    arena_release(&run->arena, ctx->parts);
+
+    cbuf_free(ctx->header_buf);
+    if(ctx->proj_buf) {
+        cbuf_free(ctx->proj_buf);
+    }
+    if(ctx->gcol_buf) {
+        cbuf_free(ctx->gcol_buf);
+    }
+    arena_release(&run->arena, ctx->proj_off);
+    arena_release(&run->arena, ctx->proj_len);
+    if(ctx->col_keep != run->col_keep) {
+        arena_release(&run->arena, ctx->col_keep);
+    }
+    if(ctx->cols != run->cols) {
+        arena_release(&run->arena, ctx->cols);
+    }
+
+    csv_free(&ctx->parser);
+    arena_release(&run->arena, ctx->scan_idx);
+}
+
+/**
+ * Split inputs until there are none left.  Each of our input threads takes
+ * the next input in turn, and splits it on its own, numbering its files from
+ * one.
+ */
+static void *input_worker(void *arg) {
+    struct csv_context *run = (struct csv_context*)arg, *ctx;
+    unsigned int i;
+
+    stats_thread(STATS_PARSE);
+
+    if(!(ctx = malloc(sizeof(struct csv_context)))) {
+        fprintf(stderr, "Error:  Couldn't allocate an input context.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while((i = __atomic_fetch_add(&run->next_input, 1, __ATOMIC_RELAXED)) < run->input_count) {
+        input_init(ctx, run, run->inputs[i]);
+        process_csv(ctx);
+        input_free(ctx);
+    }
+
+    free(ctx);
+    return NULL;
+}
+
+/**
+ * Split all of our inputs, input_jobs at a time.  We're one of our input
+ * threads ourselves.
+ */
+static void process_inputs(struct csv_context *ctx) {
+    pthread_t *threads;
+    unsigned int i;
+
+    if(!(threads = arena_alloc(&ctx->arena, ctx->input_jobs * sizeof *threads))) {
+        fprintf(stderr, "Error:  Couldn't allocate thread storage.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for(i=1;i<ctx->input_jobs;i++) {
+        if(pthread_create(&threads[i], NULL, input_worker, (void*)ctx) != 0) {
+            fprintf(stderr, "Couldn't start input threads!\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    input_worker(ctx);
+
+    for(i=1;i<ctx->input_jobs;i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/**
+ * Set up checkpointing, and if we're resuming, pick up from our checkpoint
+ * if there is one: carry on numbering from its last file, skip what it
+ * covered, and remember our last group column value.  It has to have been
+ * written with the same settings we've been given, or we'd split the rest
+ * of our input differently.
+ */
+static void checkpoint_init(struct csv_context *ctx) {
+    struct ckpt ck;
+    int err;
+
+    pthread_mutex_init(&ctx->ckpt_mutex, NULL);
+
+    ctx->ckpt.raw = ctx->raw;
+    ctx->ckpt.gcol = ctx->gcol;
+    ctx->ckpt.max_rows = ctx->max_rows;
+    ctx->ckpt.max_bytes = ctx->max_bytes;
+    ctx->ckpt.use_header = ctx->use_header;
+    ctx->ckpt.count_header = ctx->count_header;
+
+    if(!ctx->resume) {
+        return;
+    } else if((err = ckpt_read(ctx->ckpt_path, &ck)) == ENOENT) {
+        fprintf(stderr, "Warning:  No checkpoint '%s', starting from the beginning\n", ctx->ckpt_path);
+        return;
+    } else if(err) {
+        fprintf(stderr, "Error:  Couldn't read checkpoint '%s': %s\n", ctx->ckpt_path,
+                err == EINVAL ? "Not a checkpoint we can use" : strerror(err));
+        exit(EXIT_FAILURE);
+    }
+
+    if(ck.raw != ctx->raw || ck.gcol != ctx->gcol || ck.max_rows != ctx->max_rows ||
+       ck.max_bytes != ctx->max_bytes || ck.use_header != ctx->use_header ||
+       ck.count_header != ctx->count_header)
+    {
+        fprintf(stderr, "Error:  Checkpoint '%s' was written with different --raw, --group-col, --num-rows, "
+                "--max-bytes or --header settings\n", ctx->ckpt_path);
+        exit(EXIT_FAILURE);
+    }
+
+    ctx->on_file = ctx->ckpt.on_file = ck.on_file;
+    ctx->ckpt.in_size = ck.in_size;
+    ctx->skip_start = ck.header_end;
+    ctx->skip_end = ck.offset;
+
+    if(ck.group_len) {
+        ctx->gcol_buf = cbuf_init(ck.group_len);
+        ctx->gcol_buf = cbuf_setlen(ctx->gcol_buf, ck.group, ck.group_len);
+        CBUF_SETPOS(ctx->gcol_buf, ck.group_len);
+    }
+
+    // We check our header against the one we're holding on to once we've
+    // parsed it
+    ctx->ckpt.header = ck.header;
+    ctx->ckpt.header_len = ck.header_len;
+    ck.header = NULL;
+    ck.header_len = 0;
+    ckpt_free(&ck);
+}
+
+/**
+ * How big the buffers in our pool should be.  Blocks are never much bigger
+ * than our partition or stream block size, and without those, whole files
+ * are no bigger than our byte limit (give or take a row) if we have one.
+ * We never start a buffer bigger than BUFFER_SIZE though, since a big limit
+ * would have every pooled buffer hold that much whether its file needs it
+ * or not.  Buffers grow as they fill.
+ */
+static size_t pool_buf_size(struct csv_context *ctx) {
+    if(ctx->part_size) {
+        return ctx->part_size;
+    } else if(ctx->stream_size) {
+        return ctx->stream_size;
+    } else if(ctx->max_bytes && !ctx->codec && ctx->max_bytes < BUFFER_SIZE - MAX_PREALLOC) {
+        return ctx->max_bytes + MAX_PREALLOC;
+    }
+
+    return BUFFER_SIZE;
+}
+
+/**
+ * How many of our buffers our IO queue can hold
+ */
+static size_t queue_bufs(struct csv_context *ctx, size_t buf_size) {
+    size_t n;
+
+    if(!ctx->queue_bytes) {
+        return ctx->queue_size;
+    }
+
+    n = (ctx->queue_bytes + buf_size - 1) / buf_size;
+    return n < ctx->queue_size ? n : ctx->queue_size;
+}
+
+/**
+ * Make our buffers fit our memory budget, if we have one.  Every input we're
+ * splitting holds a buffer (and one per partition), on top of those queued
+ * for or held by our IO threads, and they all come from our pool.  We split
+ * fewer inputs at once, and failing that shorten our queue, to fit.
+ */
+static void fit_budget(struct csv_context *ctx, size_t buf_size, unsigned int io_bufs) {
+    size_t avail = ctx->mem_budget / buf_size, per_input = ctx->partitions + 1;
+    size_t queued = queue_bufs(ctx, buf_size);
+
+    if(avail < 1 + io_bufs + per_input) {
+        fprintf(stderr, "Error:  --memory must be at least %zu bytes to split with %zu byte buffers\n",
+                (1 + io_bufs + per_input) * buf_size, buf_size);
+        exit(EXIT_FAILURE);
+    }
+
+    if(queued + io_bufs + per_input > avail) {
+        queued = avail - io_bufs - per_input;
+        if(ctx->queue_bytes) {
+            ctx->queue_bytes = queued * buf_size;
+        } else {
+            ctx->queue_size = queued;
+        }
+    }
+    if(ctx->input_jobs > (avail - queued - io_bufs) / per_input) {
+        ctx->input_jobs = (avail - queued - io_bufs) / per_input;
+    }
+}
+
+/**
+ * How many more files we can have open at once, raising our soft limit as
+ * far as we're allowed to first
+ */
+static size_t files_avail(void) {
+    struct rlimit rl;
+    struct dirent *de;
+    size_t used = 0;
+    DIR *dir;
+
+    if(getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+        return SIZE_MAX;
+    } else if(rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if(rl.rlim_cur == RLIM_INFINITY) {
+        return SIZE_MAX;
+    }
+
+    // Count what we already have open, which is at least stdio
+    if((dir = opendir("/proc/self/fd"))) {
+        while((de = readdir(dir))) {
+            if(de->d_name[0] != '.') used++;
+        }
+        closedir(dir);
+    }
+    if(used < 3) {
+        used = 3;
+    }
+
+    return rl.rlim_cur > used ? rl.rlim_cur - used : 0;
+}
+
+/**
+ * Every partition keeps its file open and holds a buffer for as long as
+ * we're splitting, for each input we split at once.  Make sure we can open
+ * that many files, and that their buffers fit in memory (our budget has
+ * already seen to that if we have one), splitting fewer inputs at once if
+ * need be.
+ */
+static void fit_partitions(struct csv_context *ctx, unsigned int io_bufs) {
+    size_t files = files_avail(), mem, reserve = FILES_RESERVE + io_bufs + ctx->input_jobs;
+    long pages = sysconf(_SC_PHYS_PAGES), page_size = sysconf(_SC_PAGESIZE);
+
+    files = files > reserve ? files - reserve : 0;
+    if(ctx->partitions > files) {
+        fprintf(stderr, "Error:  --partitions %u needs as many open files, but we can only open %zu more "
+                "(see ulimit -n)\n", ctx->partitions, files);
+        exit(EXIT_FAILURE);
+    }
+    if(ctx->input_jobs > files / ctx->partitions) {
+        ctx->input_jobs = files / ctx->partitions;
+    }
+
+    if(ctx->mem_budget || pages <= 0 || page_size <= 0) {
+        return;
+    }
+    mem = (size_t)pages * page_size / ((size_t)ctx->partitions * ctx->part_size);
+    if(!mem) {
+        fprintf(stderr, "Error:  --partitions %u needs %zu bytes of buffers, more memory than we have\n",
+                ctx->partitions, (size_t)ctx->partitions * ctx->part_size);
+        exit(EXIT_FAILURE);
+    }
+    if(ctx->input_jobs > mem) {
+        ctx->input_jobs = mem;
+    }
+}
+
 /**
  * Main entry point for processing arguments and starting the split process
  */
 int main(int argc, char **argv) {
 	// Create our context object, null it out
 	struct csv_context ctx;
+    unsigned int io_bufs;
+    uint64_t start;
+    int intval;
     memset(&ctx, 0, sizeof(struct csv_context));
 
-    // Initialize buffers
+    // Initialize defaults
     context_init(&ctx);
 
     // Attempt to parse our arguments
     parse_args(&ctx, argc, argv);
 
-    // Allocate memory for thread storage
-    ctx.io_threads = malloc(ctx.thread_count * sizeof *ctx.io_threads);
+    // Write with a single io_uring thread if we've been asked to and can,
+    // or fall back to our IO threads.  Compressed output is written through
+    // stdio by its codec, so always goes to our IO threads.
+    if(ctx.want_uring && ctx.codec) {
+        fprintf(stderr, "Warning:  --io-uring only writes uncompressed output, using IO threads\n");
+    } else if(ctx.want_uring && (intval = uring_init(&ctx.ring, URING_ENTRIES)) != 0) {
+        fprintf(stderr, "Warning:  io_uring isn't available (%s), using IO threads\n", strerror(intval));
+    } else if(ctx.want_uring) {
+        ctx.use_uring = 1;
+        ctx.thread_count = 1;
+        ctx.thread_max = 0;
+    }
+
+    // Compressed output can't be written in whole pages, but can still be
+    // dropped from the cache
+    if(ctx.cache_mode == CACHE_DIRECT && ctx.codec) {
+        fprintf(stderr, "Warning:  --direct only writes uncompressed output, dropping written pages instead\n");
+        ctx.cache_mode = CACHE_DROP;
+    }
+
+    // Partitions send their data on in blocks, streaming or not
+    if(ctx.partitions) {
+        ctx.part_size = ctx.stream_size ? ctx.stream_size : PARTITION_BLOCK_SIZE;
+    }
+
+    // Split as many inputs at once as we've been asked to, but no more than
+    // we have, and no more than fit in our memory budget
+    io_bufs = ctx.use_uring ? URING_BLOCKS_MAX : ctx.thread_max ? ctx.thread_max : ctx.thread_count;
+    if(ctx.input_jobs > ctx.input_count) {
+        ctx.input_jobs = ctx.input_count;
+    }
+    if(ctx.mem_budget) {
+        fit_budget(&ctx, pool_buf_size(&ctx), io_bufs);
+    }
+    if(ctx.partitions) {
+        fit_partitions(&ctx, io_bufs);
+    }
+
+    // Init our buffer pool, which only ever needs to hold as many buffers as
+    // can be queued or in our IO threads (plus one per partition for each
+    // input we're splitting), and take our passthrough buffer.  O_DIRECT needs
+    // them page aligned.
+    cbuf_pool_init_aligned(&ctx.buf_pool, pool_buf_size(&ctx), queue_bufs(&ctx, pool_buf_size(&ctx)) + io_bufs +
+                           ctx.input_jobs * (ctx.partitions + 1),
+                           ctx.cache_mode == CACHE_DIRECT ? DIRECT_ALIGN : 0);
+    ctx.csv_buf = pool_get(&ctx);
+
+    // Give each partition its own buffer, unless our inputs each get their own
+    if(ctx.partitions && ctx.input_count == 1) {
+        partitions_init(&ctx);
+    }
+
+    // Initialize our blocking queue
+    if(fq_init(&ctx.io_queue, ctx.queue_size) != 0) {
+        fprintf(stderr, "Error:  Couldn't initialize IO queue.\n");
+        exit(EXIT_FAILURE);
+    }
+    if(ctx.queue_bytes) {
+        pthread_mutex_init(&ctx.bytes_mutex, NULL);
+        pthread_cond_init(&ctx.bytes_cond, NULL);
+    }
+
+    // Allocate memory for thread storage, with room for as many as our pool
+    // can grow to
+    intval = ctx.thread_max ? ctx.thread_max : ctx.thread_count;
+    ctx.io_threads = arena_alloc(&ctx.arena, intval * sizeof *ctx.io_threads);
+    if((ctx.io_live = arena_alloc(&ctx.arena, intval))) {
+        memset(ctx.io_live, 0, intval);
+    }
 
     // OOM sanity check
-    if(!ctx.io_threads) {
+    if(!ctx.io_threads || !ctx.io_live) {
         fprintf(stderr, "Error:  Couldn't allocate thread storage.\n");
         exit(EXIT_FAILURE);
     }
 
+    // Start counting before any of our threads start, so they all count
+    stats_start_run(&ctx);
+
+    // Pick up where we left off if we're resuming
+    if(*ctx.ckpt_path) {
+        checkpoint_init(&ctx);
+    }
+
+    // Start our gzip compression threads if we're gzipping.  Other codecs
+    // manage their own threads per stream.
+    if(ctx.codec && !strcmp(ctx.codec->name, "gzip") &&
+       pgz_init(&ctx.pgz, ctx.compress_threads) != 0)
+    {
+        fprintf(stderr, "Couldn't start compression threads!\n");
+        exit(EXIT_FAILURE);
+    }
+    ctx.codec_opts.threads = ctx.compress_threads;
+    ctx.codec_opts.pgz = &ctx.pgz;
+
+    // Start our trigger executor if we've got a trigger
+    if(*ctx.trigger_cmd && trigger_init(&ctx.triggers, ctx.trigger_jobs) != 0) {
+        fprintf(stderr, "Couldn't start trigger executor!\n");
+        exit(EXIT_FAILURE);
+    }
+
     // Initialize our IO threads
     spool_threads(&ctx);
 
-    // Process our input
-    process_csv(&ctx);
+    // Process our input, or all of them
+    start = stats_start();
+    if(ctx.input_count > 1) {
+        process_inputs(&ctx);
+    } else {
+        process_csv(&ctx);
+    }
+    stats_stop(STAT_INPUT_NS, start);
 
     // Signal that we're done inside our queue
     fq_fin(&ctx.io_queue);
 
     // Join our threads
     join_threads(&ctx);
+    pgz_free(&ctx.pgz);
+    if(ctx.use_uring) {
+        uring_free(&ctx.ring);
+    }
 
-    // One last trigger showing we're done
-    exec_trigger(ctx.trigger_cmd, "", 0);
+    // Wait for our triggers to finish, then one last trigger showing we're done
+    if(*ctx.trigger_cmd) {
+        trigger_free(&ctx.triggers);
+        trigger_exec(ctx.trigger_cmd, "", 0);
+    }
+
+    // Report where our time went
+    stats_end_run(&ctx);
+
+    // Every file is written, so there's nothing left to resume
+    if(*ctx.ckpt_path) {
+        unlink(ctx.ckpt_path);
+        pthread_mutex_destroy(&ctx.ckpt_mutex);
+        ckpt_free(&ctx.ckpt);
+    }
 
     // Free memory from our context
     context_free(&ctx);
@@ -5,6 +5,19 @@
 #include "queue.h"
 #include <getopt.h>
 #include "csv.h"
+#include "csv-scan.h"
+#include "csv-range.h"
+#include <zlib.h>
+#include "pgz.h"
+#include "codec.h"
+#include "dz.h"
+#include "trigger.h"
+#include "filter.h"
+#include "arena.h"
+#include "uring.h"
+#include "stats.h"
+#include "checkpoint.h"
+#include "outname.h"
 
 /**
  * Version number
@@ -19,10 +32,71 @@
 #define IO_THREADS_MAX     10
 
 /**
- * How much of a backlog to allow in our IO queue
+ * How often we look at whether our IO pool should grow or shrink (in
+ * milliseconds), and what tells us to.  We grow when our queue is at least
+ * IO_GROW_QUEUE percent full and our threads are busy at least IO_GROW_BUSY
+ * percent of the time, and shrink when it's under IO_SHRINK_QUEUE percent
+ * full and they're busy less than IO_SHRINK_BUSY percent of the time.
+ */
+#define IO_ADAPT_INTERVAL 100
+#define IO_GROW_QUEUE     50
+#define IO_GROW_BUSY      75
+#define IO_SHRINK_QUEUE   10
+#define IO_SHRINK_BUSY    40
+
+/**
+ * Parse thread count limits, and how big a range each parse thread reads
+ * and scans at a time when we're processing a file in parallel
+ */
+#define PARSE_THREADS_MIN  1
+#define PARSE_THREADS_MAX  64
+#define PARSE_RANGE_SIZE   (8*1024*1024)
+
+/**
+ * How our files are named by default, with and without partitions, and how
+ * many files go in each {shard} by default
+ */
+#define OUT_NAME_DEFAULT      "{prefix}.{n:05}"
+#define OUT_NAME_PARTITIONS   "{prefix}.p{part:03}.{n:05}"
+#define SHARD_SIZE_DEFAULT    1000
+
+/**
+ * How many input files we split at once, at most
+ */
+#define INPUT_JOBS_MIN 1
+#define INPUT_JOBS_MAX 64
+
+/**
+ * How much of a backlog to allow in our IO queue by default
  */
 #define BG_QUEUE_MAX 20
 
+/**
+ * How many blocks our IO queue can hold when it's bounded by bytes instead,
+ * unless we're told otherwise
+ */
+#define QUEUE_BYTES_ITEMS 1024
+
+/**
+ * The most blocks our io_uring writer keeps in flight at once, and the most
+ * it writes in a single operation
+ */
+#define URING_BLOCKS_MAX (URING_ENTRIES/2)
+#define URING_WRITE_MAX  (1024*1024*1024)
+
+/**
+ * How we treat the page cache when writing output: leave it be, write with
+ * O_DIRECT, or drop what we've written once it's on disk.  O_DIRECT writes
+ * have to start and end on DIRECT_ALIGN boundaries, from buffers aligned
+ * the same way.
+ */
+#define CACHE_KEEP   0
+#define CACHE_DIRECT 1
+#define CACHE_DROP   2
+
+#define DIRECT_ALIGN    4096
+#define DIRECT_ROUND(n) (((n) + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1))
+
 /** 
  * The CSV realloc size, we're being aggressive here
  */
@@ -33,40 +107,167 @@
  */
 #define BUFFER_SIZE 1024*1000*10
 
+/**
+ * Default block size when streaming output files
+ */
+#define STREAM_BLOCK_SIZE (4*1024*1024)
+
+/**
+ * Maximum number of hash partitions, and the size of the blocks each one
+ * sends to our IO threads (unless we're streaming with our own block size)
+ */
+#define PARTITIONS_MAX       65536
+#define PARTITION_BLOCK_SIZE (1024*1024)
+
+/**
+ * Files we keep free for our inputs, triggers and anything else we open
+ * besides our partitions' output files
+ */
+#define FILES_RESERVE 16
+
+/**
+ * How much data we compress up front to estimate compressed file sizes
+ */
+#define RATIO_SAMPLE_SIZE (256*1024)
+
 /** 
  * How much data to read at a time
  */
 #define READ_BUF_SIZE 32768
 
 /**
- * Environment variable for payload file
+ * How much of a mapped input file we parse before telling the kernel it can
+ * drop those pages
  */
-#define ENV_PAYLOAD_VAR  "CSV_PAYLOAD_FILE"
-#define ENV_ROWCOUNT_VAR "CSV_ROWCOUNT"
+#define MMAP_RELEASE_SIZE (64*1024*1024)
+
+/**
+ * How we report our stats at exit, if we do, and how often we print a
+ * progress line by default (in seconds)
+ */
+#define STATS_OFF  0
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+#define PROGRESS_INTERVAL 1
+
+/**
+ * A hash partition, with its own output buffer and files
+ */
+struct partition {
+    // The data waiting to go to this partition's current file
+    cbuf buf;
+
+    // Its current file (once we've sent it a block), next block number,
+    // the rows in it so far, the bytes we've sent to it, and which of our
+    // files it is
+    struct out_file *file;
+    unsigned int seq;
+    unsigned long row;
+    size_t bytes;
+    unsigned int on_file;
+};
 
 // Context we'll need for our split operation
 struct csv_context {
+    /**
+     * The context for our whole run, which owns everything our inputs share:
+     * our IO queue and threads, buffer pool, allocators and triggers.  That's
+     * us, unless we're one of several inputs being split at once.
+     */
+    struct csv_context *run;
+
     // Our input file and output path
     char in_file[255], out_path[255];
 
-    // The prefix to use when we split
+    // The prefix to use when we split, which is our input's name without
+    // any compression suffix
     const char *in_prefix;
+    char in_base[255];
+
+    /**
+     * How we name our files (under our output path), how many files go in
+     * each shard, and the directories we've made for them
+     */
+    const char *out_name_arg;
+    struct outname out_name;
+    unsigned long shard_size;
+    struct dircache dirs;
+
+    /**
+     * Every input we've been given, how many we split at once, the next one
+     * to be taken, and the most memory our buffers should use between them
+     * (zero for no limit)
+     */
+    char **inputs;
+    unsigned int input_count, input_jobs, next_input;
+    size_t mem_budget;
 
 	// Trigger command to run when a chunk is done
     char trigger_cmd[255];
 
+    // Our trigger executor, and how many triggers it runs at once
+    struct trigger_pool triggers;
+    unsigned int trigger_jobs;
+
     // Should we read from stdin?
     int from_stdin;
 
     // Which part are we on
     unsigned int on_file;
 
+    /**
+     * Where we are in our input: where the piece we're parsing starts, where
+     * the last row we finished ends, where the row at our overflow position
+     * ends, where our header row ends, and where the last file we finished
+     * ends
+     */
+    off_t in_off, row_end, opos_end, header_end, flush_end;
+
+    /**
+     * Where we write checkpoints (empty if we don't), whether we're resuming
+     * from one, and our checkpoint, which also holds the settings we were
+     * started with
+     */
+    char ckpt_path[255];
+    int resume;
+    struct ckpt ckpt;
+
+    /**
+     * If we're resuming, the part of our input we skip, between the end of
+     * our header and our checkpoint.  Files that were written ahead of
+     * those before them are held until those are done too.
+     */
+    off_t skip_start, skip_end;
+    struct out_file *ckpt_held;
+    pthread_mutex_t ckpt_mutex;
+
     // The number of rows, and our current column
     unsigned long row, col;
 
     // The maximum number of rows per file
     unsigned long max_rows; 
 
+    /**
+     * The most bytes we want in each file (zero for no limit), compressed if
+     * we're compressing, how much of the current file we've already sent to
+     * our IO threads, and whether it's reached our row or byte limit
+     */
+    size_t max_bytes;
+    size_t file_bytes;
+    int full;
+
+    // The longest field we'll buffer (zero for no limit)
+    size_t max_field_bytes;
+
+    /**
+     * How many bytes our IO threads have been given, and how many they've
+     * written after compression, which tells us how well we're compressing.
+     * We also take our own sample up front.
+     */
+    size_t written_in, written_out;
+    int sampled;
+
 	/**
      * Mark our overflow position here, which lets us specify that
      * we've gone past our maximum row count but may need to in order
@@ -82,9 +283,54 @@ struct csv_context {
     int gcol;
 
     /**
-     * GZIP compression level (zero for none)
+     * Column projection.  The input column for each of our ncols output
+     * columns (-1 for one we'll find by name in our header), their names,
+     * which input columns our parser keeps, and whether we've worked all of
+     * that out yet
+     */
+    unsigned int ncols;
+    int *cols;
+    char **col_names;
+    unsigned char *col_keep;
+    size_t col_keep_len;
+    int cols_ready;
+
+    /**
+     * Our --where filter (with no instructions if we don't have one), and
+     * whether the row we're parsing has already failed it
      */
-    int gzip;
+    struct filter filter;
+    int drop;
+
+    /**
+     * The kept fields of the row we're parsing, stashed until we can write
+     * them out in order: their data, and each one's offset and length by
+     * input column
+     */
+    cbuf proj_buf;
+    size_t *proj_off, *proj_len;
+    size_t proj_size;
+
+    /**
+     * If we're partitioning, the number of partitions rows are routed to
+     * by a hash of their group column, the partitions themselves, the hash
+     * of the current row's value, and how big a partition's buffer gets
+     * before we send it to our IO threads
+     */
+    unsigned int partitions;
+    struct partition *parts;
+    uint64_t part_hash;
+    size_t part_size;
+
+    /**
+     * Our output codec (NULL for none) and its settings, how many threads
+     * we compress on, and our pool of threads to compress blocks of each
+     * gzip file in parallel
+     */
+    const struct codec *codec;
+    struct codec_opts codec_opts;
+    unsigned int compress_threads;
+    struct pgz_pool pgz;
 
     /**
      * Our header injection flag as well as the length of the header once
@@ -95,48 +341,203 @@ struct csv_context {
     unsigned short use_header;
     unsigned short count_header;
     unsigned int header_len;
+    cbuf header_buf;
 
     // Simple flag to let us know if we should put a comma
     unsigned int put_comma;
 
+    /**
+     * Raw passthrough mode.  Rather than re-encoding every field we only
+     * look for row boundaries and copy the row bytes verbatim into csv_buf
+     */
+    int raw;
+
+    /**
+     * Raw mode scanner state.  Our vectorized scanner and the offsets it
+     * hands back, where our current row starts in csv_buf (which we also
+     * keep track of when filtering), and where the group column lies
+     * (relative to the start of the row)
+     */
+    struct csv_scanner scanner;
+    uint32_t *scan_idx;
+    size_t row_start;
+    size_t gcol_start, gcol_end;
+
     // The last group column we encountered, so we can detect when it changes
     cbuf gcol_buf;
 
-    // A buffer we're using and re-using to write the CSV output data
+    // The buffer we're writing the current file's CSV output data to
     cbuf csv_buf;
 
-    // Our blocking, thread-safe, IO queue
+    /**
+     * If we're streaming, the size of the blocks we send to our IO threads
+     * as we go, rather than holding a whole file in memory.  Zero if not.
+     */
+    size_t stream_size;
+
+    // The file we're currently streaming blocks to, and its next block number
+    struct out_file *cur_file;
+    unsigned int cur_seq;
+
+    // Buffers we hand off to our IO threads, which they give back once written
+    cbuf_pool buf_pool;
+
+    // What we do about our output filling the page cache
+    int cache_mode;
+
+    /**
+     * Memory for the whole run, and caches of the queue items and output
+     * files we pass to our IO threads, which they give back once written
+     */
+    struct arena arena;
+    struct slab_cache item_slab, file_slab;
+
+    // Our blocking, thread-safe, IO queue and how many items it can hold
     fqueue io_queue;
+    unsigned int queue_size;
+
+    /**
+     * If our queue is bounded by bytes, the most it holds (the size of the
+     * buffers in it), how much it holds now, and how we wait for room
+     */
+    size_t queue_bytes, queued_bytes;
+    pthread_mutex_t bytes_mutex;
+    pthread_cond_t bytes_cond;
+
+    // The number of threads we'll use to scan file input in parallel
+    unsigned int parse_threads;
+
+    /**
+     * Whether we want to write with io_uring, and if we can, our ring and
+     * how many operations and blocks our writer has in flight
+     */
+    int want_uring, use_uring;
+    struct uring ring;
+    unsigned int uring_ops, uring_blocks;
 
     // The number of threads we're using, and storage for them
     unsigned int thread_count;
     pthread_t *io_threads;
+
+    /**
+     * If our IO pool adapts to how busy it is, the most threads we'll grow
+     * to (otherwise it's thread_count, which is also the fewest we'll shrink
+     * to), which of our slots have a thread we've yet to join, how many are
+     * running and how many we've asked to stop, how long they've spent
+     * writing, and the thread watching over them
+     */
+    unsigned int thread_max;
+    unsigned char *io_live;
+    unsigned int io_running, io_retire;
+    uint64_t io_busy_ns;
+    pthread_t adapt_thread;
+    pthread_mutex_t adapt_mutex;
+    pthread_cond_t adapt_cond;
+    int adapt_done;
+
+    /**
+     * How we report our stats at exit, and if we're printing progress, how
+     * often, our thread doing so, and how we tell it to stop
+     */
+    int stats;
+    unsigned int progress;
+    pthread_t progress_thread;
+    pthread_mutex_t progress_mutex;
+    pthread_cond_t progress_cond;
+    int progress_done;
     
     // Our CSV parser
     struct csv_parser parser;
 };
 
 /**
- * An item with enough information for our IO consumers to write to disk
+ * We're past our row limit but still keeping group column values together
  */
-struct q_flush_item { 
+#define IN_OVERFLOW(ctx) ((ctx)->gcol >= 0 && (ctx)->full)
+
+/**
+ * An output file, which our IO threads write to one block at a time
+ */
+struct out_file {
     // The filename where we'll write data
-    char out_file[255];
+    char path[1024];
 
     // Our trigger command
     const char *trigger_cmd;
 
+    // Our codec (NULL if we're not compressing)
+    const struct codec *codec;
+
+    // Our open file, and our compressed stream if we're compressing
+    FILE *fp;
+    void *cstate;
+
+    /**
+     * Whether we're writing with O_DIRECT (straight to our descriptor rather
+     * than through fp), whether our last block was padded out to a whole
+     * page and we need to cut ourselves back to size, and whether we drop
+     * our pages from the cache once written, and how far we've done so
+     */
+    int direct, pad, drop;
+    off_t dropped;
+
+    // The next block to write, so blocks are always written in order
+    unsigned int next_seq;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    /**
+     * Our io_uring writer's state (or our descriptor and size so far if
+     * we're writing with O_DIRECT): our descriptor (negative until it's
+     * open), where our next block goes, blocks waiting for us to be opened,
+     * how many writes we have in flight, and our row count once we've seen
+     * our last block
+     */
+    int fd;
+    off_t off;
+    struct q_flush_item *pending, *pending_tail;
+    unsigned int inflight;
+    int got_last;
+    unsigned long row_count;
+
+    /**
+     * If we're checkpointing, whether we sync before we're closed, our
+     * number, where the row after our last starts in our input, our last
+     * group column value, and the next file held after us
+     */
+    int sync;
+    unsigned int num;
+    off_t in_end;
+    char *group;
+    size_t group_len;
+    struct out_file *held_next;
+};
+
+/**
+ * An item with enough information for our IO consumers to write to disk
+ */
+struct q_flush_item { 
+    // The file we're writing to
+    struct out_file *file;
+
+    // Which block of the file this is, and whether it's the last one
+    unsigned int seq;
+    int last;
+
     // Our row count
     unsigned long row_count;
 
-    // The data we'll be writing
-    char *str;
+    // The data we'll be writing, a buffer from our pool
+    cbuf str;
 
-    // The data length
-    size_t len;
+    // The data length, and how much we count toward our queue's byte limit
+    size_t len, bytes;
 
-    // gzip compression level (zero for none)
-    int gzip;
+    // For our io_uring writer, where this block goes in our file, how much
+    // of it has been written, and the next block waiting on our file
+    off_t off;
+    size_t done;
+    struct q_flush_item *next;
 };
 
 static const struct option g_long_opts[] = {
@@ -148,6 +549,33 @@ static const struct option g_long_opts[] = {
     { "version", no_argument, NULL, 'v'},
     { "gzip", optional_argument, NULL, 'z'},
     { "header", optional_argument, NULL, 'd'},
+    { "raw", no_argument, NULL, 'r'},
+    { "parse-threads", required_argument, NULL, 'p'},
+    { "queue-size", required_argument, NULL, 'q'},
+    { "stream", optional_argument, NULL, 's'},
+    { "compress", required_argument, NULL, 'c'},
+    { "compress-threads", required_argument, NULL, 0},
+    { "trigger-jobs", required_argument, NULL, 0},
+    { "partitions", required_argument, NULL, 0},
+    { "max-bytes", required_argument, NULL, 'b'},
+    { "columns", required_argument, NULL, 'C'},
+    { "where", required_argument, NULL, 'w'},
+    { "max-field-bytes", required_argument, NULL, 0},
+    { "io-uring", no_argument, NULL, 0},
+    { "direct", no_argument, NULL, 0},
+    { "drop-cache", no_argument, NULL, 0},
+    { "gzip-threads", required_argument, NULL, 0},
+    { "stats", optional_argument, NULL, 0},
+    { "progress", optional_argument, NULL, 0},
+    { "checkpoint", required_argument, NULL, 0},
+    { "resume", no_argument, NULL, 0},
+    { "files-from", required_argument, NULL, 0},
+    { "input-jobs", required_argument, NULL, 0},
+    { "memory", required_argument, NULL, 0},
+    { "output-name", required_argument, NULL, 0},
+    { "io-threads-max", required_argument, NULL, 0},
+    { "queue-bytes", required_argument, NULL, 0},
+    { "shard-size", required_argument, NULL, 0},
     { 0, 0, 0, 0}
 };
 
@@ -51,10 +51,15 @@ struct csv_parser {
   unsigned char delim_char;
   int (*is_space)(unsigned char);
   int (*is_term)(unsigned char);
-  size_t blk_size;
+  size_t blk_size;    /* Smallest amount to grow entry_buf by */
+  size_t entry_max;   /* Largest entry_buf may grow to, or 0 for no limit */
   void *(*malloc_func)(size_t);
   void *(*realloc_func)(void *, size_t);
   void (*free_func)(void *);
+  const unsigned char *keep; /* Which fields to keep, or NULL for all of them */
+  size_t keep_len;    /* Length of keep, fields past it are skipped */
+  size_t field;       /* The field we're on in the current row */
+  size_t row_end;     /* How far into the current csv_parse() input the last row ended */
 };
 
 /* Function Prototypes */
@@ -79,6 +84,8 @@ void csv_set_term_func(struct csv_parser *p, int (*f)(unsigned char));
 void csv_set_realloc_func(struct csv_parser *p, void *(*)(void *, size_t));
 void csv_set_free_func(struct csv_parser *p, void (*)(void *));
 void csv_set_blk_size(struct csv_parser *p, size_t);
+void csv_set_entry_max(struct csv_parser *p, size_t);
+void csv_set_skip(struct csv_parser *p, const unsigned char *keep, size_t len);
 size_t csv_get_buffer_size(struct csv_parser *p);
 
 #ifdef __cplusplus
@@ -0,0 +1,364 @@
+/*
+ * dz.c
+ *
+ * Decompressing input reader
+ */
+
+#include "dz.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/**
+ * How much of a mapping we decompress before we let the kernel drop it
+ */
+#define DZ_RELEASE_SIZE (64*1024*1024)
+
+/**
+ * Decompressor state, which lives on our thread
+ */
+struct dz_state {
+    // Compressed input we haven't consumed yet
+    const char *in;
+    size_t in_len;
+
+    // Whether we're part way through a stream (gzip member or zstd frame)
+    int in_stream;
+
+    // Where we read compressed data from a FILE into
+    char *rbuf;
+
+    // How far through our mapping we are, and how much we've released
+    size_t map_pos, map_done;
+
+    // Our decompressor
+    z_stream strm;
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zds;
+#endif
+};
+
+int dz_detect(const char *buf, size_t len) {
+    const unsigned char *p = (const unsigned char*)buf;
+
+    if(len >= 2 && p[0] == 0x1f && p[1] == 0x8b) {
+        return DZ_GZIP;
+    } else if(len >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd) {
+        return DZ_ZSTD;
+    }
+
+    return DZ_NONE;
+}
+
+const char *dz_name(int type) {
+    switch(type) {
+        case DZ_GZIP: return "gzip";
+        case DZ_ZSTD: return "zstd";
+        default: return "uncompressed";
+    }
+}
+
+const char *dz_suffix(int type) {
+    switch(type) {
+        case DZ_GZIP: return ".gz";
+        case DZ_ZSTD: return ".zst";
+        default: return "";
+    }
+}
+
+const char *dz_strerror(int err) {
+    switch(err) {
+        case EPIPE: return "unexpected end of file";
+        case EINVAL: return "corrupt data";
+        case ENOTSUP: return "csv-split was built without support for it";
+        default: return strerror(err);
+    }
+}
+
+// Get more compressed input, returning zero once there is no more
+static size_t dz_input(struct dz_reader *dz, struct dz_state *st) {
+    size_t len, drop;
+
+    // Hand out our mapping a piece at a time, releasing what we're done with
+    if(dz->map) {
+        len = dz->map_len - st->map_pos < DZ_READ_SIZE ? dz->map_len - st->map_pos : DZ_READ_SIZE;
+        st->in = dz->map + st->map_pos;
+        st->map_pos += len;
+
+        if(st->map_pos - st->map_done >= DZ_RELEASE_SIZE) {
+            drop = (st->map_pos - st->map_done - len) & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+            madvise((void*)(dz->map + st->map_done), drop, MADV_DONTNEED);
+            st->map_done += drop;
+        }
+
+        return len;
+    }
+
+    // Whatever our caller read to find our magic comes first
+    if(dz->pre_len) {
+        st->in = dz->pre;
+        len = dz->pre_len;
+        dz->pre_len = 0;
+        return len;
+    }
+
+    if(!(len = fread(st->rbuf, 1, DZ_READ_SIZE, dz->fp)) && ferror(dz->fp)) {
+        dz->error = EIO;
+    }
+
+    st->in = st->rbuf;
+    return len;
+}
+
+/**
+ * Decompress as much of our input as we can into out, starting at *pos.
+ * Returns non zero on corrupt data.
+ */
+static int dz_step(struct dz_reader *dz, struct dz_state *st, char *out, size_t *pos, size_t size) {
+    int ret;
+
+    if(dz->type == DZ_GZIP) {
+        // gzip files can be several members back to back
+        if(!st->in_stream && st->in_len) {
+            inflateReset(&st->strm);
+            st->in_stream = 1;
+        }
+
+        st->strm.next_in = (Bytef*)st->in;
+        st->strm.avail_in = st->in_len;
+        st->strm.next_out = (Bytef*)out + *pos;
+        st->strm.avail_out = size - *pos;
+
+        ret = inflate(&st->strm, Z_NO_FLUSH);
+        if(ret == Z_STREAM_END) {
+            st->in_stream = 0;
+        } else if(ret != Z_OK && ret != Z_BUF_ERROR) {
+            return EINVAL;
+        }
+
+        st->in += st->in_len - st->strm.avail_in;
+        st->in_len = st->strm.avail_in;
+        *pos = size - st->strm.avail_out;
+    }
+#ifdef HAVE_ZSTD
+    else {
+        ZSTD_inBuffer in = { st->in, st->in_len, 0 };
+        ZSTD_outBuffer ob = { out, size, *pos };
+        size_t zret;
+
+        zret = ZSTD_decompressStream(st->zds, &ob, &in);
+        if(ZSTD_isError(zret)) {
+            return EINVAL;
+        }
+
+        // Zero means we're at the end of a frame
+        st->in_stream = zret != 0;
+        st->in += in.pos;
+        st->in_len -= in.pos;
+        *pos = ob.pos;
+    }
+#endif
+
+    return 0;
+}
+
+/**
+ * Fill a buffer with decompressed data, setting *done once we've reached the
+ * end of our input (or failed)
+ */
+static size_t dz_fill(struct dz_reader *dz, struct dz_state *st, char *out, int *done) {
+    size_t pos = 0, prev;
+
+    while(pos < DZ_BUF_SIZE) {
+        if(!st->in_len && !(st->in_len = dz_input(dz, st))) {
+            if(dz->error) {
+                *done = 1;
+                break;
+            }
+
+            // Out of input, but we may still have output to flush
+            prev = pos;
+            if(st->in_stream && !(dz->error = dz_step(dz, st, out, &pos, DZ_BUF_SIZE)) &&
+               (pos > prev || !st->in_stream))
+            {
+                continue;
+            }
+
+            // Anything short of the end of a stream means we were cut off
+            if(st->in_stream && !dz->error) {
+                dz->error = EPIPE;
+            }
+
+            *done = 1;
+            break;
+        }
+
+        if((dz->error = dz_step(dz, st, out, &pos, DZ_BUF_SIZE))) {
+            *done = 1;
+            break;
+        }
+    }
+
+    return pos;
+}
+
+// Our decompression thread
+static void *dz_worker(void *arg) {
+    struct dz_reader *dz = (struct dz_reader*)arg;
+    struct dz_state st;
+    int i = 0, done = 0, err = 0;
+    size_t len;
+
+    memset(&st, 0, sizeof(st));
+
+    // Set up our decompressor
+    if(!dz->map && !(st.rbuf = malloc(DZ_READ_SIZE))) {
+        err = ENOMEM;
+    } else if(dz->type == DZ_GZIP) {
+        err = inflateInit2(&st.strm, 15 + 16) != Z_OK ? ENOMEM : 0;
+    }
+#ifdef HAVE_ZSTD
+    else if(!(st.zds = ZSTD_createDStream())) {
+        err = ENOMEM;
+    }
+#endif
+
+    pthread_mutex_lock(&dz->mutex);
+    dz->error = err;
+    pthread_mutex_unlock(&dz->mutex);
+
+    while(!err && !done) {
+        // Wait for our reader to give this buffer back
+        pthread_mutex_lock(&dz->mutex);
+        while(dz->full[i] && !dz->stop) {
+            pthread_cond_wait(&dz->cond, &dz->mutex);
+        }
+        if(dz->stop) {
+            pthread_mutex_unlock(&dz->mutex);
+            break;
+        }
+        pthread_mutex_unlock(&dz->mutex);
+
+        len = dz_fill(dz, &st, dz->bufs[i], &done);
+
+        // Hand it over, and move on to our other buffer
+        pthread_mutex_lock(&dz->mutex);
+        dz->lens[i] = len;
+        dz->full[i] = len > 0;
+        pthread_cond_broadcast(&dz->cond);
+        pthread_mutex_unlock(&dz->mutex);
+
+        i ^= 1;
+    }
+
+    // Let our reader know there's nothing more coming
+    pthread_mutex_lock(&dz->mutex);
+    dz->eof = 1;
+    pthread_cond_broadcast(&dz->cond);
+    pthread_mutex_unlock(&dz->mutex);
+
+    if(dz->type == DZ_GZIP) {
+        inflateEnd(&st.strm);
+    }
+#ifdef HAVE_ZSTD
+    ZSTD_freeDStream(st.zds);
+#endif
+    free(st.rbuf);
+
+    return NULL;
+}
+
+int dz_open(struct dz_reader *dz, int type, const char *map, size_t map_len,
+            FILE *fp, const char *pre, size_t pre_len)
+{
+    int ret;
+
+    memset(dz, 0, sizeof(struct dz_reader));
+
+#ifndef HAVE_ZSTD
+    if(type == DZ_ZSTD) {
+        return ENOTSUP;
+    }
+#endif
+    if(type != DZ_GZIP && type != DZ_ZSTD) {
+        return EINVAL;
+    }
+
+    dz->type = type;
+    dz->map = map;
+    dz->map_len = map_len;
+    dz->fp = fp;
+    dz->pre = pre;
+    dz->pre_len = pre_len;
+    dz->cur = -1;
+
+    if(!(dz->bufs[0] = malloc(DZ_BUF_SIZE)) || !(dz->bufs[1] = malloc(DZ_BUF_SIZE))) {
+        free(dz->bufs[0]);
+        return ENOMEM;
+    }
+
+    pthread_mutex_init(&dz->mutex, NULL);
+    pthread_cond_init(&dz->cond, NULL);
+
+    if((ret = pthread_create(&dz->thread, NULL, dz_worker, (void*)dz))) {
+        pthread_mutex_destroy(&dz->mutex);
+        pthread_cond_destroy(&dz->cond);
+        free(dz->bufs[0]);
+        free(dz->bufs[1]);
+        return ret;
+    }
+
+    return 0;
+}
+
+size_t dz_read(struct dz_reader *dz, const char **buf) {
+    size_t len = 0;
+    int next;
+
+    pthread_mutex_lock(&dz->mutex);
+
+    // Give back the buffer we were using
+    if(dz->cur >= 0) {
+        dz->full[dz->cur] = 0;
+        pthread_cond_broadcast(&dz->cond);
+    }
+
+    // Buffers are filled alternately, so ours is the next one
+    next = dz->cur < 0 ? 0 : dz->cur ^ 1;
+    while(!dz->full[next] && !dz->eof) {
+        pthread_cond_wait(&dz->cond, &dz->mutex);
+    }
+
+    if(dz->full[next]) {
+        *buf = dz->bufs[next];
+        len = dz->lens[next];
+        dz->cur = next;
+    } else {
+        dz->cur = -1;
+    }
+
+    pthread_mutex_unlock(&dz->mutex);
+
+    return len;
+}
+
+void dz_close(struct dz_reader *dz) {
+    pthread_mutex_lock(&dz->mutex);
+    dz->stop = 1;
+    pthread_cond_broadcast(&dz->cond);
+    pthread_mutex_unlock(&dz->mutex);
+
+    pthread_join(dz->thread, NULL);
+
+    pthread_mutex_destroy(&dz->mutex);
+    pthread_cond_destroy(&dz->cond);
+    free(dz->bufs[0]);
+    free(dz->bufs[1]);
+}
@@ -0,0 +1,121 @@
+/*
+ * dz.h
+ *
+ * Decompressing input reader.  Compressed input (gzip, or zstd if we're
+ * built with it) is recognized by its magic bytes and inflated on a thread
+ * of its own, which fills one of two buffers while the parser works through
+ * the other, so decompression and parsing overlap.
+ */
+
+#ifndef DZ_H_
+#define DZ_H_
+
+#include <stdio.h>
+#include <pthread.h>
+
+/**
+ * Size of each of our two buffers
+ */
+#define DZ_BUF_SIZE (1024*1024)
+
+/**
+ * How much compressed data we read from a file at once
+ */
+#define DZ_READ_SIZE (128*1024)
+
+/**
+ * Formats we know about
+ */
+#define DZ_NONE 0
+#define DZ_GZIP 1
+#define DZ_ZSTD 2
+
+/**
+ * A decompressing reader
+ */
+struct dz_reader {
+    /**
+     * Which format we're decompressing
+     */
+    int type;
+
+    /**
+     * Where our compressed data comes from: either a mapping of the whole
+     * file, or a FILE we read from after first handing out the pre_len
+     * bytes in pre, which the caller already read to find our magic
+     */
+    const char *map;
+    size_t map_len;
+    FILE *fp;
+    const char *pre;
+    size_t pre_len;
+
+    /**
+     * Our two buffers, how much is in each, and whether each is full (and
+     * so belongs to our reader rather than our thread)
+     */
+    char *bufs[2];
+    size_t lens[2];
+    int full[2];
+
+    /**
+     * The buffer our reader is using, if any
+     */
+    int cur;
+
+    /**
+     * Set once we've decompressed everything (or failed to, with error
+     * set), or if our reader wants us to stop
+     */
+    int eof, error, stop;
+
+    /**
+     * Our thread
+     */
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+/**
+ * Work out what format some data is in from its first bytes
+ */
+int dz_detect(const char *buf, size_t len);
+
+/**
+ * Name of a format, for error messages
+ */
+const char *dz_name(int type);
+
+/**
+ * The file name suffix a format usually has (e.g. ".gz"), or an empty string
+ */
+const char *dz_suffix(int type);
+
+/**
+ * Describe an error from our reader
+ */
+const char *dz_strerror(int err);
+
+/**
+ * Start decompressing data of a given type, either from a mapping (if map
+ * is non NULL) or from a FILE, after the pre_len bytes in pre.  Returns
+ * zero on success.
+ */
+int dz_open(struct dz_reader *dz, int type, const char *map, size_t map_len,
+            FILE *fp, const char *pre, size_t pre_len);
+
+/**
+ * Get the next block of decompressed data, which is valid until our next
+ * call.  Returns the length of the block, or zero once we're done (or on
+ * error, in which case error is set, to EPIPE if our input was cut short or
+ * EINVAL if it's corrupt).
+ */
+size_t dz_read(struct dz_reader *dz, const char **buf);
+
+/**
+ * Stop our thread and free our buffers
+ */
+void dz_close(struct dz_reader *dz);
+
+#endif /* DZ_H_ */
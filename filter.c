@@ -0,0 +1,340 @@
+/*
+ * filter.c
+ *
+ * Row filter compiler and evaluator
+ */
+
+#include "filter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <setjmp.h>
+#include <errno.h>
+
+/**
+ * Longest value we'll try to read as a number
+ */
+#define FILTER_NUM_MAX 64
+
+/**
+ * Highest column we'll compare, so a typo can't have us allocate (or
+ * overflow) a table of every column up to it
+ */
+#define FILTER_COL_MAX (1 << 20)
+
+/**
+ * Compiler state
+ */
+struct filter_cc {
+    struct filter *f;
+    const char *p;
+    char *err;
+    size_t err_len;
+    jmp_buf fail;
+};
+
+// Give up compiling with an error message
+static void cc_fail(struct filter_cc *cc, const char *msg) {
+    if(*cc->p) {
+        snprintf(cc->err, cc->err_len, "%s at '%.16s'", msg, cc->p);
+    } else {
+        snprintf(cc->err, cc->err_len, "%s at end of expression", msg);
+    }
+    longjmp(cc->fail, 1);
+}
+
+// Skip whitespace
+static void cc_space(struct filter_cc *cc) {
+    while(isspace((unsigned char)*cc->p)) cc->p++;
+}
+
+// Consume a token if it's next
+static int cc_accept(struct filter_cc *cc, const char *tok) {
+    size_t len = strlen(tok);
+
+    cc_space(cc);
+    if(strncmp(cc->p, tok, len)) {
+        return 0;
+    }
+
+    cc->p += len;
+    return 1;
+}
+
+// Add an instruction, returning its index
+static size_t cc_emit(struct filter_cc *cc, int code) {
+    struct filter *f = cc->f;
+    struct filter_op *ops;
+
+    if(f->nops == f->size) {
+        if(!(ops = realloc(f->ops, (f->size ? f->size * 2 : 8) * sizeof *f->ops))) {
+            cc_fail(cc, "Out of memory");
+        }
+        f->ops = ops;
+        f->size = f->size ? f->size * 2 : 8;
+    }
+
+    memset(&f->ops[f->nops], 0, sizeof *f->ops);
+    f->ops[f->nops].code = code;
+
+    return f->nops++;
+}
+
+// Mark a column as one we look at
+static void cc_need(struct filter_cc *cc, unsigned int col) {
+    struct filter *f = cc->f;
+    unsigned char *need;
+
+    if(col >= f->need_len) {
+        if(!(need = realloc(f->need, col + 1))) {
+            cc_fail(cc, "Out of memory");
+        }
+        f->need = need;
+        memset(f->need + f->need_len, 0, col + 1 - f->need_len);
+        f->need_len = col + 1;
+    }
+
+    f->need[col] = 1;
+}
+
+// Parse a quoted string, with backslash escapes
+static void cc_string(struct filter_cc *cc, struct filter_op *op) {
+    const char *start = ++cc->p;
+    size_t len = 0;
+
+    if(!(op->str = malloc(strlen(start) + 1))) {
+        cc_fail(cc, "Out of memory");
+    }
+
+    while(*cc->p != '"') {
+        if(!*cc->p) {
+            cc->p = start - 1;
+            cc_fail(cc, "Unterminated string");
+        }
+        if(*cc->p == '\\' && cc->p[1]) {
+            cc->p++;
+        }
+        op->str[len++] = *cc->p++;
+    }
+
+    cc->p++;
+    op->str[len] = '\0';
+    op->len = len;
+}
+
+// Parse a comparison: colN OP "string" or colN OP number
+static void cc_compare(struct filter_cc *cc) {
+    static const struct { const char *tok; int op; } ops[] = {
+        { "==", FILTER_EQ }, { "!=", FILTER_NE }, { "<=", FILTER_LE },
+        { ">=", FILTER_GE }, { "^=", FILTER_PREFIX }, { "<", FILTER_LT },
+        { ">", FILTER_GT }, { "=", FILTER_EQ }
+    };
+    struct filter_op *op;
+    unsigned long col;
+    size_t i, idx;
+    char *end;
+
+    cc_space(cc);
+    if(strncmp(cc->p, "col", 3) || !isdigit((unsigned char)cc->p[3])) {
+        cc_fail(cc, "Expected a column (e.g. col3)");
+    }
+
+    errno = 0;
+    col = strtoul(cc->p + 3, &end, 10);
+    if(errno == ERANGE || col > FILTER_COL_MAX) {
+        cc_fail(cc, "Column number too large");
+    }
+    cc->p = end;
+
+    for(i=0;i<sizeof(ops)/sizeof(*ops) && !cc_accept(cc, ops[i].tok);i++);
+    if(i == sizeof(ops)/sizeof(*ops)) {
+        cc_fail(cc, "Expected a comparison operator");
+    }
+
+    idx = cc_emit(cc, FILTER_CMP);
+    op = &cc->f->ops[idx];
+    op->col = col;
+    op->op = ops[i].op;
+    cc_need(cc, col);
+
+    cc_space(cc);
+    if(*cc->p == '"') {
+        cc_string(cc, op);
+    } else {
+        op->num = strtod(cc->p, &end);
+        if(end == cc->p) {
+            cc_fail(cc, "Expected a quoted string or a number");
+        }
+
+        // Keep its text too, so prefix tests work on numbers
+        op->len = end - cc->p;
+        if(!(op->str = strndup(cc->p, op->len))) {
+            cc_fail(cc, "Out of memory");
+        }
+        op->is_num = op->op != FILTER_PREFIX;
+        cc->p = end;
+    }
+}
+
+static void cc_or(struct filter_cc *cc);
+
+// Parse a comparison, or a negated or parenthesized expression
+static void cc_unary(struct filter_cc *cc) {
+    if(cc_accept(cc, "!")) {
+        cc_unary(cc);
+        cc_emit(cc, FILTER_NOT);
+    } else if(cc_accept(cc, "(")) {
+        cc_or(cc);
+        if(!cc_accept(cc, ")")) {
+            cc_fail(cc, "Expected ')'");
+        }
+    } else {
+        cc_compare(cc);
+    }
+}
+
+// a && b: if a leaves a zero, skip b
+static void cc_and(struct filter_cc *cc) {
+    size_t jump;
+
+    cc_unary(cc);
+    while(cc_accept(cc, "&&")) {
+        jump = cc_emit(cc, FILTER_JZ);
+        cc_unary(cc);
+        cc->f->ops[jump].jump = cc->f->nops;
+    }
+}
+
+// a || b: if a leaves a non zero, skip b
+static void cc_or(struct filter_cc *cc) {
+    size_t jump;
+
+    cc_and(cc);
+    while(cc_accept(cc, "||")) {
+        jump = cc_emit(cc, FILTER_JNZ);
+        cc_and(cc);
+        cc->f->ops[jump].jump = cc->f->nops;
+    }
+}
+
+int filter_compile(struct filter *f, const char *expr, char *err, size_t err_len) {
+    struct filter_cc cc;
+
+    memset(f, 0, sizeof(struct filter));
+
+    cc.f = f;
+    cc.p = expr;
+    cc.err = err;
+    cc.err_len = err_len;
+
+    if(setjmp(cc.fail)) {
+        filter_free(f);
+        return -1;
+    }
+
+    cc_or(&cc);
+
+    cc_space(&cc);
+    if(*cc.p) {
+        cc_fail(&cc, "Unexpected input");
+    }
+
+    f->single = f->nops == 1;
+
+    return 0;
+}
+
+// Read a value as a number, returning non zero if it is one
+static int filter_num(const char *s, size_t len, double *num) {
+    char buf[FILTER_NUM_MAX], *end;
+
+    if(!len || len >= sizeof(buf)) {
+        return 0;
+    }
+
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+
+    *num = strtod(buf, &end);
+    return *end == '\0';
+}
+
+int filter_test(const struct filter_op *op, const char *s, size_t len) {
+    double num;
+    int cmp;
+
+    if(!s) {
+        s = "";
+        len = 0;
+    }
+
+    // Equality and prefix tests are a length check and a memcmp
+    if(op->op == FILTER_PREFIX) {
+        return len >= op->len && !memcmp(s, op->str, op->len);
+    } else if(!op->is_num && op->op <= FILTER_NE) {
+        return (len == op->len && !memcmp(s, op->str, len)) == (op->op == FILTER_EQ);
+    }
+
+    if(op->is_num) {
+        // Values that aren't numbers are only ever not equal
+        if(!filter_num(s, len, &num)) {
+            return op->op == FILTER_NE;
+        }
+        cmp = num < op->num ? -1 : num > op->num;
+    } else if(!(cmp = memcmp(s, op->str, len < op->len ? len : op->len))) {
+        cmp = len < op->len ? -1 : len > op->len;
+    }
+
+    switch(op->op) {
+        case FILTER_EQ: return cmp == 0;
+        case FILTER_NE: return cmp != 0;
+        case FILTER_LT: return cmp < 0;
+        case FILTER_LE: return cmp <= 0;
+        case FILTER_GT: return cmp > 0;
+        default:        return cmp >= 0;
+    }
+}
+
+int filter_eval(const struct filter *f, filter_field_fn field, void *arg) {
+    const struct filter_op *op;
+    const char *s;
+    size_t pc, len;
+    int acc = 0;
+
+    for(pc=0;pc<f->nops;pc++) {
+        op = &f->ops[pc];
+
+        switch(op->code) {
+            case FILTER_CMP:
+                s = field(arg, op->col, &len);
+                acc = filter_test(op, s, len);
+                break;
+            case FILTER_NOT:
+                acc = !acc;
+                break;
+            case FILTER_JZ:
+                if(!acc) pc = op->jump - 1;
+                break;
+            case FILTER_JNZ:
+                if(acc) pc = op->jump - 1;
+                break;
+        }
+    }
+
+    return acc;
+}
+
+void filter_free(struct filter *f) {
+    size_t i;
+
+    for(i=0;i<f->nops;i++) {
+        free(f->ops[i].str);
+    }
+
+    free(f->ops);
+    free(f->need);
+    f->ops = NULL;
+    f->need = NULL;
+    f->nops = f->size = f->need_len = 0;
+}
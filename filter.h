@@ -0,0 +1,108 @@
+/*
+ * filter.h
+ *
+ * Row filter predicates.  An expression like
+ *
+ *     col3 == "GB" && (col7 > 100 || !(col2 ^= "tmp"))
+ *
+ * is compiled once into a flat program of comparisons and jumps, which is
+ * run against each row's fields with a single accumulator.  Comparisons
+ * against a quoted string compare bytes, against a bare number compare
+ * numerically, and ^= tests for a prefix.
+ */
+
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include <stddef.h>
+
+/**
+ * Instructions
+ */
+#define FILTER_CMP 0 /* Compare a column, setting our accumulator */
+#define FILTER_NOT 1 /* Invert our accumulator */
+#define FILTER_JZ  2 /* Jump if our accumulator is zero */
+#define FILTER_JNZ 3 /* Jump if our accumulator is non zero */
+
+/**
+ * Comparison operators
+ */
+#define FILTER_EQ     0
+#define FILTER_NE     1
+#define FILTER_LT     2
+#define FILTER_LE     3
+#define FILTER_GT     4
+#define FILTER_GE     5
+#define FILTER_PREFIX 6
+
+/**
+ * One instruction
+ */
+struct filter_op {
+    int code;
+
+    /**
+     * For a comparison: the column, operator, and what we're comparing it
+     * to, as a string or (if is_num is set) a number
+     */
+    unsigned int col;
+    int op;
+    char *str;
+    size_t len;
+    double num;
+    int is_num;
+
+    /**
+     * Where a jump goes
+     */
+    size_t jump;
+};
+
+/**
+ * A compiled filter
+ */
+struct filter {
+    struct filter_op *ops;
+    size_t nops, size;
+
+    /**
+     * Which columns we look at
+     */
+    unsigned char *need;
+    size_t need_len;
+
+    /**
+     * Set if we're a single comparison, which can be tested as soon as its
+     * column has been parsed
+     */
+    int single;
+};
+
+/**
+ * Get a column's value for our filter, returning NULL if the row doesn't
+ * have it
+ */
+typedef const char *(*filter_field_fn)(void *arg, unsigned int col, size_t *len);
+
+/**
+ * Compile an expression.  Returns zero on success, or non zero with a
+ * description of the problem in err.
+ */
+int filter_compile(struct filter *f, const char *expr, char *err, size_t err_len);
+
+/**
+ * Run a comparison against a value
+ */
+int filter_test(const struct filter_op *op, const char *s, size_t len);
+
+/**
+ * Run our filter against a row, returning non zero if it passes
+ */
+int filter_eval(const struct filter *f, filter_field_fn field, void *arg);
+
+/**
+ * Free a compiled filter
+ */
+void filter_free(struct filter *f);
+
+#endif /* FILTER_H_ */
@@ -44,29 +44,43 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #define MEM_BLK_SIZE 128
 
+/* Whether the field we're on is one we've been told to skip */
+#define FIELD_SKIPPED(p) ((p)->keep && ((p)->field >= (p)->keep_len || !(p)->keep[(p)->field]))
+
 #define SUBMIT_FIELD(p) \
   do { \
-   if (!quoted) \
-     entry_pos -= spaces; \
-   if (p->options & CSV_APPEND_NULL) \
-     ((p)->entry_buf[entry_pos]) = '\0'; \
-   if (cb1 && (p->options & CSV_EMPTY_IS_NULL) && !quoted && entry_pos == 0) \
-     cb1(NULL, entry_pos, data); \
-   else if (cb1) \
-     cb1(p->entry_buf, entry_pos, data); \
+   if (skip) { \
+     if (cb1) \
+       cb1(NULL, 0, data); \
+   } else { \
+     if (!quoted) \
+       entry_pos -= spaces; \
+     if (p->options & CSV_APPEND_NULL) \
+       ((p)->entry_buf[entry_pos]) = '\0'; \
+     if (cb1 && (p->options & CSV_EMPTY_IS_NULL) && !quoted && entry_pos == 0) \
+       cb1(NULL, entry_pos, data); \
+     else if (cb1) \
+       cb1(p->entry_buf, entry_pos, data); \
+   } \
    pstate = FIELD_NOT_BEGUN; \
    entry_pos = quoted = spaces = 0; \
+   (p)->field++; \
+   skip = FIELD_SKIPPED(p); \
  } while (0)
 
 #define SUBMIT_ROW(p, c) \
   do { \
+    (p)->row_end = pos; \
     if (cb2) \
       cb2(c, data); \
     pstate = ROW_NOT_BEGUN; \
     entry_pos = quoted = spaces = 0; \
+    (p)->field = 0; \
+    skip = FIELD_SKIPPED(p); \
   } while (0)
 
-#define SUBMIT_CHAR(p, c) ((p)->entry_buf[entry_pos++] = (c))
+/* Skipped fields are never copied */
+#define SUBMIT_CHAR(p, c) (skip ? 0 : ((p)->entry_buf[entry_pos++] = (c)))
 
 static char *csv_errors[] = {"success",
                              "error parsing data while strict checking enabled",
@@ -132,9 +146,14 @@ csv_init(struct csv_parser *p, unsigned char options)
   p->is_space = NULL;
   p->is_term = NULL;
   p->blk_size = MEM_BLK_SIZE;
+  p->entry_max = 0;
   p->malloc_func = NULL;
   p->realloc_func = realloc;
   p->free_func = free;
+  p->keep = NULL;
+  p->keep_len = 0;
+  p->field = 0;
+  p->row_end = 0;
 
   return 0;
 }
@@ -163,10 +182,14 @@ csv_fini(struct csv_parser *p, void (*cb1)(void *, size_t, void *), void (*cb2)(
   int pstate = p->pstate;
   size_t spaces = p->spaces;
   size_t entry_pos = p->entry_pos;
+  int skip;
+  size_t pos = 0;  /* A row we finish here ends past any input we were given */
 
   if (p == NULL)
     return -1;
 
+  skip = FIELD_SKIPPED(p);
+
 
   if (p->pstate == FIELD_BEGUN && p->quoted && p->options & CSV_STRICT && p->options & CSV_STRICT_FINI) {
     /* Current field is quoted, no end-quote was seen, and CSV_STRICT_FINI is set */
@@ -176,7 +199,8 @@ csv_fini(struct csv_parser *p, void (*cb1)(void *, size_t, void *), void (*cb2)(
 
   switch (p->pstate) {
     case FIELD_MIGHT_HAVE_ENDED:
-      p->entry_pos -= p->spaces + 1;  /* get rid of spaces and original quote */
+      if (!skip)
+        p->entry_pos -= p->spaces + 1;  /* get rid of spaces and original quote */
       /* Fall-through */
     case FIELD_NOT_BEGUN:
     case FIELD_BEGUN:
@@ -190,6 +214,7 @@ csv_fini(struct csv_parser *p, void (*cb1)(void *, size_t, void *), void (*cb2)(
 
   /* Reset parser */
   p->spaces = p->quoted = p->entry_pos = p->status = 0;
+  p->field = 0;
   p->pstate = ROW_NOT_BEGUN;
 
   return 0;
@@ -251,6 +276,17 @@ csv_set_free_func(struct csv_parser *p, void (*f)(void *))
   if (p && f) p->free_func = f;
 }
 
+void
+csv_set_skip(struct csv_parser *p, const unsigned char *keep, size_t len)
+{
+  /* Only keep fields with a non-zero entry in keep (or every field if keep
+     is NULL).  Fields we don't keep, including any past the end of keep, are
+     never copied, and are passed to the field callback as NULL with a length
+     of zero. */
+  p->keep = keep;
+  p->keep_len = len;
+}
+
 void
 csv_set_blk_size(struct csv_parser *p, size_t size)
 {
@@ -258,6 +294,14 @@ csv_set_blk_size(struct csv_parser *p, size_t size)
   if (p) p->blk_size = size;
 }
 
+void
+csv_set_entry_max(struct csv_parser *p, size_t size)
+{
+  /* Set the largest the entry buffer may grow to, zero for no limit.  A
+     field that needs more fails with CSV_ETOOBIG. */
+  if (p) p->entry_max = size;
+}
+
 size_t
 csv_get_buffer_size(struct csv_parser *p)
 {
@@ -270,15 +314,23 @@ csv_get_buffer_size(struct csv_parser *p)
 static int
 csv_increase_buffer(struct csv_parser *p)
 {
-  /* Increase the size of the entry buffer.  Attempt to increase size by 
-   * p->blk_size, if this is larger than SIZE_MAX try to increase current
-   * buffer size to SIZE_MAX.  If allocation fails, try to allocate halve 
-   * the size and try again until successful or increment size is zero.
+  /* Increase the size of the entry buffer.  Attempt to double its size
+   * (growing by at least p->blk_size), so long fields take a logarithmic
+   * number of reallocations rather than a linear one.  Growth stops at
+   * p->entry_max if it's set, and if this is larger than SIZE_MAX try to
+   * increase current buffer size to SIZE_MAX.  If allocation fails, try to
+   * allocate halve the size and try again until successful or increment
+   * size is zero.
    */
 
-  size_t to_add = p->blk_size;
+  size_t to_add = p->entry_size > p->blk_size ? p->entry_size : p->blk_size;
   void *vp;
 
+  if ( p->entry_max && p->entry_size >= p->entry_max )
+    to_add = 0;
+  else if ( p->entry_max && to_add > p->entry_max - p->entry_size )
+    to_add = p->entry_max - p->entry_size;
+
   if ( p->entry_size >= SIZE_MAX - to_add )
     to_add = SIZE_MAX - p->entry_size;
 
@@ -317,6 +369,7 @@ csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, s
   int pstate = p->pstate;
   size_t spaces = p->spaces;
   size_t entry_pos = p->entry_pos;
+  int skip = FIELD_SKIPPED(p);  /* Whether we're skipping the current field */
 
 
   if (!p->entry_buf && pos < len) {
@@ -405,10 +458,12 @@ csv_parse(struct csv_parser *p, const void *s, size_t len, void (*cb1)(void *, s
       case FIELD_MIGHT_HAVE_ENDED:
         /* This only happens when a quote character is encountered in a quoted field */
         if (c == delim) {  /* Comma */
-          entry_pos -= spaces + 1;  /* get rid of spaces and original quote */
+          if (!skip)
+            entry_pos -= spaces + 1;  /* get rid of spaces and original quote */
           SUBMIT_FIELD(p);
         } else if (is_term ? is_term(c) : c == CSV_CR || c == CSV_LF) {  /* Carriage Return or Line Feed */
-          entry_pos -= spaces + 1;  /* get rid of spaces and original quote */
+          if (!skip)
+            entry_pos -= spaces + 1;  /* get rid of spaces and original quote */
           SUBMIT_FIELD(p);
           SUBMIT_ROW(p, (unsigned char)c);
         } else if (is_space ? is_space(c) : c == CSV_SPACE || c == CSV_TAB) {  /* Space or Tab */
@@ -0,0 +1,295 @@
+/*
+ * outname.c
+ *
+ * Output file name templates, and the directories they put files in
+ */
+
+#include "outname.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/**
+ * The widest we'll pad a field, and how many directories we make room for
+ * at first
+ */
+#define OUTNAME_WIDTH_MAX 32
+#define DIRCACHE_SIZE     64
+
+static const char *g_field_names[OUTNAME_FIELDS] = {
+    [OUTNAME_PREFIX] = "prefix",
+    [OUTNAME_N]      = "n",
+    [OUTNAME_SHARD]  = "shard",
+    [OUTNAME_PART]   = "part",
+};
+
+// Add a part to our name
+static struct outname_tok *add_tok(struct outname *name, int type) {
+    struct outname_tok *tok;
+
+    if(!(tok = realloc(name->toks, (name->ntoks + 1) * sizeof *tok))) {
+        return NULL;
+    }
+    name->toks = tok;
+
+    tok = &name->toks[name->ntoks++];
+    memset(tok, 0, sizeof *tok);
+    tok->type = type;
+    name->uses |= 1u << type;
+
+    return tok;
+}
+
+// Parse a field, from just after its opening brace up to its closing one
+static int parse_field(struct outname *name, const char *p, size_t len, char *err, size_t err_len) {
+    const char *colon = memchr(p, ':', len);
+    size_t name_len = colon ? (size_t)(colon - p) : len;
+    struct outname_tok *tok;
+    const char *w;
+    int type;
+
+    for(type=OUTNAME_PREFIX;type<OUTNAME_FIELDS;type++) {
+        if(strlen(g_field_names[type]) == name_len && !memcmp(g_field_names[type], p, name_len)) {
+            break;
+        }
+    }
+    if(type == OUTNAME_FIELDS) {
+        snprintf(err, err_len, "Unknown field '{%.*s}'", (int)len, p);
+        return -1;
+    }
+
+    if(!(tok = add_tok(name, type))) {
+        snprintf(err, err_len, "Out of memory");
+        return -1;
+    }
+
+    // An optional width, zero padded if it starts with a zero
+    if(colon) {
+        for(w=colon+1;w<p+len;w++) {
+            if(*w < '0' || *w > '9') break;
+            tok->width = tok->width * 10 + (*w - '0');
+            if(tok->width > OUTNAME_WIDTH_MAX) break;
+        }
+        if(w == colon + 1 || w != p + len) {
+            snprintf(err, err_len, "Invalid width in '{%.*s}', must be a number up to %d (e.g. {n:08})",
+                     (int)len, p, OUTNAME_WIDTH_MAX);
+            return -1;
+        }
+        tok->zero = colon[1] == '0';
+    }
+
+    return 0;
+}
+
+int outname_compile(struct outname *name, const char *tmpl, char *err, size_t err_len) {
+    struct outname_tok *tok;
+    const char *p, *end;
+
+    memset(name, 0, sizeof(struct outname));
+
+    if(!*tmpl) {
+        snprintf(err, err_len, "Empty template");
+        return -1;
+    } else if(*tmpl == '/') {
+        snprintf(err, err_len, "Names are relative to our output path");
+        return -1;
+    } else if(!(name->tmpl = strdup(tmpl))) {
+        snprintf(err, err_len, "Out of memory");
+        return -1;
+    }
+
+    for(p=name->tmpl;*p;p=end) {
+        if(*p == '{') {
+            if(!(end = strchr(p, '}'))) {
+                snprintf(err, err_len, "Unterminated field at '%s'", p);
+                goto fail;
+            } else if(parse_field(name, p + 1, end - p - 1, err, err_len)) {
+                goto fail;
+            }
+            end++;
+        } else {
+            if(!(end = strchr(p, '{'))) {
+                end = p + strlen(p);
+            }
+            if(!(tok = add_tok(name, OUTNAME_LITERAL))) {
+                snprintf(err, err_len, "Out of memory");
+                goto fail;
+            }
+            tok->lit = p;
+            tok->len = end - p;
+        }
+    }
+
+    name->dirs = strchr(name->tmpl, '/') != NULL;
+
+    return 0;
+fail:
+    outname_free(name);
+    return -1;
+}
+
+int outname_format(const struct outname *name, char *buf, size_t len, const char *prefix,
+                   unsigned long n, unsigned long shard, unsigned int part)
+{
+    const struct outname_tok *tok;
+    unsigned long val;
+    size_t pos = 0;
+    unsigned int i;
+    int ret;
+
+    for(i=0;i<name->ntoks;i++) {
+        tok = &name->toks[i];
+
+        if(tok->type == OUTNAME_LITERAL) {
+            if(pos + tok->len >= len) {
+                return -1;
+            }
+            memcpy(buf + pos, tok->lit, tok->len);
+            pos += tok->len;
+            continue;
+        } else if(tok->type == OUTNAME_PREFIX) {
+            ret = snprintf(buf + pos, len - pos, "%*s", (int)tok->width, prefix);
+        } else {
+            val = tok->type == OUTNAME_N ? n : tok->type == OUTNAME_SHARD ? shard : part;
+            ret = snprintf(buf + pos, len - pos, tok->zero ? "%0*lu" : "%*lu", (int)tok->width, val);
+        }
+
+        if(ret < 0 || (size_t)ret >= len - pos) {
+            return -1;
+        }
+        pos += ret;
+    }
+
+    if(pos >= len) {
+        return -1;
+    }
+    buf[pos] = '\0';
+
+    return (int)pos;
+}
+
+void outname_free(struct outname *name) {
+    free(name->tmpl);
+    free(name->toks);
+    name->tmpl = NULL;
+    name->toks = NULL;
+    name->ntoks = 0;
+}
+
+void dircache_init(struct dircache *dc) {
+    memset(dc, 0, sizeof(struct dircache));
+    pthread_mutex_init(&dc->mutex, NULL);
+}
+
+// Hash a directory (64 bit FNV-1a)
+static uint64_t dir_hash(const char *s, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    while(len--) {
+        h ^= (unsigned char)*s++;
+        h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+// Put a directory in our table, which has room for it
+static void dir_put(struct dircache *dc, char *dir) {
+    size_t i = dir_hash(dir, strlen(dir)) & (dc->size - 1);
+
+    while(dc->slots[i]) {
+        i = (i + 1) & (dc->size - 1);
+    }
+    dc->slots[i] = dir;
+    dc->count++;
+}
+
+// Make room for another directory, keeping our table at most half full
+static int dir_grow(struct dircache *dc) {
+    char **old = dc->slots;
+    size_t i, size = dc->size;
+
+    if((dc->count + 1) * 2 <= dc->size) {
+        return 0;
+    }
+
+    if(!(dc->slots = calloc(size ? size * 2 : DIRCACHE_SIZE, sizeof *dc->slots))) {
+        dc->slots = old;
+        return ENOMEM;
+    }
+    dc->size = size ? size * 2 : DIRCACHE_SIZE;
+    dc->count = 0;
+
+    for(i=0;i<size;i++) {
+        if(old[i]) dir_put(dc, old[i]);
+    }
+    free(old);
+
+    return 0;
+}
+
+// Make a directory and its parents, like mkdir -p
+static int make_dirs(char *dir) {
+    char *p;
+
+    for(p=dir+1;*p;p++) {
+        if(*p != '/') continue;
+
+        *p = '\0';
+        if(mkdir(dir, 0777) != 0 && errno != EEXIST) {
+            *p = '/';
+            return errno;
+        }
+        *p = '/';
+    }
+
+    return mkdir(dir, 0777) != 0 && errno != EEXIST ? errno : 0;
+}
+
+int dircache_make(struct dircache *dc, const char *path) {
+    const char *slash = strrchr(path, '/');
+    size_t i, len;
+    char *dir;
+    int err;
+
+    if(!slash || slash == path) {
+        return 0;
+    }
+    len = slash - path;
+
+    pthread_mutex_lock(&dc->mutex);
+
+    // Most files go in a directory we've already made
+    for(i=dc->size ? dir_hash(path, len) & (dc->size - 1) : 0;dc->size && dc->slots[i];i=(i+1)&(dc->size-1)) {
+        if(!strncmp(dc->slots[i], path, len) && !dc->slots[i][len]) {
+            pthread_mutex_unlock(&dc->mutex);
+            return 0;
+        }
+    }
+
+    if(!(dir = strndup(path, len))) {
+        err = ENOMEM;
+    } else if(!(err = make_dirs(dir)) && !(err = dir_grow(dc))) {
+        dir_put(dc, dir);
+        dir = NULL;
+    }
+    free(dir);
+
+    pthread_mutex_unlock(&dc->mutex);
+
+    return err;
+}
+
+void dircache_free(struct dircache *dc) {
+    size_t i;
+
+    for(i=0;i<dc->size;i++) {
+        free(dc->slots[i]);
+    }
+    free(dc->slots);
+    pthread_mutex_destroy(&dc->mutex);
+}
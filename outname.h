@@ -0,0 +1,106 @@
+/*
+ * outname.h
+ *
+ * Output file names.  A template like
+ *
+ *     {prefix}/{shard:03}/{n:08}.csv
+ *
+ * is compiled once into a list of literals and fields, and filled in for
+ * each file we write.  Fields can be padded to a width, with zeros if the
+ * width starts with one.  Templates that put files in directories of their
+ * own come with a cache of the directories we've made, so we only make each
+ * one once, when the first file goes in it.
+ */
+
+#ifndef OUTNAME_H_
+#define OUTNAME_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+/**
+ * What goes in each part of a name
+ */
+#define OUTNAME_LITERAL 0 /* Text from our template */
+#define OUTNAME_PREFIX  1 /* Our input's name, or our --stdin prefix */
+#define OUTNAME_N       2 /* The file's number, from one */
+#define OUTNAME_SHARD   3 /* Which run of files it's in, from zero */
+#define OUTNAME_PART    4 /* Its partition, if we're partitioning */
+#define OUTNAME_FIELDS  5
+
+/**
+ * One part of a name
+ */
+struct outname_tok {
+    int type;
+
+    // Our text, if we're a literal
+    const char *lit;
+    size_t len;
+
+    // How wide we're padded, and whether we're padded with zeros
+    unsigned int width;
+    int zero;
+};
+
+/**
+ * A compiled template
+ */
+struct outname {
+    char *tmpl;
+    struct outname_tok *toks;
+    unsigned int ntoks;
+
+    // Which fields we use (by bit), and whether we put files in directories
+    unsigned int uses;
+    int dirs;
+};
+
+/**
+ * Directories we've made
+ */
+struct dircache {
+    char **slots;
+    size_t size, count;
+    pthread_mutex_t mutex;
+};
+
+/**
+ * Compile a template, returning non zero with a message in err if it's not
+ * valid
+ */
+int outname_compile(struct outname *name, const char *tmpl, char *err, size_t err_len);
+
+/**
+ * Whether a template uses a field
+ */
+#define OUTNAME_USES(name, field) ((name)->uses & (1u << (field)))
+
+/**
+ * Write a file's name to buf, returning its length, or -1 if it doesn't fit
+ */
+int outname_format(const struct outname *name, char *buf, size_t len, const char *prefix,
+                   unsigned long n, unsigned long shard, unsigned int part);
+
+/**
+ * Free a compiled template
+ */
+void outname_free(struct outname *name);
+
+/**
+ * Start a directory cache
+ */
+void dircache_init(struct dircache *dc);
+
+/**
+ * Make sure the directory a file goes in exists, making it (and any of its
+ * parents) if we haven't already.  Returns zero or an errno value.
+ */
+int dircache_make(struct dircache *dc, const char *path);
+
+/**
+ * Free a directory cache
+ */
+void dircache_free(struct dircache *dc);
+
+#endif /* OUTNAME_H_ */
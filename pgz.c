@@ -0,0 +1,338 @@
+/*
+ * pgz.c
+ *
+ * Parallel gzip compression
+ */
+
+#include "pgz.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/**
+ * A block of data to compress, and the result
+ */
+struct pgz_job {
+    // Data to compress and the dictionary to prime our compressor with
+    const unsigned char *in, *dict;
+    size_t len, dict_len;
+
+    // Compression level, and whether this finishes the stream
+    int level, finish;
+
+    // Compressed data, its length, and the CRC of our input
+    unsigned char *out;
+    size_t out_len;
+    uLong crc;
+
+    // Set when a worker is finished with us, non zero err if it failed
+    int done, err;
+
+    // Who to tell when we're done
+    pthread_mutex_t *mutex;
+    pthread_cond_t *cond;
+};
+
+/**
+ * Each thread keeps a compressor around between jobs
+ */
+struct pgz_tls {
+    z_stream strm;
+    int level;
+};
+
+static pthread_key_t pgz_key;
+static pthread_once_t pgz_once = PTHREAD_ONCE_INIT;
+
+// Free a thread's compressor when it exits
+static void pgz_tls_free(void *arg) {
+    struct pgz_tls *t = (struct pgz_tls*)arg;
+    deflateEnd(&t->strm);
+    free(t);
+}
+
+static void pgz_key_init(void) {
+    pthread_key_create(&pgz_key, pgz_tls_free);
+}
+
+// Get this thread's raw deflate compressor for a given level
+static z_stream *pgz_strm(int level) {
+    struct pgz_tls *t;
+
+    pthread_once(&pgz_once, pgz_key_init);
+
+    // Start over if the level changed
+    if((t = pthread_getspecific(pgz_key)) && t->level != level) {
+        pgz_tls_free(t);
+        t = NULL;
+    }
+
+    if(!t) {
+        if(!(t = calloc(1, sizeof(struct pgz_tls)))) {
+            return NULL;
+        }
+
+        // Negative window bits for raw deflate, we write our own wrapper
+        if(deflateInit2(&t->strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(t);
+            return NULL;
+        }
+
+        t->level = level;
+    }
+
+    pthread_setspecific(pgz_key, t);
+    return &t->strm;
+}
+
+// Compress a single block
+static int pgz_compress(struct pgz_job *job) {
+    z_stream *strm;
+    size_t bound;
+    int ret;
+
+    if(!(strm = pgz_strm(job->level))) {
+        return ENOMEM;
+    }
+
+    // Room for the worst case, plus our sync flush marker
+    bound = deflateBound(strm, job->len) + 16;
+    if(!(job->out = malloc(bound))) {
+        return ENOMEM;
+    }
+
+    // Prime with the data before us, so we compress as well as one stream would
+    if(job->dict_len) {
+        deflateSetDictionary(strm, job->dict, job->dict_len);
+    }
+
+    strm->next_in = (Bytef*)job->in;
+    strm->avail_in = job->len;
+    strm->next_out = job->out;
+    strm->avail_out = bound;
+
+    // Every block but the last ends byte aligned, so they can be concatenated
+    ret = deflate(strm, job->finish ? Z_FINISH : Z_SYNC_FLUSH);
+    if(ret != (job->finish ? Z_STREAM_END : Z_OK) || strm->avail_in) {
+        deflateReset(strm);
+        return EIO;
+    }
+
+    job->out_len = bound - strm->avail_out;
+    job->crc = crc32(0L, job->in, job->len);
+
+    deflateReset(strm);
+    return 0;
+}
+
+// Compression thread
+static void *pgz_worker(void *arg) {
+    struct pgz_pool *pool = (struct pgz_pool*)arg;
+    struct pgz_job *job;
+    uint64_t start;
+    void *ptr;
+    int err;
+
+    stats_thread(STATS_COMPRESS);
+
+    while(!fq_get(&pool->jobs, &ptr)) {
+        job = (struct pgz_job*)ptr;
+
+        start = stats_start();
+        err = pgz_compress(job);
+        stats_stop(STAT_COMPRESS_NS, start);
+        stats_add(STAT_BLOCKS, 1);
+
+        // Let whoever is waiting on this block know it's ready
+        pthread_mutex_lock(job->mutex);
+        job->err = err;
+        job->done = 1;
+        pthread_cond_broadcast(job->cond);
+        pthread_mutex_unlock(job->mutex);
+    }
+
+    return NULL;
+}
+
+// Start our compression threads
+int pgz_init(struct pgz_pool *pool, unsigned int thread_count) {
+    unsigned int i;
+    int ret;
+
+    memset(pool, 0, sizeof(struct pgz_pool));
+
+    if(!thread_count) {
+        return 0;
+    }
+
+    // Enough of a backlog to keep every thread busy
+    if((ret = fq_init(&pool->jobs, thread_count * 4))) {
+        return ret;
+    }
+
+    if(!(pool->threads = calloc(thread_count, sizeof *pool->threads))) {
+        fq_free(&pool->jobs);
+        return ENOMEM;
+    }
+
+    for(i=0;i<thread_count;i++,pool->thread_count++) {
+        if((ret = pthread_create(&pool->threads[i], NULL, pgz_worker, (void*)pool))) {
+            pgz_free(pool);
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+// Stop our compression threads
+void pgz_free(struct pgz_pool *pool) {
+    unsigned int i;
+
+    if(!pool->threads) {
+        return;
+    }
+
+    fq_fin(&pool->jobs);
+    for(i=0;i<pool->thread_count;i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    fq_free(&pool->jobs);
+    free(pool->threads);
+    memset(pool, 0, sizeof(struct pgz_pool));
+}
+
+// Start a stream
+void pgz_stream_init(struct pgz_stream *s, int level) {
+    s->level = level;
+    s->started = 0;
+    s->crc = crc32(0L, Z_NULL, 0);
+    s->len = 0;
+    s->dict_len = 0;
+}
+
+// Write a 32 bit little endian value
+static void pgz_put32(unsigned char *p, uLong v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+// Compress the next part of our stream
+int pgz_write(struct pgz_pool *pool, struct pgz_stream *s, FILE *fp,
+              const char *data, size_t len, int last)
+{
+    const unsigned char *in = (const unsigned char*)data;
+    unsigned char hdr[10] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3 };
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    struct pgz_job *jobs;
+    size_t i, count, keep;
+    int ret = 0;
+
+    // Write our gzip header the first time through
+    if(!s->started) {
+        hdr[8] = s->level == Z_BEST_COMPRESSION ? 2 : (s->level == Z_BEST_SPEED ? 4 : 0);
+        if(fwrite(hdr, 1, sizeof(hdr), fp) != sizeof(hdr)) {
+            return EIO;
+        }
+        s->started = 1;
+    }
+
+    // How many blocks we've got.  Even with no data, finishing needs one.
+    count = len ? (len + PGZ_BLOCK_SIZE - 1) / PGZ_BLOCK_SIZE : (last ? 1 : 0);
+    if(!count) {
+        return 0;
+    }
+
+    if(!(jobs = calloc(count, sizeof *jobs))) {
+        return ENOMEM;
+    }
+
+    for(i=0;i<count;i++) {
+        jobs[i].in = in + i * PGZ_BLOCK_SIZE;
+        jobs[i].len = len - i * PGZ_BLOCK_SIZE < PGZ_BLOCK_SIZE ? len - i * PGZ_BLOCK_SIZE : PGZ_BLOCK_SIZE;
+        jobs[i].level = s->level;
+        jobs[i].finish = last && i == count - 1;
+        jobs[i].mutex = &mutex;
+        jobs[i].cond = &cond;
+
+        // Our first block continues on from our last call, the rest from
+        // the block before them
+        if(i == 0) {
+            jobs[i].dict = s->dict;
+            jobs[i].dict_len = s->dict_len;
+        } else {
+            jobs[i].dict = jobs[i].in - PGZ_DICT_SIZE;
+            jobs[i].dict_len = PGZ_DICT_SIZE;
+        }
+
+        // Hand everything but our first block to our threads
+        if(i && pool->thread_count) {
+            fq_add(&pool->jobs, &jobs[i]);
+        }
+    }
+
+    // We do the first block ourselves, and any others if we have no threads
+    for(i=0;i<count;i++) {
+        if(i == 0 || !pool->thread_count) {
+            jobs[i].err = pgz_compress(&jobs[i]);
+            jobs[i].done = 1;
+        }
+    }
+
+    // Write out our blocks in order as they finish
+    for(i=0;i<count;i++) {
+        pthread_mutex_lock(&mutex);
+        while(!jobs[i].done) {
+            pthread_cond_wait(&cond, &mutex);
+        }
+        pthread_mutex_unlock(&mutex);
+
+        if(!ret && jobs[i].err) {
+            ret = jobs[i].err;
+        }
+        if(!ret && fwrite(jobs[i].out, 1, jobs[i].out_len, fp) != jobs[i].out_len) {
+            ret = EIO;
+        }
+
+        // Fold this block's CRC into our stream's
+        s->crc = crc32_combine(s->crc, jobs[i].crc, jobs[i].len);
+        s->len += jobs[i].len;
+
+        free(jobs[i].out);
+    }
+
+    free(jobs);
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&cond);
+
+    if(ret) {
+        return ret;
+    }
+
+    // Keep the last 32KB we've seen for our next call
+    if(len >= PGZ_DICT_SIZE) {
+        memcpy(s->dict, in + len - PGZ_DICT_SIZE, PGZ_DICT_SIZE);
+        s->dict_len = PGZ_DICT_SIZE;
+    } else if(len) {
+        keep = s->dict_len + len > PGZ_DICT_SIZE ? PGZ_DICT_SIZE - len : s->dict_len;
+        memmove(s->dict, s->dict + s->dict_len - keep, keep);
+        memcpy(s->dict + keep, in, len);
+        s->dict_len = keep + len;
+    }
+
+    // Finish with our trailer
+    if(last) {
+        pgz_put32(hdr, s->crc);
+        pgz_put32(hdr + 4, (uLong)(s->len & 0xffffffffUL));
+        if(fwrite(hdr, 1, 8, fp) != 8) {
+            return EIO;
+        }
+    }
+
+    return 0;
+}
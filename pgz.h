@@ -0,0 +1,100 @@
+/*
+ * pgz.h
+ *
+ * Parallel gzip compression, in the style of pigz.  Data is cut into
+ * blocks which are compressed independently as raw deflate streams on a
+ * pool of threads, each primed with the 32KB of data before it as a
+ * dictionary.  Every block but the last ends on a byte boundary with a
+ * sync flush, so they can simply be concatenated, and the CRC of the whole
+ * stream is put together from each block's CRC with crc32_combine().  The
+ * result is a single, ordinary, gzip member.
+ */
+
+#ifndef PGZ_H_
+#define PGZ_H_
+
+#include <stdio.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "queue.h"
+
+/**
+ * How much data we compress per job, and how much of the data before it we
+ * use as a dictionary (deflate's maximum window)
+ */
+#define PGZ_BLOCK_SIZE (128*1024)
+#define PGZ_DICT_SIZE  32768
+
+/**
+ * Maximum number of compression threads
+ */
+#define PGZ_THREADS_MAX 64
+
+/**
+ * Our pool of compression threads
+ */
+struct pgz_pool {
+    /**
+     * Jobs waiting to be compressed
+     */
+    fqueue jobs;
+
+    /**
+     * Our threads
+     */
+    pthread_t *threads;
+    unsigned int thread_count;
+};
+
+/**
+ * State for one gzip stream, which may be written across several calls
+ */
+struct pgz_stream {
+    /**
+     * Compression level
+     */
+    int level;
+
+    /**
+     * Whether we've written our header yet
+     */
+    int started;
+
+    /**
+     * CRC and length of everything we've compressed so far
+     */
+    uLong crc;
+    size_t len;
+
+    /**
+     * The last 32KB of data we were given, to prime the next call with
+     */
+    unsigned char dict[PGZ_DICT_SIZE];
+    size_t dict_len;
+};
+
+/**
+ * Start thread_count compression threads
+ */
+int pgz_init(struct pgz_pool *pool, unsigned int thread_count);
+
+/**
+ * Stop our compression threads
+ */
+void pgz_free(struct pgz_pool *pool);
+
+/**
+ * Initialize a stream with a compression level
+ */
+void pgz_stream_init(struct pgz_stream *s, int level);
+
+/**
+ * Compress len bytes of data as the next part of our stream, writing the
+ * result to fp.  The gzip header is written with the first call, and if
+ * last is set the stream is finished and the trailer written.  Returns zero
+ * on success.
+ */
+int pgz_write(struct pgz_pool *pool, struct pgz_stream *s, FILE *fp,
+              const char *data, size_t len, int last);
+
+#endif /* PGZ_H_ */
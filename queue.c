@@ -1,141 +1,266 @@
 #include "queue.h"
+#include "stats.h"
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#else
+#include <sched.h>
+#endif
+
+/**
+ * Each slot alternates between being a producer's turn and a consumer's
+ * turn, once per lap around the ring.  Keeping the two apart (rather than
+ * using the position itself) lets us have a ring of any size, even one.
+ */
+#define FQ_ADD_TURN(q, pos) (((pos) / (q)->max_len) * 2)
+#define FQ_GET_TURN(q, pos) (((pos) / (q)->max_len) * 2 + 1)
+
+// Sleep until our futex word changes from val
+static void fq_wait(uint32_t *addr, uint32_t val) {
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+    if(__atomic_load_n(addr, __ATOMIC_SEQ_CST) == val) sched_yield();
+#endif
+}
+
+// Wake up to count threads waiting on our futex word
+static void fq_wake(uint32_t *addr, int count) {
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+#endif
+}
+
+// Bump a futex word, and wake a waiter if there is one
+static void fq_signal(uint32_t *addr, uint32_t *waiters) {
+    __atomic_add_fetch(addr, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(waiters, __ATOMIC_SEQ_CST)) {
+        fq_wake(addr, 1);
+    }
+}
 
 // Initialize our background queue with a maximum size
 int fq_init(fqueue *queue, size_t max_len) {
-    // Assume success
-    int ret = 0;
-    
+    size_t i;
+
     // NULL sanity check
-    if(queue == NULL) {
+    if(queue == NULL || max_len == 0) {
         return EINVAL;
     }
 
     // Null everything out
     memset(queue, 0, sizeof(fqueue));
 
-    // Set our maximum length
-    queue->max_len = max_len;
-
-    // Empty queue condition
-    if((ret = pthread_cond_init(&queue->empty, NULL))) {
-        return ret;
+    // Allocate our slots
+    if(!(queue->cells = malloc(max_len * sizeof(struct queue_cell)))) {
+        return ENOMEM;
     }
 
-    // Full queue condition
-    if((ret = pthread_cond_init(&queue->full, NULL))) {
-        pthread_cond_destroy(&queue->empty);
-        return ret;
-    }
+    // Set our maximum length
+    queue->max_len = max_len;
 
-    // Exclusive access mutex
-    if((ret = pthread_mutex_init(&queue->mutex, NULL))) {
-        pthread_cond_destroy(&queue->empty);
-        pthread_cond_destroy(&queue->full);
-        return ret;
+    // Each slot starts out ready for a producer on its first lap
+    for(i=0;i<max_len;i++) {
+        queue->cells[i].seq = 0;
+        queue->cells[i].data = NULL;
     }
 
     // Success!
     return 0;
 }
 
-int fq_add(fqueue *queue, void *data) {
-    struct queue_item *item;
+// Try to add an item without blocking, returning zero if we're full
+static int fq_try_add(fqueue *queue, void *data) {
+    size_t pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED), seq;
+    struct queue_cell *cell;
+    intptr_t dif;
+
+    while(1) {
+        cell = &queue->cells[pos % queue->max_len];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        dif = (intptr_t)seq - (intptr_t)FQ_ADD_TURN(queue, pos);
+
+        if(dif == 0) {
+            // The slot is ours if nobody beats us to it
+            if(__atomic_compare_exchange_n(&queue->head, &pos, pos + 1, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        } else if(dif < 0) {
+            // A consumer hasn't taken the item a lap behind us, so we're full
+            return 0;
+        } else {
+            // Another producer took it, try again
+            pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+        }
+    }
 
-    // Attain exclusive access
-    pthread_mutex_lock(&queue->mutex);
+    // Publish our item to consumers
+    cell->data = data;
+    __atomic_store_n(&cell->seq, FQ_GET_TURN(queue, pos), __ATOMIC_RELEASE);
 
-    // Block if our queue is full
-    while(queue->len == queue->max_len) {
-        pthread_cond_wait(&queue->full, &queue->mutex);
-    }
+    return 1;
+}
 
-    // Allocate our item, set members
-    item = malloc(sizeof(struct queue_item));
-
-    // Set members
-    item->data = data;
-    item->next = NULL;
-    
-    if(queue->last == NULL) {
-        queue->last = item;
-        queue->first = item;
-    } else {
-        queue->last->next = item;
-        queue->last = item;
+// Try to get an item without blocking, returning zero if we're empty
+static int fq_try_get(fqueue *queue, void **data) {
+    size_t pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED), seq;
+    struct queue_cell *cell;
+    intptr_t dif;
+
+    while(1) {
+        cell = &queue->cells[pos % queue->max_len];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        dif = (intptr_t)seq - (intptr_t)FQ_GET_TURN(queue, pos);
+
+        if(dif == 0) {
+            if(__atomic_compare_exchange_n(&queue->tail, &pos, pos + 1, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        } else if(dif < 0) {
+            // Nothing has been published here yet
+            return 0;
+        } else {
+            pos = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+        }
     }
 
-    // If our list was empty, let anyone waiting for an item continue
-    if(queue->len == 0) {
-        pthread_cond_broadcast(&queue->empty);
+    // Take our item, and hand the slot to the producer one lap ahead
+    *data = cell->data;
+    __atomic_store_n(&cell->seq, FQ_ADD_TURN(queue, pos + queue->max_len), __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+int fq_add(fqueue *queue, void *data) {
+    uint64_t start = 0;
+    uint32_t val;
+
+    // Block while our queue is full
+    while(!fq_try_add(queue, data)) {
+        if(!start && (start = stats_start())) {
+            stats_add(STAT_FULL_WAITS, 1);
+        }
+
+        val = __atomic_load_n(&queue->not_full, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&queue->full_waiters, 1, __ATOMIC_SEQ_CST);
+
+        // Check again now that any consumer will see we're waiting
+        if(fq_try_add(queue, data)) {
+            __atomic_sub_fetch(&queue->full_waiters, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+
+        fq_wait(&queue->not_full, val);
+        __atomic_sub_fetch(&queue->full_waiters, 1, __ATOMIC_SEQ_CST);
     }
 
-    // Increase our queue length
-    queue->len++;
+    // Count how long we were blocked, if we were
+    if(start) {
+        stats_stop(STAT_FULL_NS, start);
+    }
 
-    // Release Mutex
-    pthread_mutex_unlock(&queue->mutex);
+    // Let one waiting consumer know there's something here
+    fq_signal(&queue->not_empty, &queue->empty_waiters);
 
     // Success
     return 0;
 }
 
 int fq_get(fqueue *queue, void **data) {
+    uint64_t start = 0;
+    uint32_t val;
+
     // Argument sanity check
     if(queue == NULL) {
         return EINVAL;
     }
 
-    // Gain exclusive access
-    pthread_mutex_lock(&queue->mutex);
-
-    // Block if our queue is empty
-    while(queue->first == NULL) {
-        pthread_cond_wait(&queue->empty, &queue->mutex);
+    // Block while our queue is empty, unless we're done
+    while(!fq_try_get(queue, data)) {
+        if(!start && (start = stats_start())) {
+            stats_add(STAT_EMPTY_WAITS, 1);
+        }
+
+        val = __atomic_load_n(&queue->not_empty, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&queue->empty_waiters, 1, __ATOMIC_SEQ_CST);
+
+        if(fq_try_get(queue, data)) {
+            __atomic_sub_fetch(&queue->empty_waiters, 1, __ATOMIC_SEQ_CST);
+            break;
+        }
+
+        // Everything was added before we were flagged done, so if we're
+        // empty now, we're finished
+        if(__atomic_load_n(&queue->done, __ATOMIC_SEQ_CST)) {
+            __atomic_sub_fetch(&queue->empty_waiters, 1, __ATOMIC_SEQ_CST);
+            if(start) {
+                stats_stop(STAT_EMPTY_NS, start);
+            }
+            *data = NULL;
+            return 1;
+        }
+
+        fq_wait(&queue->not_empty, val);
+        __atomic_sub_fetch(&queue->empty_waiters, 1, __ATOMIC_SEQ_CST);
     }
 
-    // If our data is not NULL it's an actual element, otherwise
-    // it's a fake one that lets our consumers finish.
-    if(queue->first->data) {
-    	// Extract data
-    	*data = queue->first->data;
-
-    	// Grab a copy of this element
-    	struct queue_item *tmp = queue->first;
+    if(start) {
+        stats_stop(STAT_EMPTY_NS, start);
+    }
 
-    	// Move our first pointer
-    	queue->first = queue->first->next;
-    	queue->len--;
+    // Let one waiting producer know there's room
+    fq_signal(&queue->not_full, &queue->full_waiters);
 
-    	// Free our removed element
-    	free(tmp);
+    // Return zero if we're sending non null data
+    return *data == NULL;
+}
 
-    	// If we are out of elements, update last as well
-    	if(queue->first == NULL) {
-    		queue->last = NULL;
-    		queue->len = 0;
-    	}
-    } else {
+int fq_poll(fqueue *queue, void **data) {
+    if(!fq_try_get(queue, data)) {
         *data = NULL;
-    }
 
-    // Unlock anyone waiting to add to the thread
-    if(queue->len == queue->max_len - 1) {
-    	pthread_cond_broadcast(&queue->full);
+        // Everything was added before we were flagged done, so check once
+        // more if we are
+        if(!__atomic_load_n(&queue->done, __ATOMIC_SEQ_CST)) {
+            return EAGAIN;
+        } else if(!fq_try_get(queue, data)) {
+            return 1;
+        }
     }
 
-    // Release exclusive access
-    pthread_mutex_unlock(&queue->mutex);
+    // Let one waiting producer know there's room
+    fq_signal(&queue->not_full, &queue->full_waiters);
 
-    // Return zero if we're sending non null data
     return *data == NULL;
 }
 
 // Flag our queue as being done so consumers can exit
 int fq_fin(fqueue *queue) {
-    return fq_add(queue, NULL);
+    __atomic_store_n(&queue->done, 1, __ATOMIC_SEQ_CST);
+
+    // Everyone needs to see this one
+    __atomic_add_fetch(&queue->not_empty, 1, __ATOMIC_SEQ_CST);
+    fq_wake(&queue->not_empty, INT_MAX);
+
+    return 0;
+}
+
+// How many items are in our queue, give or take any being added or taken
+size_t fq_len(fqueue *queue) {
+    size_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+
+    return head > tail ? head - tail : 0;
 }
 
 // Free our list
@@ -145,25 +270,8 @@ int fq_free(fqueue *queue) {
         return EINVAL;
     }
 
-    // Gain exclusive access
-    pthread_mutex_lock(&queue->mutex);
-
-    struct queue_item *cur = queue->first, *next;
-
-    // Free all of our items
-    while(cur) {
-        next = cur->next;
-        free(cur);
-        cur = next;
-    }
-
-    // Relese exclusive access, destroy mutex
-    pthread_mutex_unlock(&queue->mutex);
-    pthread_mutex_destroy(&queue->mutex);
-
-    // Destroy conditions
-    pthread_cond_destroy(&queue->empty);
-    pthread_cond_destroy(&queue->full);
+    free(queue->cells);
+    queue->cells = NULL;
 
     // Success!
     return 0;
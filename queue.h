@@ -8,67 +8,70 @@
 #ifndef QUEUE_H_
 #define QUEUE_H_
 
-#include <pthread.h>
-#include <semaphore.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /**
- * A very simple linked list based item for our queue.  The data can 
- * be whatever the user wants, but it must be freed by the caller
+ * Cache line size, so our producer and consumer positions don't share one
  */
-struct queue_item {
+#define FQ_CACHE_LINE 64
+
+/**
+ * A slot in our ring.  The sequence number tells producers and consumers
+ * whose turn it is to use the slot.
+ */
+struct queue_cell {
     /**
-     * The data in our item
+     * Whose turn it is to use this slot, see FQ_ADD_TURN/FQ_GET_TURN
      */
-    void *data;
-     
+    size_t seq;
+
     /**
-     * Next item in our queue
+     * The data in our slot.  It can be whatever the user wants, but it
+     * must be freed by the caller
      */
-    struct queue_item *next; 
+    void *data;
 };
 
 /**
- * Thread-safe blocking queue with a maximum number of items.  The
- * queue will block when empty or when the maximum number of items
- * is reached.  When you're done with the queue just call fq_fin()
- * to add a NULL element which will unblock the queue such that
- * consumers can finish and we can join worker threads
+ * Thread-safe, lock-free, bounded ring buffer with a fixed number of
+ * slots.  Adding blocks when the queue is full and getting blocks when
+ * it's empty, sleeping on a futex rather than spinning.  When you're done
+ * with the queue just call fq_fin() which will flag the queue as done such
+ * that consumers can finish (once it's empty) and we can join worker threads
  */
 typedef struct _fqueue {
 	/**
-     * Our items
+     * Our slots
      */
-    struct queue_item *items;
-
-    /**
-      * Fist, last items
-     */
-    struct queue_item *first, *last;
+    struct queue_cell *cells;
 
     /**
      * Maximum length of queue
     */
     unsigned int max_len;
 
-    /** 
-     * Length of our queue
-     */
-	unsigned int len;
-
     /**
-     * Mutex, for exclusive access to our queue
-    */
-    pthread_mutex_t mutex;
+     * Set by fq_fin() once nothing else will be added
+     */
+    int done;
 
     /**
-     * Condition variable to block when we're full
+     * Next position to add to, and next position to get from.  These are
+     * on their own cache lines as producers and consumers hammer them.
      */
-    pthread_cond_t full;
+    size_t head __attribute__((aligned(FQ_CACHE_LINE)));
+    size_t tail __attribute__((aligned(FQ_CACHE_LINE)));
 
     /**
-     * Condition variable to block when we're empty
+     * Futex words we bump whenever an item is added (not_empty) or taken
+     * (not_full), and how many threads are waiting on each, so we only
+     * make a wake up system call when someone is actually asleep
      */
-    pthread_cond_t empty;
+    uint32_t not_empty __attribute__((aligned(FQ_CACHE_LINE)));
+    uint32_t empty_waiters;
+    uint32_t not_full __attribute__((aligned(FQ_CACHE_LINE)));
+    uint32_t full_waiters;
 } fqueue;
 
 /**
@@ -87,10 +90,21 @@ int fq_add(fqueue *queue, void *data);
 int fq_get(fqueue *queue, void **data);
 
 /**
- * Add a null element which will flag our queue as done
+ * Get something from the queue without blocking.  Returns EAGAIN if it's
+ * empty, or non zero (like fq_get) if it's empty and done.
+ */
+int fq_poll(fqueue *queue, void **data);
+
+/**
+ * Flag our queue as done, so consumers finish once it's empty
  */
 int fq_fin(fqueue *queue);
 
+/**
+ * Approximate number of items in the queue
+ */
+size_t fq_len(fqueue *queue);
+
 /**
  * Free a queue
  */
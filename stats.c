@@ -0,0 +1,206 @@
+/*
+ * stats.c
+ *
+ * Per thread counters and timers
+ */
+
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+/**
+ * How we show each counter
+ */
+#define KIND_COUNT 0
+#define KIND_BYTES 1
+#define KIND_NS    2
+
+static const struct {
+    const char *name;
+    int kind;
+} g_stat_info[STAT_COUNT] = {
+    [STAT_IN_BYTES]    = { "in_bytes",    KIND_BYTES },
+    [STAT_ROWS]        = { "rows",        KIND_COUNT },
+    [STAT_INPUT_NS]    = { "input",       KIND_NS },
+    [STAT_READ_NS]     = { "read",        KIND_NS },
+    [STAT_PARSE_NS]    = { "parse",       KIND_NS },
+    [STAT_FLUSHES]     = { "flushes",     KIND_COUNT },
+    [STAT_FLUSH_NS]    = { "flush",       KIND_NS },
+    [STAT_FULL_WAITS]  = { "full_waits",  KIND_COUNT },
+    [STAT_FULL_NS]     = { "full_wait",   KIND_NS },
+    [STAT_EMPTY_WAITS] = { "empty_waits", KIND_COUNT },
+    [STAT_EMPTY_NS]    = { "empty_wait",  KIND_NS },
+    [STAT_BLOCKS]      = { "blocks",      KIND_COUNT },
+    [STAT_FILES]       = { "files",       KIND_COUNT },
+    [STAT_WRITE_IN]    = { "write_in",    KIND_BYTES },
+    [STAT_WRITE_OUT]   = { "write_out",   KIND_BYTES },
+    [STAT_WRITE_NS]    = { "write",       KIND_NS },
+    [STAT_COMPRESS_NS] = { "compress",    KIND_NS },
+    [STAT_TRIGGERS]    = { "triggers",    KIND_COUNT },
+    [STAT_SPAWN_NS]    = { "spawn",       KIND_NS },
+    [STAT_SLOT_NS]     = { "slot_wait",   KIND_NS },
+    [STAT_TRIGGER_NS]  = { "trigger",     KIND_NS },
+};
+
+static const char *g_role_names[STATS_ROLES] = {
+    "parse", "io", "compress", "trigger"
+};
+
+__thread struct stats *t_stats;
+
+/**
+ * Every thread's counters, when we started, and whether we're counting
+ */
+static struct stats *g_stats;
+static pthread_mutex_t g_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t g_stats_start;
+static int g_stats_on;
+
+void stats_enable(void) {
+    g_stats_start = stats_ns();
+    __atomic_store_n(&g_stats_on, 1, __ATOMIC_RELEASE);
+}
+
+int stats_enabled(void) {
+    return __atomic_load_n(&g_stats_on, __ATOMIC_ACQUIRE);
+}
+
+int stats_thread(int role) {
+    struct stats *s;
+
+    if(!stats_enabled() || t_stats) {
+        return 0;
+    }
+
+    if(posix_memalign((void**)&s, 64, sizeof(struct stats))) {
+        return ENOMEM;
+    }
+    memset(s, 0, sizeof(struct stats));
+    s->role = role;
+
+    pthread_mutex_lock(&g_stats_mutex);
+    s->next = g_stats;
+    g_stats = s;
+    pthread_mutex_unlock(&g_stats_mutex);
+
+    t_stats = s;
+    return 0;
+}
+
+unsigned int stats_sum(int role, uint64_t *sum) {
+    unsigned int i, n = 0;
+    struct stats *s;
+
+    memset(sum, 0, STAT_COUNT * sizeof *sum);
+
+    pthread_mutex_lock(&g_stats_mutex);
+    for(s=g_stats;s;s=s->next) {
+        if(role >= 0 && s->role != role) continue;
+
+        for(i=0;i<STAT_COUNT;i++) {
+            sum[i] += __atomic_load_n(&s->c[i], __ATOMIC_RELAXED);
+        }
+        n++;
+    }
+    pthread_mutex_unlock(&g_stats_mutex);
+
+    return n;
+}
+
+double stats_elapsed(void) {
+    return (stats_ns() - g_stats_start) / 1e9;
+}
+
+// Write a byte count the way a person would want to read it
+static void print_bytes(FILE *fp, uint64_t n) {
+    if(n >= 1024ULL*1024*1024) {
+        fprintf(fp, "%.2f GB", n / (1024.0*1024*1024));
+    } else if(n >= 1024*1024) {
+        fprintf(fp, "%.2f MB", n / (1024.0*1024));
+    } else if(n >= 1024) {
+        fprintf(fp, "%.2f KB", n / 1024.0);
+    } else {
+        fprintf(fp, "%llu B", (unsigned long long)n);
+    }
+}
+
+void stats_print(FILE *fp) {
+    uint64_t sum[STAT_COUNT];
+    double secs = stats_elapsed();
+    unsigned int n, i;
+    int role;
+
+    fprintf(fp, "csv-split stats: %.3fs\n", secs);
+
+    for(role=0;role<STATS_ROLES;role++) {
+        if(!(n = stats_sum(role, sum))) continue;
+
+        fprintf(fp, "  %-8s %2u thread%s ", g_role_names[role], n, n == 1 ? ": " : "s:");
+        for(i=0;i<STAT_COUNT;i++) {
+            if(!sum[i]) continue;
+
+            fprintf(fp, " %s ", g_stat_info[i].name);
+            switch(g_stat_info[i].kind) {
+                case KIND_BYTES:
+                    print_bytes(fp, sum[i]);
+                    break;
+                case KIND_NS:
+                    fprintf(fp, "%.3fs", sum[i] / 1e9);
+                    break;
+                default:
+                    fprintf(fp, "%llu", (unsigned long long)sum[i]);
+                    break;
+            }
+        }
+        fprintf(fp, "\n");
+
+        // Throughput is what we most often want to know, over the time it
+        // took us to get through our input
+        if(role == STATS_PARSE && sum[STAT_INPUT_NS]) {
+            secs = sum[STAT_INPUT_NS] / 1e9;
+            fprintf(fp, "  %-8s %.1f MB/s, %.0f rows/s\n", "", sum[STAT_IN_BYTES] / 1048576.0 / secs,
+                    sum[STAT_ROWS] / secs);
+        }
+    }
+}
+
+void stats_print_json(FILE *fp) {
+    uint64_t sum[STAT_COUNT];
+    unsigned int n, i;
+    int role, first = 1;
+
+    fprintf(fp, "{\"seconds\": %.6f, \"roles\": {", stats_elapsed());
+
+    for(role=0;role<STATS_ROLES;role++) {
+        if(!(n = stats_sum(role, sum))) continue;
+
+        fprintf(fp, "%s\n  \"%s\": {\"threads\": %u", first ? "" : ",", g_role_names[role], n);
+        for(i=0;i<STAT_COUNT;i++) {
+            if(g_stat_info[i].kind == KIND_NS) {
+                fprintf(fp, ", \"%s_ns\": %llu", g_stat_info[i].name, (unsigned long long)sum[i]);
+            } else {
+                fprintf(fp, ", \"%s\": %llu", g_stat_info[i].name, (unsigned long long)sum[i]);
+            }
+        }
+        fprintf(fp, "}");
+        first = 0;
+    }
+
+    fprintf(fp, "\n}}\n");
+}
+
+void stats_free(void) {
+    struct stats *s, *next;
+
+    pthread_mutex_lock(&g_stats_mutex);
+    for(s=g_stats;s;s=next) {
+        next = s->next;
+        free(s);
+    }
+    g_stats = NULL;
+    pthread_mutex_unlock(&g_stats_mutex);
+
+    t_stats = NULL;
+}
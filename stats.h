@@ -0,0 +1,143 @@
+/*
+ * stats.h
+ *
+ * Counters and timers for where a run spends its time.  Each thread that
+ * wants to be counted registers a block of counters of its own, on a cache
+ * line of its own, and only ever writes to that, so counting costs a branch
+ * and a store (and reading the clock for timers).  Blocks are only added up
+ * when we report, or every so often for our progress line.  Until stats are
+ * enabled no thread has a block and nothing is counted.
+ */
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * What each thread is doing, so we can add up the threads doing the same
+ * thing
+ */
+#define STATS_PARSE    0
+#define STATS_IO       1
+#define STATS_COMPRESS 2
+#define STATS_TRIGGER  3
+#define STATS_ROLES    4
+
+/**
+ * Our counters
+ */
+#define STAT_IN_BYTES    0  /* Input bytes parsed */
+#define STAT_ROWS        1  /* Rows parsed */
+#define STAT_INPUT_NS    2  /* Time from opening our input to finishing with it */
+#define STAT_READ_NS     3  /* Time reading (or waiting on decompressed) input */
+#define STAT_PARSE_NS    4  /* Time parsing, including handing off blocks */
+#define STAT_FLUSHES     5  /* Files finished by our parser */
+#define STAT_FLUSH_NS    6  /* Time finishing them, including queueing */
+#define STAT_FULL_WAITS  7  /* Times we blocked adding to a full queue */
+#define STAT_FULL_NS     8  /* Time spent blocked on full queues */
+#define STAT_EMPTY_WAITS 9  /* Times we blocked getting from an empty queue */
+#define STAT_EMPTY_NS    10 /* Time spent blocked on empty queues */
+#define STAT_BLOCKS      11 /* Blocks written */
+#define STAT_FILES       12 /* Files written */
+#define STAT_WRITE_IN    13 /* Bytes handed to us to write */
+#define STAT_WRITE_OUT   14 /* Bytes written, after compression */
+#define STAT_WRITE_NS    15 /* Time writing uncompressed data */
+#define STAT_COMPRESS_NS 16 /* Time compressing (and writing compressed data) */
+#define STAT_TRIGGERS    17 /* Triggers started */
+#define STAT_SPAWN_NS    18 /* Time starting triggers */
+#define STAT_SLOT_NS     19 /* Time waiting for a free trigger slot */
+#define STAT_TRIGGER_NS  20 /* Time triggers ran for, start to exit */
+#define STAT_COUNT       21
+
+/**
+ * One thread's counters
+ */
+struct stats {
+    uint64_t c[STAT_COUNT];
+    int role;
+    struct stats *next;
+} __attribute__((aligned(64)));
+
+/**
+ * The calling thread's counters, NULL if we're not counting
+ */
+extern __thread struct stats *t_stats;
+
+/**
+ * Start counting.  Only threads registered after this are counted.
+ */
+void stats_enable(void);
+
+/**
+ * Whether we're counting
+ */
+int stats_enabled(void);
+
+/**
+ * Give the calling thread a block of counters for a role, if we're
+ * counting.  Returns non zero if we couldn't.
+ */
+int stats_thread(int role);
+
+/**
+ * Nanoseconds on our monotonic clock
+ */
+static inline uint64_t stats_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Add to one of our counters.  Only we write to it, but it can be read at any
+ * time, so we store it in one piece.
+ */
+static inline void stats_add(int stat, uint64_t n) {
+    if(t_stats) {
+        __atomic_store_n(&t_stats->c[stat], t_stats->c[stat] + n, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Start a timer, returning zero if we're not counting
+ */
+static inline uint64_t stats_start(void) {
+    return t_stats ? stats_ns() : 0;
+}
+
+/**
+ * Add the time since stats_start() to one of our counters
+ */
+static inline void stats_stop(int stat, uint64_t start) {
+    if(t_stats) {
+        stats_add(stat, stats_ns() - start);
+    }
+}
+
+/**
+ * Add up every thread's counters for a role (or every role, if role is
+ * negative), returning how many threads there were
+ */
+unsigned int stats_sum(int role, uint64_t *sum);
+
+/**
+ * How long since we started counting, in seconds
+ */
+double stats_elapsed(void);
+
+/**
+ * Write out everything we've counted, as text or JSON
+ */
+void stats_print(FILE *fp);
+void stats_print_json(FILE *fp);
+
+/**
+ * Free every thread's counters
+ */
+void stats_free(void);
+
+#endif /* STATS_H_ */
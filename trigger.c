@@ -0,0 +1,295 @@
+/*
+ * trigger.c
+ *
+ * Trigger command executor
+ */
+
+#include "trigger.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+/**
+ * A trigger waiting to be started
+ */
+struct trigger_job {
+    const char *cmd;
+    char *path;
+    unsigned long row_count;
+};
+
+/**
+ * Build the environment for a trigger: ours, with our payload variables
+ * replaced.  Only the array and our two variables are allocated.
+ */
+static char **trigger_env(const char *path, unsigned long row_count) {
+    size_t i, n = 0, plen = strlen(ENV_PAYLOAD_VAR), rlen = strlen(ENV_ROWCOUNT_VAR);
+    char **env, **ep;
+
+    for(ep=environ;*ep;ep++) n++;
+
+    if(!(env = malloc((n + 3) * sizeof *env))) {
+        return NULL;
+    }
+
+    // Skip any values for our variables that we inherited
+    for(i=0,ep=environ;*ep;ep++) {
+        if((!strncmp(*ep, ENV_PAYLOAD_VAR, plen) && (*ep)[plen] == '=') ||
+           (!strncmp(*ep, ENV_ROWCOUNT_VAR, rlen) && (*ep)[rlen] == '='))
+        {
+            continue;
+        }
+        env[i++] = *ep;
+    }
+
+    if(!(env[i] = malloc(plen + strlen(path) + 2)) || !(env[i+1] = malloc(rlen + 24))) {
+        free(env[i]);
+        free(env);
+        return NULL;
+    }
+
+    sprintf(env[i], "%s=%s", ENV_PAYLOAD_VAR, path);
+    sprintf(env[i+1], "%s=%lu", ENV_ROWCOUNT_VAR, row_count);
+    env[i+2] = NULL;
+
+    return env;
+}
+
+// Free an environment from trigger_env
+static void trigger_env_free(char **env) {
+    char **ep;
+
+    // Our own variables are the last two
+    for(ep=env;*ep;ep++);
+    free(ep[-1]);
+    free(ep[-2]);
+    free(env);
+}
+
+/**
+ * Start a trigger through /bin/sh.  posix_spawn doesn't copy our address
+ * space the way fork() would, which matters when we're holding large
+ * buffers.
+ */
+static int trigger_spawn(const char *cmd, const char *path, unsigned long row_count, pid_t *pid) {
+    char *argv[] = { "sh", "-c", (char*)cmd, NULL };
+    char **env;
+    int ret;
+
+    if(!(env = trigger_env(path, row_count))) {
+        return ENOMEM;
+    }
+
+    ret = posix_spawn(pid, "/bin/sh", NULL, NULL, argv, env);
+    trigger_env_free(env);
+
+    return ret;
+}
+
+// Report a trigger that didn't succeed
+static int trigger_status(const char *cmd, const char *path, int status) {
+    if(WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        return 0;
+    }
+
+    if(WIFSIGNALED(status)) {
+        fprintf(stderr, "Error:  Trigger \"%s\" for '%s' killed by signal %d\n", cmd, path,
+                WTERMSIG(status));
+    } else {
+        fprintf(stderr, "Error:  Trigger \"%s\" for '%s' exited with status %d\n", cmd, path,
+                WEXITSTATUS(status));
+    }
+
+    return 1;
+}
+
+/**
+ * Start triggers as they're queued, whenever we're under our limit
+ */
+static void *trigger_launcher(void *arg) {
+    struct trigger_pool *pool = (struct trigger_pool*)arg;
+    struct trigger_job *job;
+    void *ptr;
+    uint64_t start;
+    pid_t pid;
+    unsigned int i;
+    int ret;
+
+    stats_thread(STATS_TRIGGER);
+
+    while(!fq_get(&pool->jobs, &ptr)) {
+        job = (struct trigger_job*)ptr;
+
+        // Wait for a free slot.  We start it and hand it to our reaper while
+        // holding our lock, so the reaper can't collect it before it's ours.
+        start = stats_start();
+        pthread_mutex_lock(&pool->mutex);
+        while(pool->running >= pool->max_running) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+        stats_stop(STAT_SLOT_NS, start);
+
+        start = stats_start();
+        ret = trigger_spawn(job->cmd, job->path, job->row_count, &pid);
+        stats_stop(STAT_SPAWN_NS, start);
+        stats_add(STAT_TRIGGERS, 1);
+
+        if(ret) {
+            fprintf(stderr, "Error:  Couldn't execute trigger \"%s\": %s\n", job->cmd, strerror(ret));
+            pool->failed++;
+            free(job->path);
+        } else {
+            for(i=0;pool->procs[i].pid;i++);
+            pool->procs[i].pid = pid;
+            pool->procs[i].cmd = job->cmd;
+            pool->procs[i].path = job->path;
+            pool->procs[i].started = start;
+            pool->running++;
+            pthread_cond_broadcast(&pool->cond);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        free(job);
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->launched = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return NULL;
+}
+
+/**
+ * Collect exit statuses as our triggers finish
+ */
+static void *trigger_reaper(void *arg) {
+    struct trigger_pool *pool = (struct trigger_pool*)arg;
+    unsigned int i;
+    pid_t pid;
+    int status;
+
+    stats_thread(STATS_TRIGGER);
+
+    while(1) {
+        // Sleep until something is running, or we're finished
+        pthread_mutex_lock(&pool->mutex);
+        while(!pool->running && !pool->launched) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+        if(!pool->running) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        // Our triggers are the only children we have
+        if((pid = waitpid(-1, &status, 0)) < 0) {
+            if(errno == EINTR) continue;
+            break;
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+        for(i=0;i<pool->max_running && pool->procs[i].pid != pid;i++);
+        if(i < pool->max_running) {
+            pool->failed += trigger_status(pool->procs[i].cmd, pool->procs[i].path, status);
+            if(pool->procs[i].started) {
+                stats_stop(STAT_TRIGGER_NS, pool->procs[i].started);
+            }
+            free(pool->procs[i].path);
+            pool->procs[i].pid = 0;
+            pool->procs[i].path = NULL;
+            pool->running--;
+            pthread_cond_broadcast(&pool->cond);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return NULL;
+}
+
+int trigger_init(struct trigger_pool *pool, unsigned int max_running) {
+    int ret;
+
+    memset(pool, 0, sizeof(struct trigger_pool));
+
+    if((ret = fq_init(&pool->jobs, TRIGGER_QUEUE_SIZE))) {
+        return ret;
+    }
+
+    if(!(pool->procs = calloc(max_running, sizeof *pool->procs))) {
+        fq_free(&pool->jobs);
+        return ENOMEM;
+    }
+
+    pool->max_running = max_running;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    if((ret = pthread_create(&pool->launcher, NULL, trigger_launcher, (void*)pool))) {
+        free(pool->procs);
+        fq_free(&pool->jobs);
+        return ret;
+    }
+
+    if((ret = pthread_create(&pool->reaper, NULL, trigger_reaper, (void*)pool))) {
+        fq_fin(&pool->jobs);
+        pthread_join(pool->launcher, NULL);
+        free(pool->procs);
+        fq_free(&pool->jobs);
+        return ret;
+    }
+
+    return 0;
+}
+
+int trigger_add(struct trigger_pool *pool, const char *cmd, const char *path,
+                unsigned long row_count)
+{
+    struct trigger_job *job;
+
+    if(!(job = malloc(sizeof(struct trigger_job))) || !(job->path = strdup(path))) {
+        free(job);
+        return ENOMEM;
+    }
+
+    job->cmd = cmd;
+    job->row_count = row_count;
+
+    return fq_add(&pool->jobs, job);
+}
+
+unsigned long trigger_free(struct trigger_pool *pool) {
+    fq_fin(&pool->jobs);
+    pthread_join(pool->launcher, NULL);
+    pthread_join(pool->reaper, NULL);
+
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->procs);
+    fq_free(&pool->jobs);
+
+    return pool->failed;
+}
+
+int trigger_exec(const char *cmd, const char *path, unsigned long row_count) {
+    pid_t pid;
+    int ret, status;
+
+    if((ret = trigger_spawn(cmd, path, row_count, &pid))) {
+        fprintf(stderr, "Error:  Couldn't execute trigger \"%s\": %s\n", cmd, strerror(ret));
+        return ret;
+    }
+
+    while(waitpid(pid, &status, 0) < 0) {
+        if(errno != EINTR) return errno;
+    }
+
+    return trigger_status(cmd, path, status);
+}
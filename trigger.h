@@ -0,0 +1,101 @@
+/*
+ * trigger.h
+ *
+ * Running our trigger command for each finished file.  Commands are run
+ * with posix_spawn() through /bin/sh, each with its own environment rather
+ * than by changing ours, by a launcher thread which keeps at most a fixed
+ * number running at once.  A second thread collects their exit statuses, so
+ * whoever asked for a trigger never waits on it.
+ */
+
+#ifndef TRIGGER_H_
+#define TRIGGER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "queue.h"
+
+/**
+ * Environment variables that are set for our trigger command
+ */
+#define ENV_PAYLOAD_VAR  "CSV_PAYLOAD_FILE"
+#define ENV_ROWCOUNT_VAR "CSV_ROWCOUNT"
+
+/**
+ * Limits on how many triggers we run at once, and how many can be waiting
+ * to start
+ */
+#define TRIGGER_JOBS_MIN   1
+#define TRIGGER_JOBS_MAX   256
+#define TRIGGER_QUEUE_SIZE 64
+
+/**
+ * A trigger we've started
+ */
+struct trigger_proc {
+    pid_t pid;
+    const char *cmd;
+    char *path;
+
+    // When we started it, if we're counting
+    uint64_t started;
+};
+
+/**
+ * Our trigger executor
+ */
+struct trigger_pool {
+    /**
+     * Triggers waiting to be started
+     */
+    fqueue jobs;
+
+    /**
+     * What's running, at most max_running of them
+     */
+    struct trigger_proc *procs;
+    unsigned int running, max_running;
+
+    /**
+     * Set once our launcher has started everything it's going to
+     */
+    int launched;
+
+    /**
+     * How many triggers failed to start or exited unsuccessfully
+     */
+    unsigned long failed;
+
+    /**
+     * Our launcher and reaper threads
+     */
+    pthread_t launcher, reaper;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+/**
+ * Start our executor, running at most max_running triggers at once
+ */
+int trigger_init(struct trigger_pool *pool, unsigned int max_running);
+
+/**
+ * Queue a trigger for a finished file.  This only blocks if too many are
+ * already waiting to start.
+ */
+int trigger_add(struct trigger_pool *pool, const char *cmd, const char *path,
+                unsigned long row_count);
+
+/**
+ * Wait for every queued trigger to start and finish, and stop our threads.
+ * Returns how many failed.
+ */
+unsigned long trigger_free(struct trigger_pool *pool);
+
+/**
+ * Run a trigger and wait for it to finish, returning non zero on failure
+ */
+int trigger_exec(const char *cmd, const char *path, unsigned long row_count);
+
+#endif /* TRIGGER_H_ */
@@ -0,0 +1,205 @@
+/*
+ * uring.c
+ *
+ * Raw system call io_uring
+ */
+
+#include "uring.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if !defined(__NR_io_uring_setup) || !defined(__NR_io_uring_enter)
+#define URING_UNSUPPORTED
+#endif
+
+// The kernel updates our ring heads and tails, so we access them atomically
+#define LOAD_ACQUIRE(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+int uring_init(struct uring *ring, unsigned int entries) {
+#ifdef URING_UNSUPPORTED
+    (void)ring;
+    (void)entries;
+    return ENOSYS;
+#else
+    struct io_uring_params p;
+    int err;
+
+    memset(ring, 0, sizeof(struct uring));
+    memset(&p, 0, sizeof(p));
+
+    if((ring->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+        return errno;
+    }
+
+    ring->entries = p.sq_entries;
+
+    // Map our submission ring, its entries, and our completion ring
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+
+    if(ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        err = errno;
+        uring_free(ring);
+        return err;
+    }
+
+    ring->sq_head  = (unsigned int*)((char*)ring->sq_ring + p.sq_off.head);
+    ring->sq_tail  = (unsigned int*)((char*)ring->sq_ring + p.sq_off.tail);
+    ring->sq_mask  = (unsigned int*)((char*)ring->sq_ring + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int*)((char*)ring->sq_ring + p.sq_off.array);
+    ring->cq_head  = (unsigned int*)((char*)ring->cq_ring + p.cq_off.head);
+    ring->cq_tail  = (unsigned int*)((char*)ring->cq_ring + p.cq_off.tail);
+    ring->cq_mask  = (unsigned int*)((char*)ring->cq_ring + p.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe*)((char*)ring->cq_ring + p.cq_off.cqes);
+
+    ring->sqe_tail = *ring->sq_tail;
+
+    return 0;
+#endif
+}
+
+// Enter the kernel, submitting and/or waiting
+static int uring_enter(struct uring *ring, unsigned int submit, unsigned int wait) {
+#ifdef URING_UNSUPPORTED
+    (void)ring;
+    (void)submit;
+    (void)wait;
+    return ENOSYS;
+#else
+    int ret;
+
+    while((ret = syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+                         wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) < 0)
+    {
+        if(errno != EINTR) {
+            return errno;
+        }
+    }
+
+    return 0;
+#endif
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *ring) {
+    struct io_uring_sqe *sqe;
+    unsigned int idx;
+
+    // If we're full, submit what we have.  The kernel takes it all at once.
+    if(ring->sqe_tail - LOAD_ACQUIRE(ring->sq_head) >= ring->entries && uring_submit(ring, 0)) {
+        return NULL;
+    }
+
+    idx = ring->sqe_tail & *ring->sq_mask;
+    sqe = &ring->sqes[idx];
+    ring->sq_array[idx] = idx;
+    ring->sqe_tail++;
+
+    memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+int uring_submit(struct uring *ring, unsigned int wait) {
+    // Anything the kernel hasn't consumed yet, including any it stopped
+    // short of last time
+    unsigned int submit = ring->sqe_tail - LOAD_ACQUIRE(ring->sq_head);
+
+    STORE_RELEASE(ring->sq_tail, ring->sqe_tail);
+
+    if(!submit && !wait) {
+        return 0;
+    }
+
+    return uring_enter(ring, submit, wait);
+}
+
+struct io_uring_cqe *uring_cqe(struct uring *ring) {
+    unsigned int head = *ring->cq_head;
+
+    if(head == LOAD_ACQUIRE(ring->cq_tail)) {
+        return NULL;
+    }
+
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_seen(struct uring *ring) {
+    STORE_RELEASE(ring->cq_head, *ring->cq_head + 1);
+}
+
+void uring_prep_openat(struct io_uring_sqe *sqe, const char *path, int flags, mode_t mode, uint64_t data) {
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t)(uintptr_t)path;
+    sqe->len = mode;
+    sqe->open_flags = flags;
+    sqe->user_data = data;
+}
+
+void uring_prep_write(struct io_uring_sqe *sqe, int fd, const void *buf, size_t len, off_t off, uint64_t data) {
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = data;
+}
+
+void uring_prep_close(struct io_uring_sqe *sqe, int fd, uint64_t data) {
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = data;
+}
+
+void uring_prep_fsync(struct io_uring_sqe *sqe, int fd, uint64_t data) {
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = fd;
+    sqe->user_data = data;
+}
+
+void uring_prep_sync_file_range(struct io_uring_sqe *sqe, int fd, off_t off, size_t len, unsigned int flags,
+                                uint64_t data)
+{
+    sqe->opcode = IORING_OP_SYNC_FILE_RANGE;
+    sqe->fd = fd;
+    sqe->off = off;
+    sqe->len = len;
+    sqe->sync_range_flags = flags;
+    sqe->user_data = data;
+}
+
+void uring_prep_fadvise(struct io_uring_sqe *sqe, int fd, off_t off, size_t len, int advice, uint64_t data) {
+    sqe->opcode = IORING_OP_FADVISE;
+    sqe->fd = fd;
+    sqe->off = off;
+    sqe->len = len;
+    sqe->fadvise_advice = advice;
+    sqe->user_data = data;
+}
+
+void uring_free(struct uring *ring) {
+    if(ring->sq_ring && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if(ring->cq_ring && ring->cq_ring != MAP_FAILED) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if(ring->sqes && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+
+    close(ring->fd);
+}
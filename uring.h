@@ -0,0 +1,93 @@
+/*
+ * uring.h
+ *
+ * A minimal io_uring, set up and driven with raw system calls so we don't
+ * need liburing.  One thread prepares operations in our submission ring,
+ * hands them all to the kernel with a single system call, and collects
+ * their results from our completion ring as they finish.
+ */
+
+#ifndef URING_H_
+#define URING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+/**
+ * How many operations we can have waiting to be submitted
+ */
+#define URING_ENTRIES 256
+
+/**
+ * Our ring
+ */
+struct uring {
+    int fd;
+
+    /**
+     * Our submission ring: the kernel's head and tail, its mask and index
+     * array, our entries, and the tail we've filled up to (which we only
+     * publish when we submit)
+     */
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int sqe_tail;
+
+    /**
+     * Our completion ring
+     */
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /**
+     * Our mappings
+     */
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned int entries;
+};
+
+/**
+ * Set up a ring.  Returns zero on success, or an errno value if io_uring
+ * isn't available.
+ */
+int uring_init(struct uring *ring, unsigned int entries);
+
+/**
+ * Get an empty submission entry, submitting what we have to make room if
+ * we need to.  Returns NULL on failure.
+ */
+struct io_uring_sqe *uring_sqe(struct uring *ring);
+
+/**
+ * Submit everything we've prepared, and wait for at least wait completions.
+ * Returns zero on success or an errno value.
+ */
+int uring_submit(struct uring *ring, unsigned int wait);
+
+/**
+ * Get the next completion, or NULL if there isn't one.  Call uring_seen()
+ * once done with it.
+ */
+struct io_uring_cqe *uring_cqe(struct uring *ring);
+void uring_seen(struct uring *ring);
+
+/**
+ * Prepare operations
+ */
+void uring_prep_openat(struct io_uring_sqe *sqe, const char *path, int flags, mode_t mode, uint64_t data);
+void uring_prep_write(struct io_uring_sqe *sqe, int fd, const void *buf, size_t len, off_t off, uint64_t data);
+void uring_prep_close(struct io_uring_sqe *sqe, int fd, uint64_t data);
+void uring_prep_fsync(struct io_uring_sqe *sqe, int fd, uint64_t data);
+void uring_prep_sync_file_range(struct io_uring_sqe *sqe, int fd, off_t off, size_t len, unsigned int flags,
+                                uint64_t data);
+void uring_prep_fadvise(struct io_uring_sqe *sqe, int fd, off_t off, size_t len, int advice, uint64_t data);
+
+/**
+ * Tear down our ring
+ */
+void uring_free(struct uring *ring);
+
+#endif /* URING_H_ */